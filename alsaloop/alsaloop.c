@@ -32,40 +32,81 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
 #include "alsaloop.h"
 
 struct loopback_thread {
 	int threaded;
+	int id;				/* requested thread number */
 	pthread_t thread;
 	int exitcode;
+	int finished;
 	struct loopback **loopbacks;
 	int loopbacks_count;
 	snd_output_t *output;
+	/* configuration reload (loops to stop and to start) */
+	pthread_mutex_t reload_lock;
+	volatile int reload;
+	struct loopback **reload_remove;
+	int reload_remove_count;
+	struct loopback **reload_add;
+	int reload_add_count;
+	int pinned;			/* the affinity is set by a job */
+	cpu_set_t cpus;			/* affinity before the pinning */
+	/* timer driven wakeups */
+	int timer_fd;			/* -1 = poll driven wakeups */
+	long timer_period;		/* in usec, 0 = disarmed */
+	struct timespec timer_next;	/* next expected expiration */
+	int timer_late;			/* consecutive late wakeups */
 };
 
+#define TIMER_LATE_LIMIT	16	/* fallback to poll wakeups */
+
 int quit = 0;
 int verbose = 0;
 int workarounds = 0;
 int daemonize = 0;
 int use_syslog = 0;
+int use_metrics = 0;
+char *arg_metrics_path = NULL;
+char *arg_config_file = NULL;
+volatile int reload_pending = 0;
 struct loopback **loopbacks = NULL;
 int loopbacks_count = 0;
 char **my_argv = NULL;
 int my_argc = 0;
-struct loopback_thread *threads;
+struct loopback_thread **threads;
 int threads_count = 0;
 pthread_t main_job;
 int arg_default_xrun = 0;
 int arg_default_wake = 0;
+int unique_threads = 0;
+static int unique_threads_base = 0;
+static int reloading = 0;
+
+/* read by the main thread on the configuration reload */
+static void loop_stopped(struct loopback *loop, int stopped)
+{
+	__atomic_store_n(&loop->stopped, stopped, __ATOMIC_RELEASE);
+}
 
 static void my_exit(struct loopback_thread *thread, int exitcode)
 {
 	int i;
 
-	for (i = 0; i < thread->loopbacks_count; i++)
+	for (i = 0; i < thread->loopbacks_count; i++) {
 		pcmjob_done(thread->loopbacks[i]);
+		loop_stopped(thread->loopbacks[i], 1);
+	}
+	if (thread->timer_fd >= 0)
+		close(thread->timer_fd);
+	thread->timer_fd = -1;
 	if (thread->threaded) {
 		thread->exitcode = exitcode;
+		thread->finished = 1;
 		pthread_exit(0);
 	}
 	exit(exitcode);
@@ -126,6 +167,9 @@ static int create_loopback(struct loopback **_handle,
 	handle->loop_limit = ~0ULL;
 	handle->output = output;
 	handle->state = output;
+	handle->mix_gain = MIX_GAIN_UNITY;
+	handle->sched_policy = -1;
+	handle->sched_priority = -1;
 #ifdef USE_SAMPLERATE
 	handle->src_enable = 1;
 	handle->src_converter_type = SRC_SINC_BEST_QUALITY;
@@ -134,28 +178,192 @@ static int create_loopback(struct loopback **_handle,
 	return 0;
 }
 
-static void set_loop_time(struct loopback *loop, unsigned long loop_time)
+static void free_loopback_handle(struct loopback_handle *lhandle)
+{
+	if (lhandle->ctl_notify)
+		snd_ctl_elem_value_free(lhandle->ctl_notify);
+	if (lhandle->ctl_active)
+		snd_ctl_elem_value_free(lhandle->ctl_active);
+	if (lhandle->ctl_format)
+		snd_ctl_elem_value_free(lhandle->ctl_format);
+	if (lhandle->ctl_rate)
+		snd_ctl_elem_value_free(lhandle->ctl_rate);
+	if (lhandle->ctl_channels)
+		snd_ctl_elem_value_free(lhandle->ctl_channels);
+	free(lhandle->device);
+	free(lhandle->ctldev);
+	free(lhandle->id);
+	free(lhandle);
+}
+
+static void free_mixer_control(struct loopback_control *control)
 {
-	loop->loop_time = loop_time;
-	loop->loop_limit = loop->capt->rate * loop_time;
+	if (control->id)
+		snd_ctl_elem_id_free(control->id);
+	if (control->info)
+		snd_ctl_elem_info_free(control->info);
+	if (control->value)
+		snd_ctl_elem_value_free(control->value);
 }
 
-static void setscheduler(void)
+/* the loopback must be finished using pcmjob_done() */
+static void free_loopback(struct loopback *loop)
+{
+	struct loopback_mixer *mixer;
+	struct loopback_ossmixer *ossmixer;
+
+	while ((mixer = loop->controls) != NULL) {
+		loop->controls = mixer->next;
+		free_mixer_control(&mixer->src);
+		free_mixer_control(&mixer->dst);
+		free(mixer);
+	}
+	while ((ossmixer = loop->oss_controls) != NULL) {
+		loop->oss_controls = ossmixer->next;
+		free((char *)ossmixer->alsa_id);
+		free((char *)ossmixer->oss_id);
+		free(ossmixer);
+	}
+	route_free(loop->route);
+	free(loop->trace_file);
+	free_loopback_handle(loop->play);
+	free_loopback_handle(loop->capt);
+	free(loop->cfg);
+	free(loop);
+}
+
+static const char *sched_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "FIFO";
+	case SCHED_OTHER:
+		return "Other";
+	default:
+		return "Round Robin";
+	}
+}
+
+/* POLICY[:PRIORITY], the policy is rr, fifo or other */
+static int parse_sched(const char *str, int *policy, int *priority)
+{
+	const char *s = strchr(str, ':');
+	size_t len = s ? (size_t)(s - str) : strlen(str);
+	char *end;
+	long prio = -1;
+
+	if (len == 2 && strncasecmp(str, "rr", len) == 0)
+		*policy = SCHED_RR;
+	else if (len == 4 && strncasecmp(str, "fifo", len) == 0)
+		*policy = SCHED_FIFO;
+	else if (len == 5 && strncasecmp(str, "other", len) == 0)
+		*policy = SCHED_OTHER;
+	else
+		return -EINVAL;
+	if (s) {
+		prio = strtol(s + 1, &end, 10);
+		if (end == s + 1 || *end ||
+		    prio < sched_get_priority_min(*policy) ||
+		    prio > sched_get_priority_max(*policy))
+			return -EINVAL;
+	}
+	*priority = prio;
+	return 0;
+}
+
+/* comma separated cpu numbers or ranges, for example "2,4-7" */
+static int parse_cpus(const char *str, cpu_set_t *cpus)
+{
+	const char *s = str;
+	char *end;
+	unsigned long cpu, last;
+
+	CPU_ZERO(cpus);
+	while (*s) {
+		cpu = strtoul(s, &end, 10);
+		if (end == s)
+			return -EINVAL;
+		last = cpu;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if (end == s || last < cpu)
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; cpu <= last; cpu++)
+			CPU_SET(cpu, cpus);
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -EINVAL;
+	}
+	return CPU_COUNT(cpus) > 0 ? 0 : -EINVAL;
+}
+
+/*
+ * The scheduling and the affinity of the thread are taken from the
+ * first job in the thread which sets them. The default is the maximal
+ * Round Robin priority without the affinity. The original affinity is
+ * restored when no job in the thread sets it after a reload.
+ */
+static void setscheduler(struct loopback_thread *thread)
 {
 	struct sched_param sched_param;
+	struct loopback *loop, *sched = NULL, *pin = NULL;
+	int i, policy = SCHED_RR;
 
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		loop = thread->loopbacks[i];
+		if (loop->sched_policy >= 0) {
+			if (sched == NULL)
+				sched = loop;
+			else if (sched->sched_policy != loop->sched_policy ||
+				 sched->sched_priority != loop->sched_priority)
+				logit(LOG_WARNING, "Scheduling of loop %s -> %s ignored (thread %i uses the first setting).\n", loop->capt->device, loop->play->device, thread->id);
+		}
+		if (loop->affinity) {
+			if (pin == NULL)
+				pin = loop;
+			else if (!CPU_EQUAL(&pin->cpus, &loop->cpus))
+				logit(LOG_WARNING, "Affinity of loop %s -> %s ignored (thread %i uses the first setting).\n", loop->capt->device, loop->play->device, thread->id);
+		}
+	}
+	if (pin && !thread->pinned) {
+		if (sched_getaffinity(0, sizeof(thread->cpus), &thread->cpus) < 0) {
+			CPU_ZERO(&thread->cpus);
+			for (i = 0; i < CPU_SETSIZE; i++)
+				CPU_SET(i, &thread->cpus);
+		}
+		thread->pinned = 1;
+	}
+	if (pin) {
+		if (sched_setaffinity(0, sizeof(pin->cpus), &pin->cpus) < 0)
+			logit(LOG_WARNING, "Unable to set the thread %i affinity: %s\n", thread->id, strerror(errno));
+	} else if (thread->pinned) {
+		if (sched_setaffinity(0, sizeof(thread->cpus), &thread->cpus) < 0)
+			logit(LOG_WARNING, "Unable to reset the thread %i affinity: %s\n", thread->id, strerror(errno));
+		thread->pinned = 0;
+	}
 	if (sched_getparam(0, &sched_param) < 0) {
 		logit(LOG_WARNING, "Scheduler getparam failed.\n");
 		return;
 	}
-	sched_param.sched_priority = sched_get_priority_max(SCHED_RR);
-	if (!sched_setscheduler(0, SCHED_RR, &sched_param)) {
+	if (sched)
+		policy = sched->sched_policy;
+	if (sched && sched->sched_priority >= 0)
+		sched_param.sched_priority = sched->sched_priority;
+	else
+		sched_param.sched_priority = sched_get_priority_max(policy);
+	if (!sched_setscheduler(0, policy, &sched_param)) {
 		if (verbose)
-			logit(LOG_WARNING, "Scheduler set to Round Robin with priority %i\n", sched_param.sched_priority);
+			logit(LOG_WARNING, "Scheduler set to %s with priority %i\n", sched_name(policy), sched_param.sched_priority);
 		return;
 	}
 	if (verbose)
-		logit(LOG_INFO, "!!!Scheduler set to Round Robin with priority %i FAILED!\n", sched_param.sched_priority);
+		logit(LOG_INFO, "!!!Scheduler set to %s with priority %i FAILED!\n", sched_name(policy), sched_param.sched_priority);
 }
 
 void help(void)
@@ -165,6 +373,7 @@ void help(void)
 "Usage: alsaloop [OPTION]...\n\n"
 "-h,--help      help\n"
 "-g,--config    configuration file (one line = one job specified)\n"
+"               (SIGHUP reloads the configuration file)\n"
 "-d,--daemonize daemonize the main process and use syslog for errors\n"
 "-P,--pdevice   playback device\n"
 "-C,--cdevice   capture device\n"
@@ -174,6 +383,7 @@ void help(void)
 "-t,--tlatency  requested latency in usec (1/1000000sec)\n"
 "-f,--format    sample format\n"
 "-c,--channels  channels\n"
+"-R,--route     channel routing SRC:DST[=GAIN],... (playback channels = max DST + 1)\n"
 "-r,--rate      rate\n"
 "-n,--resample  resample in alsa-lib\n"
 "-A,--samplerate use converter (0=sincbest,1=sincmedium,2=sincfastest,\n"
@@ -182,10 +392,23 @@ void help(void)
 "-E,--period    period size in frames\n"
 "-s,--seconds   duration of loop in seconds\n"
 "-b,--nblock    non-block mode (very early process wakeup)\n"
+"-M,--mmap      use mmap access (zero-copy transfer when possible)\n"
+"-x,--mix       mix the playback with other -x jobs in the same thread\n"
+"-G,--gain      mixing gain in dB (for -x)\n"
+"-j,--fanout    share the capture with other -j jobs in the same thread\n"
+"-u,--split     read the capture in a separate thread\n"
+"-N,--endpoint  play to the shared memory ring in given file (replaces -P)\n"
+"-L,--measure   measure the round-trip latency every <ms> (replaces audio)\n"
+"-i,--timer     wake the thread by a timer (one pass for all jobs)\n"
+"-q,--conceal   conceal the xrun gaps (repeat and crossfade, S16/S32 only)\n"
+"-o,--trace     record the sync trace to given file (see alsaloop-replay)\n"
 "-S,--sync      sync mode(0=none,1=simple,2=captshift,3=playshift,4=samplerate,\n"
 "                         5=auto)\n"
 "-a,--slave     stream parameters slave mode (0=auto, 1=on, 2=off)\n"
+"-D,--drift     drift estimator (0=average, 1=pi)\n"
 "-T,--thread    thread number (-1 = create unique)\n"
+"-Q,--sched     thread scheduling POLICY[:PRIORITY] (rr, fifo or other)\n"
+"-K,--cpus      thread cpu affinity (for example 2,4-7)\n"
 "-m,--mixer	redirect mixer, argument is:\n"
 "		    SRC_SLAVE_ID(PLAYBACK)[@DST_SLAVE_ID(CAPTURE)]\n"
 "-O,--ossmixer	rescan and redirect oss mixer, argument is:\n"
@@ -196,6 +419,7 @@ void help(void)
 "-U,--xrun      xrun profiling\n"
 "-W,--wake      process wake timeout in ms\n"
 "-z,--syslog    use syslog for errors\n"
+"-k,--metrics   serve live metrics on given unix socket path\n"
 );
 	printf("\nRecognized sample formats are:");
 	for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -226,15 +450,19 @@ static long timediff(struct timeval t1, struct timeval t2)
 	return (t1.tv_sec * 1000000) + l;
 }
 
-static void add_loop(struct loopback *loop)
+static int add_loop(struct loopback *loop)
 {
-	loopbacks = realloc(loopbacks, (loopbacks_count + 1) *
+	struct loopback **loops;
+
+	loops = realloc(loopbacks, (loopbacks_count + 1) *
 						sizeof(struct loopback *));
-	if (loopbacks == NULL) {
+	if (loops == NULL) {
 		logit(LOG_CRIT, "No enough memory\n");
-		exit(EXIT_FAILURE);
+		return -ENOMEM;
 	}
+	loopbacks = loops;
 	loopbacks[loopbacks_count++] = loop;
+	return 0;
 }
 
 static int init_mixer_control(struct loopback_control *control,
@@ -361,23 +589,38 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"tlatency", 1, NULL, 't'},
 		{"format", 1, NULL, 'f'},
 		{"channels", 1, NULL, 'c'},
+		{"route", 1, NULL, 'R'},
 		{"rate", 1, NULL, 'r'},
 		{"buffer", 1, NULL, 'B'},
 		{"period", 1, NULL, 'E'},
 		{"seconds", 1, NULL, 's'},
 		{"nblock", 0, NULL, 'b'},
+		{"mmap", 0, NULL, 'M'},
+		{"mix", 0, NULL, 'x'},
+		{"gain", 1, NULL, 'G'},
+		{"fanout", 0, NULL, 'j'},
+		{"split", 0, NULL, 'u'},
+		{"endpoint", 1, NULL, 'N'},
+		{"measure", 1, NULL, 'L'},
+		{"timer", 0, NULL, 'i'},
+		{"conceal", 0, NULL, 'q'},
+		{"trace", 1, NULL, 'o'},
 		{"effect", 0, NULL, 'e'},
 		{"verbose", 0, NULL, 'v'},
 		{"resample", 0, NULL, 'n'},
 		{"samplerate", 1, NULL, 'A'},
 		{"sync", 1, NULL, 'S'},
 		{"slave", 1, NULL, 'a'},
+		{"drift", 1, NULL, 'D'},
 		{"thread", 1, NULL, 'T'},
+		{"sched", 1, NULL, 'Q'},
+		{"cpus", 1, NULL, 'K'},
 		{"mixer", 1, NULL, 'm'},
 		{"ossmixer", 1, NULL, 'O'},
 		{"workaround", 1, NULL, 'w'},
 		{"xrun", 0, NULL, 'U'},
 		{"syslog", 0, NULL, 'z'},
+		{"metrics", 1, NULL, 'k'},
 		{NULL, 0, NULL, 0},
 	};
 	int err, morehelp;
@@ -390,11 +633,22 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	unsigned int arg_latency_reqtime = 10000;
 	snd_pcm_format_t arg_format = SND_PCM_FORMAT_S16_LE;
 	unsigned int arg_channels = 2;
+	char *arg_route = NULL;
 	unsigned int arg_rate = 48000;
 	snd_pcm_uframes_t arg_buffer_size = 0;
 	snd_pcm_uframes_t arg_period_size = 0;
 	unsigned long arg_loop_time = ~0UL;
 	int arg_nblock = 0;
+	int arg_mmap = 0;
+	int arg_mix = 0;
+	double arg_gain = 0;
+	int arg_fanout = 0;
+	int arg_split = 0;
+	char *arg_endpoint = NULL;
+	unsigned int arg_measure = 0;
+	int arg_timer = 0;
+	int arg_conceal = 0;
+	char *arg_trace = NULL;
 	int arg_effect = 0;
 	int arg_resample = 0;
 #ifdef USE_SAMPLERATE
@@ -402,8 +656,15 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 #endif
 	int arg_sync = SYNC_TYPE_AUTO;
 	int arg_slave = SLAVE_TYPE_AUTO;
+	int arg_drift = DRIFT_TYPE_AVERAGE;
 	int arg_thread = 0;
+	int arg_sched_policy = -1;
+	int arg_sched_priority = -1;
+	int arg_affinity = 0;
+	cpu_set_t arg_cpus;
 	struct loopback *loop = NULL;
+	struct loopback_handle *play = NULL;
+	struct loopback_handle *capt = NULL;
 	char *arg_mixers[MAX_MIXERS];
 	int arg_mixers_count = 0;
 	char *arg_ossmixers[MAX_MIXERS];
@@ -415,7 +676,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hdg:P:C:X:Y:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:z",
+				"hdg:P:C:X:Y:l:t:F:f:c:R:r:s:bMxG:juN:L:iqo:envA:S:a:D:m:T:Q:K:O:w:UW:zk:",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -479,6 +740,54 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'b':
 			arg_nblock = 1;
 			break;
+		case 'M':
+			arg_mmap = 1;
+			break;
+		case 'x':
+			arg_mix = 1;
+			break;
+		case 'G':
+			arg_gain = atof(optarg);
+			break;
+		case 'j':
+			arg_fanout = 1;
+			break;
+		case 'u':
+			arg_split = 1;
+			break;
+		case 'N':
+			arg_endpoint = optarg;
+			break;
+		case 'L':
+			err = atoi(optarg);
+			arg_measure = err > 0 ? err : 1000;
+			break;
+		case 'i':
+			arg_timer = 1;
+			break;
+		case 'q':
+			arg_conceal = 1;
+			break;
+		case 'R':
+			arg_route = optarg;
+			break;
+		case 'Q':
+			if (parse_sched(optarg, &arg_sched_policy,
+					&arg_sched_priority) < 0) {
+				logit(LOG_CRIT, "Wrong scheduling '%s'.\n", optarg);
+				goto __error;
+			}
+			break;
+		case 'K':
+			if (parse_cpus(optarg, &arg_cpus) < 0) {
+				logit(LOG_CRIT, "Wrong cpu list '%s'.\n", optarg);
+				goto __error;
+			}
+			arg_affinity = 1;
+			break;
+		case 'o':
+			arg_trace = optarg;
+			break;
 		case 'e':
 			arg_effect = 1;
 			break;
@@ -534,26 +843,37 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (arg_slave < 0 || arg_slave > SLAVE_TYPE_LAST)
 				arg_slave = SLAVE_TYPE_AUTO;
 			break;
+		case 'D':
+			if (optarg[0] == 'a')
+				arg_drift = DRIFT_TYPE_AVERAGE;
+			else if (optarg[0] == 'p')
+				arg_drift = DRIFT_TYPE_PI;
+			else
+				arg_drift = atoi(optarg);
+			if (arg_drift < 0 || arg_drift > DRIFT_TYPE_LAST)
+				arg_drift = DRIFT_TYPE_AVERAGE;
+			break;
 		case 'T':
 			arg_thread = atoi(optarg);
 			if (arg_thread < 0)
-				arg_thread = 10000000 + loopbacks_count;
+				arg_thread = 10000000 + unique_threads++;
 			break;
 		case 'm':
 			if (arg_mixers_count >= MAX_MIXERS) {
 				logit(LOG_CRIT, "Maximum redirected mixer controls reached (max %i)\n", (int)MAX_MIXERS);
-				exit(EXIT_FAILURE);
+				goto __error;
 			}
 			arg_mixers[arg_mixers_count++] = optarg;
 			break;
 		case 'O':
 			if (arg_ossmixers_count >= MAX_MIXERS) {
 				logit(LOG_CRIT, "Maximum redirected mixer controls reached (max %i)\n", (int)MAX_MIXERS);
-				exit(EXIT_FAILURE);
+				goto __error;
 			}
 			arg_ossmixers[arg_ossmixers_count++] = optarg;
 			break;
 		case 'v':
+			/* restored after the configuration reload */
 			verbose++;
 			break;
 		case 'w':
@@ -573,66 +893,145 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'z':
 			enable_syslog();
 			break;
+		case 'k':
+			free(arg_metrics_path);
+			arg_metrics_path = strdup(optarg);
+			break;
 		}
 	}
 
 	if (morehelp) {
+		if (reloading) {
+			logit(LOG_CRIT, "Help option is not allowed in the reloaded configuration.\n");
+			return -EINVAL;
+		}
 		help();
 		exit(EXIT_SUCCESS);
 	}
 	if (arg_config == NULL) {
-		struct loopback_handle *play;
-		struct loopback_handle *capt;
-		err = create_loopback_handle(&play, arg_pdevice, arg_pctl, "playback");
+		err = create_loopback_handle(&play,
+					     arg_endpoint ? arg_endpoint : arg_pdevice,
+					     arg_pctl, "playback");
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to create playback handle.\n");
-			exit(EXIT_FAILURE);
+			goto __error;
 		}
 		err = create_loopback_handle(&capt, arg_cdevice, arg_cctl, "capture");
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to create capture handle.\n");
-			exit(EXIT_FAILURE);
+			goto __error;
 		}
 		err = create_loopback(&loop, play, capt, output);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to create loopback handle.\n");
-			exit(EXIT_FAILURE);
+			goto __error;
 		}
 		play->format = capt->format = arg_format;
 		play->rate = play->rate_req = capt->rate = capt->rate_req = arg_rate;
 		play->channels = capt->channels = arg_channels;
+		if (arg_route) {
+			err = route_parse(arg_route, &loop->route);
+			if (err < 0) {
+				logit(LOG_CRIT, "Unable to parse route '%s'.\n", arg_route);
+				goto __error;
+			}
+			play->channels = loop->route->channels;
+		}
 		play->buffer_size_req = capt->buffer_size_req = arg_buffer_size;
 		play->period_size_req = capt->period_size_req = arg_period_size;
 		play->resample = capt->resample = arg_resample;
 		play->nblock = capt->nblock = arg_nblock ? 1 : 0;
+		if (arg_mmap)
+			play->access = capt->access =
+					SND_PCM_ACCESS_MMAP_INTERLEAVED;
+		loop->mix = arg_mix;
+		loop->fanout = arg_fanout;
+		loop->split = arg_split;
+		loop->endpoint = arg_endpoint != NULL;
+		loop->measure_interval = arg_measure;
+		loop->timer = arg_timer;
+		loop->conceal = arg_conceal;
+		if (arg_trace) {
+			loop->trace_file = strdup(arg_trace);
+			if (loop->trace_file == NULL) {
+				logit(LOG_CRIT, "Unable to allocate trace file name.\n");
+				goto __error;
+			}
+		}
+		arg_gain = pow(10.0, arg_gain / 20.0) * MIX_GAIN_UNITY + 0.5;
+		loop->mix_gain = arg_gain < MIX_GAIN_MAX ? arg_gain : MIX_GAIN_MAX;
 		loop->latency_req = arg_latency_req;
 		loop->latency_reqtime = arg_latency_reqtime;
 		loop->sync = arg_sync;
 		loop->slave = arg_slave;
-		loop->thread = arg_thread;
+		loop->drift = arg_drift;
+		loop->thread = loop->thread_req = arg_thread;
+		loop->sched_policy = arg_sched_policy;
+		loop->sched_priority = arg_sched_priority;
+		if (arg_affinity) {
+			loop->affinity = 1;
+			loop->cpus = arg_cpus;
+		}
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add mixer controls.\n");
-			exit(EXIT_FAILURE);
+			goto __error;
 		}
 		err = add_oss_mixers(loop, arg_ossmixers, arg_ossmixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add ossmixer controls.\n");
-			exit(EXIT_FAILURE);
+			goto __error;
 		}
 #ifdef USE_SAMPLERATE
 		loop->src_enable = arg_samplerate > 0;
 		if (loop->src_enable)
 			loop->src_converter_type = arg_samplerate - 1;
 #endif
-		set_loop_time(loop, arg_loop_time);
-		add_loop(loop);
+		loop->loop_time = arg_loop_time;
+		if (add_loop(loop) < 0)
+			goto __error;
 		return 0;
 	}
 
+	if (cmdline) {
+		arg_config_file = arg_config;
+		unique_threads_base = unique_threads;
+	}
 	return parse_config_file(arg_config, output);
+
+      __error:
+	/* the reload keeps the running jobs, nothing may exit here */
+	if (loop) {
+		free_loopback(loop);
+	} else {
+		if (play)
+			free_loopback_handle(play);
+		if (capt)
+			free_loopback_handle(capt);
+	}
+	return -EINVAL;
+}
+
+static char *join_args(int argc, char *argv[])
+{
+	size_t len = 1;
+	char *str;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	str = malloc(len);
+	if (str == NULL)
+		return NULL;
+	str[0] = '\0';
+	for (i = 0; i < argc; i++) {
+		if (i > 0)
+			strcat(str, " ");
+		strcat(str, argv[i]);
+	}
+	return str;
 }
 
 static int parse_config_file(const char *file, snd_output_t *output)
@@ -640,7 +1039,7 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	FILE *fp;
 	char line[2048], word[2048];
 	char *str, *ptr;
-	int argc, c, err = 0;
+	int argc, c, count, err = 0;
 	char **argv;
 
 	fp = fopen(file, "r");
@@ -682,6 +1081,7 @@ static int parse_config_file(const char *file, snd_output_t *output)
 				*ptr = '\0';
 				if (argc >= MAX_ARGS) {
 					logit(LOG_CRIT, "Too many arguments.");
+					err = -EINVAL;
 					goto __error;
 				}
 				argv[argc++] = strdup(word);
@@ -693,7 +1093,14 @@ static int parse_config_file(const char *file, snd_output_t *output)
 		optind = opterr = 1;
 		optopt = '?';
 
+		count = loopbacks_count;
 		err = parse_config(argc, argv, output, 0);
+		if (err >= 0 && loopbacks_count > count) {
+			/* the job identity for the configuration reload */
+			loopbacks[count]->cfg = join_args(argc - 1, argv + 1);
+			if (loopbacks[count]->cfg == NULL)
+				err = -ENOMEM;
+		}
 	      __next:
 		if (err < 0)
 			break;
@@ -705,6 +1112,469 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
+static int thread_pollfds(struct loopback_thread *thread,
+			  struct pollfd **pfds, int *wake)
+{
+	struct pollfd *p;
+	int i, j, count = 0;
+
+	*wake = 1000000;
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		count += thread->loopbacks[i]->pollfd_count;
+		j = thread->loopbacks[i]->wake;
+		if (j > 0 && j < *wake)
+			*wake = j;
+	}
+	if (*wake >= 1000000)
+		*wake = -1;
+	/* one more for the timer */
+	p = realloc(*pfds, (count + 1) * sizeof(struct pollfd));
+	if (p == NULL)
+		return -ENOMEM;
+	*pfds = p;
+	return count;
+}
+
+static void thread_remove_loop(struct loopback_thread *thread,
+			       struct loopback *loop)
+{
+	int i;
+
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		if (thread->loopbacks[i] != loop)
+			continue;
+		memmove(&thread->loopbacks[i], &thread->loopbacks[i + 1],
+			(thread->loopbacks_count - i - 1) *
+					sizeof(struct loopback *));
+		thread->loopbacks_count--;
+		break;
+	}
+}
+
+/*
+ * Apply the configuration changes in the owning thread.
+ * The other loops in this thread are not touched. When start
+ * is zero, the new loops are only queued (finished thread).
+ */
+static void thread_reload(struct loopback_thread *thread, int start)
+{
+	struct loopback **remove, **add, **loops, *loop;
+	int remove_count, add_count, i, j, err;
+
+	pthread_mutex_lock(&thread->reload_lock);
+	remove = thread->reload_remove;
+	remove_count = thread->reload_remove_count;
+	add = thread->reload_add;
+	add_count = thread->reload_add_count;
+	thread->reload_remove = thread->reload_add = NULL;
+	thread->reload_remove_count = thread->reload_add_count = 0;
+	thread->reload = 0;
+	pthread_mutex_unlock(&thread->reload_lock);
+
+	for (i = 0; i < remove_count; i++) {
+		loop = remove[i];
+		if (verbose)
+			logit(LOG_INFO, "Stopping loop %s -> %s\n", loop->capt->device, loop->play->device);
+		thread_remove_loop(thread, loop);
+		/* posted by a previous reload, but not started yet */
+		for (j = 0; j < add_count; j++)
+			if (add[j] == loop)
+				add[j] = NULL;
+		pcmjob_done(loop);
+		free_loopback(loop);
+	}
+	for (i = 0; i < add_count; i++) {
+		loop = add[i];
+		if (loop == NULL)
+			continue;
+		if (verbose && start)
+			logit(LOG_INFO, "Starting loop %s -> %s\n", loop->capt->device, loop->play->device);
+		loops = realloc(thread->loopbacks, (thread->loopbacks_count + 1) *
+						sizeof(struct loopback *));
+		if (loops == NULL) {
+			logit(LOG_CRIT, "No enough memory\n");
+			continue;
+		}
+		thread->loopbacks = loops;
+		thread->loopbacks[thread->loopbacks_count++] = loop;
+		if (!start)
+			continue;
+		err = pcmjob_init(loop);
+		if (err >= 0)
+			err = pcmjob_start(loop);
+		if (err < 0) {
+			/* keep the loop allocated, it is still listed */
+			/* in loopbacks and it is retried on next reload */
+			logit(LOG_CRIT, "Loopback %s -> %s start failure.\n", loop->capt->device, loop->play->device);
+			pcmjob_done(loop);
+			thread_remove_loop(thread, loop);
+			loop_stopped(loop, 1);
+		}
+	}
+	free(remove);
+	free(add);
+}
+
+static int thread_post(struct loopback_thread *thread,
+		       struct loopback *remove, struct loopback *add)
+{
+	struct loopback **loops;
+	int err = 0;
+
+	pthread_mutex_lock(&thread->reload_lock);
+	if (remove) {
+		loops = realloc(thread->reload_remove,
+				(thread->reload_remove_count + 1) *
+						sizeof(struct loopback *));
+		if (loops == NULL) {
+			err = -ENOMEM;
+			goto __unlock;
+		}
+		thread->reload_remove = loops;
+		loops[thread->reload_remove_count++] = remove;
+	}
+	if (add) {
+		loops = realloc(thread->reload_add,
+				(thread->reload_add_count + 1) *
+						sizeof(struct loopback *));
+		if (loops == NULL) {
+			err = -ENOMEM;
+			goto __unlock;
+		}
+		thread->reload_add = loops;
+		loops[thread->reload_add_count++] = add;
+	}
+	thread->reload = 1;
+      __unlock:
+	pthread_mutex_unlock(&thread->reload_lock);
+	return err;
+}
+
+static struct loopback_thread *thread_new(int id, snd_output_t *output)
+{
+	struct loopback_thread *thread, **t;
+
+	thread = calloc(1, sizeof(*thread));
+	if (thread == NULL)
+		return NULL;
+	t = realloc(threads, (threads_count + 1) * sizeof(*t));
+	if (t == NULL) {
+		free(thread);
+		return NULL;
+	}
+	thread->id = id;
+	thread->output = output;
+	thread->timer_fd = -1;
+	pthread_mutex_init(&thread->reload_lock, NULL);
+	threads = t;
+	threads[threads_count++] = thread;
+	return thread;
+}
+
+static int thread_add_loop(struct loopback_thread *thread,
+			   struct loopback *loop)
+{
+	struct loopback **loops;
+
+	loops = realloc(thread->loopbacks, (thread->loopbacks_count + 1) *
+						sizeof(struct loopback *));
+	if (loops == NULL)
+		return -ENOMEM;
+	thread->loopbacks = loops;
+	thread->loopbacks[thread->loopbacks_count++] = loop;
+	return 0;
+}
+
+static int same_loop_devices(struct loopback *loop1, struct loopback *loop2)
+{
+	return strcmp(loop1->capt->device, loop2->capt->device) == 0 &&
+	       strcmp(loop1->play->device, loop2->play->device) == 0 &&
+	       loop1->thread_req == loop2->thread_req;
+}
+
+static void thread_job(struct loopback_thread *thread);
+
+/*
+ * Re-read the configuration file and compare the jobs with the running
+ * ones. Unchanged jobs continue, removed jobs are stopped, new jobs are
+ * started and changed jobs (same devices and thread) are replaced: the
+ * old job is removed and the new one added in the owning thread.
+ * All PCM operations are done in the owning threads.
+ */
+static void config_reload(snd_output_t *output)
+{
+	struct loopback **old = loopbacks, **new, *loop;
+	struct loopback_thread *thread;
+	int old_count = loopbacks_count, new_count;
+	int first_thread = threads_count;
+	int *old_match = NULL, *new_match = NULL;
+	int old_verbose = verbose;
+	int i, j, err;
+
+	if (arg_config_file == NULL) {
+		logit(LOG_WARNING, "Reload ignored, no configuration file.\n");
+		return;
+	}
+	if (verbose)
+		logit(LOG_INFO, "Reloading configuration file '%s'\n", arg_config_file);
+	loopbacks = NULL;
+	loopbacks_count = 0;
+	/* the same -T -1 lines must get the same threads */
+	unique_threads = unique_threads_base;
+	reloading = 1;
+	err = parse_config_file(arg_config_file, output);
+	reloading = 0;
+	verbose = old_verbose;
+	while (my_argc > 0)
+		free(my_argv[--my_argc]);
+	free(my_argv);
+	my_argv = NULL;
+	new = loopbacks;
+	new_count = loopbacks_count;
+	loopbacks = old;
+	loopbacks_count = old_count;
+	if (err >= 0 && new_count <= 0)
+		err = -EINVAL;
+	if (err >= 0) {
+		old_match = malloc((old_count + 1) * sizeof(int));
+		new_match = malloc((new_count + 1) * sizeof(int));
+		if (old_match == NULL || new_match == NULL)
+			err = -ENOMEM;
+	}
+	if (err < 0) {
+		logit(LOG_CRIT, "Configuration reload failed, keeping the current jobs.\n");
+		goto __free;
+	}
+
+	for (i = 0; i < old_count; i++)
+		old_match[i] = -1;
+	for (j = 0; j < new_count; j++)
+		new_match[j] = -1;
+	/* unchanged jobs (a job which failed to start is restarted) */
+	for (j = 0; j < new_count; j++) {
+		for (i = 0; i < old_count; i++) {
+			if (old_match[i] >= 0 ||
+			    __atomic_load_n(&old[i]->stopped, __ATOMIC_ACQUIRE))
+				continue;
+			if (old[i]->cfg && strcmp(old[i]->cfg, new[j]->cfg) == 0)
+				break;
+		}
+		if (i >= old_count)
+			continue;
+		old_match[i] = j;
+		new_match[j] = i;
+		free_loopback(new[j]);
+		new[j] = old[i];
+	}
+	/* changed jobs */
+	for (j = 0; j < new_count; j++) {
+		if (new_match[j] >= 0)
+			continue;
+		for (i = 0; i < old_count; i++) {
+			if (old_match[i] < 0 && same_loop_devices(old[i], new[j]))
+				break;
+		}
+		if (i >= old_count)
+			continue;
+		old_match[i] = j;
+		new_match[j] = i;
+	}
+
+	/* nobody may reference the removed loops after this point */
+	loopbacks = new;
+	loopbacks_count = new_count;
+	if (use_metrics)
+		metrics_set_loops(new, new_count);
+
+	for (i = 0; i < old_count; i++) {
+		if (old_match[i] >= 0)
+			continue;
+		err = thread_post(threads[old[i]->thread], old[i], NULL);
+		if (err < 0)
+			logit(LOG_CRIT, "Unable to stop loop %s -> %s\n", old[i]->capt->device, old[i]->play->device);
+	}
+	for (j = 0; j < new_count; j++) {
+		loop = new[j];
+		i = new_match[j];
+		if (i >= 0) {
+			if (loop == old[i])
+				continue;
+			loop->thread = old[i]->thread;
+			err = thread_post(threads[loop->thread], old[i], loop);
+			goto __check;
+		}
+		for (i = 0; i < threads_count; i++)
+			if (threads[i]->id == loop->thread_req)
+				break;
+		if (i < threads_count) {
+			thread = threads[i];
+		} else if (!threads[0]->threaded) {
+			/* the main process runs the only job thread */
+			i = 0;
+			thread = threads[0];
+		} else {
+			thread = thread_new(loop->thread_req, output);
+			if (thread == NULL) {
+				err = -ENOMEM;
+				goto __check;
+			}
+			thread->threaded = 1;
+		}
+		loop->thread = i;
+		if (i >= first_thread)
+			err = thread_add_loop(thread, loop);
+		else
+			err = thread_post(thread, NULL, loop);
+	      __check:
+		if (err < 0)
+			logit(LOG_CRIT, "Unable to start loop %s -> %s\n", loop->capt->device, loop->play->device);
+	}
+
+	for (i = 0; i < first_thread; i++) {
+		thread = threads[i];
+		if (!thread->reload || !thread->threaded)
+			continue;
+		if (!thread->finished) {
+			pthread_kill(thread->thread, SIGUSR2);
+			continue;
+		}
+		/* the thread exited on error, start it again */
+		pthread_join(thread->thread, NULL);
+		thread_reload(thread, 0);
+		if (thread->loopbacks_count > 0) {
+			thread->finished = 0;
+			thread_job(thread);
+		}
+	}
+	for (i = first_thread; i < threads_count; i++)
+		thread_job(threads[i]);
+	free(old);
+	new = NULL;
+	new_count = 0;
+
+      __free:
+	for (j = 0; j < new_count; j++)
+		free_loopback(new[j]);
+	free(new);
+	free(old_match);
+	free(new_match);
+}
+
+static void thread_timer_init(struct loopback_thread *thread)
+{
+	int i;
+
+	for (i = 0; i < thread->loopbacks_count; i++)
+		if (thread->loopbacks[i]->timer)
+			break;
+	if (i >= thread->loopbacks_count)
+		return;
+	thread->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (thread->timer_fd < 0) {
+		logit(LOG_WARNING, "Timer create failed (%s), using poll wakeups.\n", strerror(errno));
+		return;
+	}
+	thread->timer_period = 0;
+	thread->timer_late = 0;
+}
+
+static void thread_timer_done(struct loopback_thread *thread)
+{
+	int i;
+
+	if (thread->timer_fd >= 0)
+		close(thread->timer_fd);
+	thread->timer_fd = -1;
+	for (i = 0; i < thread->loopbacks_count; i++)
+		thread->loopbacks[i]->timer_wake = 0;
+}
+
+static void timespec_add(struct timespec *ts, long usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+/* the timer period is the shortest period of all running jobs */
+static int thread_timer_arm(struct loopback_thread *thread)
+{
+	struct itimerspec its;
+	long period = 0, p;
+	int i;
+
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		p = pcmjob_period_time(thread->loopbacks[i]);
+		if (p > 0 && (period == 0 || p < period))
+			period = p;
+	}
+	for (i = 0; i < thread->loopbacks_count; i++)
+		thread->loopbacks[i]->timer_wake = period > 0;
+	if (period == thread->timer_period)
+		return 0;
+	memset(&its, 0, sizeof(its));
+	timespec_add(&its.it_interval, period);
+	its.it_value = its.it_interval;
+	if (timerfd_settime(thread->timer_fd, 0, &its, NULL) < 0)
+		return -errno;
+	clock_gettime(CLOCK_MONOTONIC, &thread->timer_next);
+	timespec_add(&thread->timer_next, period);
+	thread->timer_period = period;
+	thread->timer_late = 0;
+	if (verbose)
+		snd_output_printf(thread->output, "Timer period %lius\n", period);
+	return 0;
+}
+
+/*
+ * Returns 1 when the timer expired, 0 when not and a negative value
+ * when the wakeups are late too often (fallback to poll wakeups).
+ */
+static int thread_timer_check(struct loopback_thread *thread)
+{
+	struct timespec now;
+	uint64_t ticks;
+	long late;
+	int i;
+
+	if (read(thread->timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return 0;
+	if (ticks == 0 || thread->timer_period == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* the expiration time of the last tick */
+	timespec_add(&thread->timer_next, (ticks - 1) * thread->timer_period);
+	late = (now.tv_sec - thread->timer_next.tv_sec) * 1000000 +
+	       (now.tv_nsec - thread->timer_next.tv_nsec) / 1000;
+	timespec_add(&thread->timer_next, thread->timer_period);
+	for (i = 0; i < thread->loopbacks_count; i++)
+		pcmjob_wake_stats(thread->loopbacks[i], late, ticks - 1);
+	if (ticks > 1 || late > thread->timer_period / 2)
+		thread->timer_late++;
+	else
+		thread->timer_late = 0;
+	if (thread->timer_late >= TIMER_LATE_LIMIT) {
+		logit(LOG_WARNING, "Timer wakeups are late (%lius), using poll wakeups.\n", late);
+		return -EIO;
+	}
+	return 1;
+}
+
+/* all jobs reached the requested duration */
+static int thread_limit_reached(struct loopback_thread *thread)
+{
+	int i;
+
+	for (i = 0; i < thread->loopbacks_count; i++)
+		if (!pcmjob_finished(thread->loopbacks[i]))
+			return 0;
+	return thread->loopbacks_count > 0;
+}
+
 static void thread_job1(void *_data)
 {
 	struct loopback_thread *thread = _data;
@@ -713,7 +1583,7 @@ static void thread_job1(void *_data)
 	int pfds_count = 0;
 	int i, j, err, wake = 1000000;
 
-	setscheduler();
+	setscheduler(thread);
 
 	for (i = 0; i < thread->loopbacks_count; i++) {
 		err = pcmjob_init(thread->loopbacks[i]);
@@ -728,20 +1598,37 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Loopback start failure.\n");
 			my_exit(thread, EXIT_FAILURE);
 		}
-		pfds_count += thread->loopbacks[i]->pollfd_count;
-		j = thread->loopbacks[i]->wake;
-		if (j > 0 && j < wake)
-			wake = j;
+		loop_stopped(thread->loopbacks[i], 0);
 	}
-	if (wake >= 1000000)
-		wake = -1;
-	pfds = calloc(pfds_count, sizeof(struct pollfd));
-	if (pfds == NULL || pfds_count <= 0) {
+	pfds_count = thread_pollfds(thread, &pfds, &wake);
+	if (pfds_count <= 0) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
 		my_exit(thread, EXIT_FAILURE);
 	}
+	thread_timer_init(thread);
 	while (!quit) {
 		struct timeval tv1, tv2;
+		int timer = 0;
+		if (reload_pending && !thread->threaded) {
+			reload_pending = 0;
+			config_reload(output);
+		}
+		if (thread->reload) {
+			thread_reload(thread, 1);
+			setscheduler(thread);
+			pfds_count = thread_pollfds(thread, &pfds, &wake);
+			if (pfds_count < 0) {
+				logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+				my_exit(thread, EXIT_FAILURE);
+			}
+			if (thread->timer_fd < 0)
+				thread_timer_init(thread);
+		}
+		if (thread->timer_fd >= 0 &&
+		    (err = thread_timer_arm(thread)) < 0) {
+			logit(LOG_WARNING, "Timer set failed (%s), using poll wakeups.\n", strerror(-err));
+			thread_timer_done(thread);
+		}
 		for (i = j = 0; i < thread->loopbacks_count; i++) {
 			err = pcmjob_pollfds_init(thread->loopbacks[i], &pfds[j]);
 			if (err < 0) {
@@ -750,6 +1637,12 @@ static void thread_job1(void *_data)
 			}
 			j += err;
 		}
+		if (thread->timer_fd >= 0) {
+			pfds[j].fd = thread->timer_fd;
+			pfds[j].events = POLLIN;
+			pfds[j].revents = 0;
+			j++;
+		}
 		if (verbose > 10)
 			gettimeofday(&tv1, NULL);
 		err = poll(pfds, j, wake);
@@ -765,9 +1658,15 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Poll failed: %s\n", strerror(-err));
 			my_exit(thread, EXIT_FAILURE);
 		}
+		if (thread->timer_fd >= 0) {
+			timer = thread_timer_check(thread);
+			if (timer < 0)
+				thread_timer_done(thread);
+		}
 		for (i = j = 0; i < thread->loopbacks_count; i++) {
 			struct loopback *loop = thread->loopbacks[i];
-			if (j < loop->active_pollfd_count) {
+			/* one pass for all jobs on the timer expiration */
+			if (timer > 0 || j < loop->active_pollfd_count) {
 				err = pcmjob_pollfds_handle(loop, &pfds[j]);
 				if (err < 0) {
 					logit(LOG_CRIT, "pcmjob failed.\n");
@@ -776,8 +1675,13 @@ static void thread_job1(void *_data)
 			}
 			j += loop->active_pollfd_count;
 		}
+		if (thread_limit_reached(thread))
+			break;
 	}
 
+	if (verbose)
+		for (i = 0; i < thread->loopbacks_count; i++)
+			pcmjob_summary(thread->loopbacks[i]);
 	my_exit(thread, EXIT_SUCCESS);
 }
 
@@ -797,8 +1701,8 @@ static void send_to_all(int sig)
 	int i;
 
 	for (i = 0; i < threads_count; i++) {
-		thread = &threads[i];
-		if (thread->threaded)
+		thread = threads[i];
+		if (thread->threaded && !thread->finished)
 			pthread_kill(thread->thread, sig);
 	}
 }
@@ -818,7 +1722,7 @@ static void signal_handler_state(int sig)
 	if (pthread_equal(main_job, self))
 		send_to_all(SIGUSR1);
 	for (i = 0; i < threads_count; i++) {
-		thread = &threads[i];
+		thread = threads[i];
 		if (thread->thread == self) {
 			for (j = 0; j < thread->loopbacks_count; j++)
 				pcmjob_state(thread->loopbacks[j]);
@@ -827,15 +1731,32 @@ static void signal_handler_state(int sig)
 	signal(sig, signal_handler_state);
 }
 
+static void signal_handler_reload(int sig)
+{
+	reload_pending = 1;
+	signal(sig, signal_handler_reload);
+}
+
 static void signal_handler_ignore(int sig)
 {
 	signal(sig, signal_handler_ignore);
 }
 
+static int threads_finished(void)
+{
+	int k;
+
+	for (k = 0; k < threads_count; k++)
+		if (!threads[k]->finished)
+			return 0;
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
 	snd_output_t *output;
-	int i, j, k, l, err;
+	struct loopback_thread *thread;
+	int i, j, k, err;
 
 	err = snd_output_stdio_attach(&output, stdout, 0);
 	if (err < 0) {
@@ -850,6 +1771,7 @@ int main(int argc, char *argv[])
 	while (my_argc > 0)
 		free(my_argv[--my_argc]);
 	free(my_argv);
+	my_argv = NULL;
 
 	if (loopbacks_count <= 0) {
 		logit(LOG_CRIT, "No loopback defined...\n");
@@ -893,39 +1815,54 @@ int main(int argc, char *argv[])
 			j = loopbacks[i]->thread;
 	}
 	j += 1;
-	threads = calloc(1, sizeof(struct loopback_thread) * j);
-	if (threads == NULL) {
-		logit(LOG_CRIT, "No enough memory\n");
-		exit(EXIT_FAILURE);
-	}
 	/* sort all threads */
 	for (k = 0; k < j; k++) {
-		for (i = l = 0; i < loopbacks_count; i++)
-			if (loopbacks[i]->thread == k)
-				l++;
-		threads[k].loopbacks = malloc(l * sizeof(struct loopback *));
-		threads[k].loopbacks_count = l;
-		threads[k].output = output;
-		threads[k].threaded = j > 1;
-		for (i = l = 0; i < loopbacks_count; i++)
+		for (i = 0; i < loopbacks_count; i++)
 			if (loopbacks[i]->thread == k)
-				threads[k].loopbacks[l++] = loopbacks[i];
+				break;
+		thread = thread_new(loopbacks[i]->thread_req, output);
+		if (thread == NULL) {
+			logit(LOG_CRIT, "No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+		thread->threaded = j > 1;
+		for (i = 0; i < loopbacks_count; i++)
+			if (loopbacks[i]->thread == k &&
+			    thread_add_loop(thread, loopbacks[i]) < 0) {
+				logit(LOG_CRIT, "No enough memory\n");
+				exit(EXIT_FAILURE);
+			}
 	}
-	threads_count = j;
 	main_job = pthread_self();
+
+	if (arg_metrics_path) {
+		err = metrics_init(arg_metrics_path, loopbacks, loopbacks_count);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to initialize metrics...\n");
+			exit(EXIT_FAILURE);
+		}
+	}
  
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_state);
 	signal(SIGUSR2, signal_handler_ignore);
+	signal(SIGHUP, signal_handler_reload);
 
-	for (k = 0; k < threads_count; k++)
-		thread_job(&threads[k]);
+	for (k = 0; k < j; k++)
+		thread_job(threads[k]);
 
 	if (j > 1) {
+		while (!quit && !threads_finished()) {
+			sleep(1);
+			if (reload_pending) {
+				reload_pending = 0;
+				config_reload(output);
+			}
+		}
 		for (k = 0; k < threads_count; k++)
-			pthread_join(threads[k].thread, NULL);
+			pthread_join(threads[k]->thread, NULL);
 	}
 
 	if (use_syslog)
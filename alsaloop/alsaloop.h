@@ -19,6 +19,7 @@
  */
 
 #include "aconfig.h"
+#include <pthread.h>
 #ifdef HAVE_SAMPLERATE_H
 #define USE_SAMPLERATE
 #include <samplerate.h>
@@ -53,6 +54,12 @@ typedef enum _sync_type {
 	SYNC_TYPE_LAST = SYNC_TYPE_AUTO
 } sync_type_t;
 
+typedef enum _drift_type {
+	DRIFT_TYPE_AVERAGE = 0,	/* averaged queued samples */
+	DRIFT_TYPE_PI,		/* timestamp based PI controller */
+	DRIFT_TYPE_LAST = DRIFT_TYPE_PI
+} drift_type_t;
+
 typedef enum _slave_type {
 	SLAVE_TYPE_AUTO = 0,
 	SLAVE_TYPE_ON = 1,
@@ -68,9 +75,11 @@ struct loopback_control {
 
 struct loopback_mixer {
 	unsigned int skip:1;
+	unsigned int pending;		/* mirroring requests (atomic) */
 	struct loopback_control src;
 	struct loopback_control dst;
 	struct loopback_mixer *next;
+	struct loopback_mixer *hash_next[2];	/* src and dst id index */
 };
 
 struct loopback_ossmixer {
@@ -81,8 +90,76 @@ struct loopback_ossmixer {
 	struct loopback_ossmixer *next;
 };
 
+#define MIX_GAIN_SHIFT	12		/* mixing gain fixed point */
+#define MIX_GAIN_UNITY	(1 << MIX_GAIN_SHIFT)
+#define MIX_GAIN_MAX	32767		/* ~ +18dB */
+
+#define METRICS_HIST_SIZE	32	/* log2 buckets in usec */
+
+/* processing phases of one wakeup */
+enum {
+	PROC_READ = 0,			/* capture transfer */
+	PROC_CONVERT,			/* copy, route, mix or samplerate */
+	PROC_WRITE,			/* playback transfer */
+	PROC_LAST
+};
+
+struct loopback_metrics_data {
+	int running;
+	unsigned long long wakeups;
+	unsigned int play_xruns;
+	unsigned int capt_xruns;
+	unsigned int reinits;
+	long latency;			/* last measured latency in frames */
+	long latency_min;
+	long latency_max;
+	double pitch;
+	unsigned long play_fill;	/* playback buffer fill in frames */
+	unsigned long capt_fill;	/* capture buffer fill in frames */
+	long proctime_max;		/* in usec */
+	unsigned int proctime[METRICS_HIST_SIZE];
+	unsigned int proc_hist[PROC_LAST][METRICS_HIST_SIZE];
+	unsigned long long proc_sum[PROC_LAST];	/* in nsec */
+	unsigned long long cpu_time;	/* thread cpu time in the job (nsec) */
+	unsigned long long capt_frames;	/* read frames */
+	unsigned long long play_frames;	/* written frames */
+	/* measured round-trip latency in capture frames */
+	long rtt;
+	long rtt_min;
+	long rtt_max;
+	unsigned int rtt_count;
+	unsigned int rtt_lost;
+	double rtt_sum;
+	double rtt_sum2;
+	/* timer driven wakeups (in usec) */
+	long wake_late;
+	long wake_late_max;
+	unsigned int wake_missed;
+	/* glitch concealment */
+	unsigned long long conceal_frames;	/* repeated frames */
+	unsigned int conceal_fades;	/* crossfaded drops */
+};
+
+struct loopback_metrics {
+	volatile unsigned int seq;	/* odd = update in progress */
+	struct loopback_metrics_data live;	/* owned by the job thread */
+	struct loopback_metrics_data snap;	/* published copy */
+};
+
+struct loopback_bus;
+struct loopback_fanout;
+struct loopback_split;
+struct loopback_measure;
+struct loopback_trace;
+struct loopback_ctlsync;
+struct loopback_endpoint;
+
 struct loopback_handle {
 	struct loopback *loopback;
+	struct loopback_bus *bus;	/* mixed playback (input FIFO only) */
+	struct loopback_fanout *fanout;	/* shared capture (output FIFO only) */
+	struct loopback_split *split;	/* capture thread (output FIFO only) */
+	struct loopback_endpoint *endpoint;	/* shared memory ring (playback only) */
 	char *device;
 	char *ctldev;
 	char *id;
@@ -127,8 +204,73 @@ struct loopback_handle {
 	snd_ctl_elem_value_t *ctl_channels;
 };
 
+/* several loops mixed to one playback PCM */
+struct loopback_bus {
+	struct loopback_bus *next;
+	int thread;
+	struct loopback_handle *play;	/* the bus playback PCM */
+	struct loopback **inputs;
+	int inputs_count;
+	int active;			/* running inputs */
+	void *sum;			/* accumulator */
+	unsigned int xruns;
+};
+
+/* channel routing matrix */
+struct loopback_route_entry {
+	unsigned int src;
+	unsigned int dst;
+	double gain;
+};
+
+struct loopback_route {
+	struct loopback_route_entry *entries;
+	unsigned int entries_count;
+	unsigned int channels;		/* playback channels (highest dst + 1) */
+	/* compiled by route_setup() */
+	unsigned int channels_in;
+	unsigned int channels_out;
+	unsigned int sparse:1;		/* at most one source per output */
+	unsigned int copy:1;		/* sparse with the unity gains */
+	int *map;			/* source for each output or -1 */
+	int *gain;			/* out x in matrix (MIX_GAIN_UNITY = 1.0) */
+	float *fgain;			/* out x in matrix */
+};
+
+/* one capture PCM feeding several loops */
+struct loopback_fanout {
+	struct loopback_fanout *next;
+	int thread;
+	struct loopback_handle *capt;	/* the shared capture PCM */
+	struct loopback **outputs;
+	int outputs_count;
+	int active;			/* running outputs */
+	unsigned int xruns;
+};
+
+/*
+ * capture thread feeding the job thread, the ring is single producer
+ * and single consumer, head and tail are free running frame counters
+ */
+struct loopback_split {
+	pthread_t thread;
+	int running;			/* thread created (job thread only) */
+	int stop;			/* exit request */
+	int done;			/* the thread exited, check the stream */
+	int full;			/* the thread waits for a room */
+	int wake_fd;			/* eventfd - stop or room available */
+	struct pollfd *fds;		/* wake_fd + capture descriptors */
+	unsigned int pollfd_count;	/* capture descriptors */
+	char *ring;
+	snd_pcm_uframes_t size;		/* in frames */
+	unsigned int overruns;		/* ring full events */
+	snd_pcm_uframes_t head __attribute__((aligned(64)));	/* producer */
+	snd_pcm_uframes_t tail __attribute__((aligned(64)));	/* consumer */
+};
+
 struct loopback {
 	char *id;
+	char *cfg;			/* configuration line (reload key) */
 	struct loopback_handle *capt;
 	struct loopback_handle *play;
 	snd_pcm_uframes_t latency;	/* final latency in frames */
@@ -144,11 +286,27 @@ struct loopback {
 	unsigned int reinit:1;
 	unsigned int running:1;
 	unsigned int stop_pending:1;
+	unsigned int mmap_copy:1;	/* direct capture -> playback mmap copy */
+	unsigned int mix:1;		/* mix the playback with other loops */
+	int mix_gain;			/* mixing gain (MIX_GAIN_UNITY = 0dB) */
+	unsigned int fanout:1;		/* share the capture with other loops */
+	unsigned int split:1;		/* read the capture in own thread */
+	unsigned int endpoint:1;	/* playback to the shared memory ring */
+	struct loopback_route *route;	/* channel routing matrix */
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
 	int thread;			/* thread number */
+	int thread_req;			/* requested thread number */
+	int stopped;			/* start failed (set by the job thread) */
+	int sched_policy;		/* thread policy (-1 = SCHED_RR) */
+	int sched_priority;		/* thread priority (-1 = maximal) */
+	unsigned int affinity:1;	/* pin the thread to cpus */
+	cpu_set_t cpus;
 	unsigned int wake;
+	unsigned int timer:1;		/* timer driven wakeups requested */
+	unsigned int conceal:1;		/* conceal the xrun gaps */
+	unsigned int timer_wake:1;	/* the thread timer replaces PCM wakeups */
 	/* statistics */
 	double pitch;
 	double pitch_delta;
@@ -156,6 +314,14 @@ struct loopback {
 	snd_pcm_sframes_t pitch_diff_min;
 	snd_pcm_sframes_t pitch_diff_max;
 	unsigned int total_queued_count;
+	/* PI drift controller */
+	drift_type_t drift;		/* type of drift estimator */
+	unsigned int drift_valid:1;
+	double drift_kp;
+	double drift_ki;
+	double drift_err;		/* filtered fill error in frames */
+	double drift_integ;		/* integrator (drift estimate) */
+	snd_htimestamp_t drift_last;
 	snd_timestamp_t tstamp_start;
 	snd_timestamp_t tstamp_end;
 	/* xrun profiling */
@@ -172,9 +338,22 @@ struct loopback {
 	unsigned int xrun_out_frames;
 	long xrun_max_proctime;
 	double xrun_max_missing;
+	/* processing time */
+	unsigned long long proc_init;	/* monotonic time of init (nsec) */
+	unsigned long long proc_cpu_init;	/* thread cpu time of init (nsec) */
+	unsigned long long proc_phase[PROC_LAST];	/* current wakeup (nsec) */
+	/* live metrics */
+	struct loopback_metrics metrics;
+	/* round-trip latency measurement */
+	unsigned int measure_interval;	/* in ms, 0 = off */
+	struct loopback_measure *measure;
+	/* sync trace record */
+	char *trace_file;
+	struct loopback_trace *trace;
 	/* control mixer */
 	struct loopback_mixer *controls;
 	struct loopback_ossmixer *oss_controls;
+	struct loopback_ctlsync *ctlsync;	/* mirroring helper thread */
 	/* sample rate */
 	unsigned int use_samplerate:1;
 #ifdef USE_SAMPLERATE
@@ -183,6 +362,8 @@ struct loopback {
 	SRC_STATE *src_state;
 	SRC_DATA src_data;
 	unsigned int src_out_frames;
+	float *src_in;			/* conversion input (src_data.data_in) */
+	float *route_data;		/* routing input (capture channels) */
 #endif
 #ifdef FILE_CWRITE
 	FILE *cfile;
@@ -195,6 +376,7 @@ struct loopback {
 extern int verbose;
 extern int workarounds;
 extern int use_syslog;
+extern int use_metrics;
 
 #define logit(priority, fmt, args...) do {		\
 	if (use_syslog)					\
@@ -203,6 +385,26 @@ extern int use_syslog;
 		fprintf(stderr, fmt, ##args);		\
 } while (0)
 
+static inline snd_pcm_uframes_t get_whole_latency(struct loopback *loop)
+{
+	return loop->latency;
+}
+
+/* frames queued in the capture thread ring */
+static inline snd_pcm_uframes_t split_fill(struct loopback_handle *capt)
+{
+	if (capt->split == NULL)
+		return 0;
+	return __atomic_load_n(&capt->split->head, __ATOMIC_ACQUIRE) -
+	       capt->split->tail;
+}
+
+static inline double htimediff(snd_htimestamp_t t1, snd_htimestamp_t t2)
+{
+	return (double)(t1.tv_sec - t2.tv_sec) +
+	       (double)(t1.tv_nsec - t2.tv_nsec) / 1000000000.0;
+}
+
 int pcmjob_init(struct loopback *loop);
 int pcmjob_done(struct loopback *loop);
 int pcmjob_start(struct loopback *loop);
@@ -210,6 +412,65 @@ int pcmjob_stop(struct loopback *loop);
 int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds);
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds);
 void pcmjob_state(struct loopback *loop);
+int pcmjob_finished(struct loopback *loop);
+void pcmjob_summary(struct loopback *loop);
+long pcmjob_period_time(struct loopback *loop);
+void update_pitch(struct loopback *loop);
+void pcmjob_wake_stats(struct loopback *loop, long late, unsigned int missed);
+
+int metrics_init(const char *path, struct loopback **loops, int count);
+void metrics_set_loops(struct loopback **loops, int count);
+void metrics_publish(struct loopback *loop);
+long metrics_percentile(const unsigned int *hist, unsigned int percent);
+
+void drift_init(struct loopback *loop);
+void drift_update_fill(struct loopback *loop, double fill,
+		       snd_htimestamp_t tstamp);
+void sync_average_update(struct loopback *loop, snd_pcm_sframes_t pqueued,
+			 snd_pcm_sframes_t cqueued);
+
+int trace_open(struct loopback *loop);
+void trace_close(struct loopback *loop);
+void trace_start(struct loopback *loop);
+void trace_xrun(struct loopback *loop, int playback);
+void trace_wakeup(struct loopback *loop);
+
+int endpoint_open(struct loopback_handle *lhandle);
+void endpoint_close(struct loopback_handle *lhandle);
+int endpoint_setparams(struct loopback_handle *lhandle,
+		       snd_pcm_uframes_t bufsize);
+int endpoint_start(struct loopback_handle *lhandle);
+void endpoint_stop(struct loopback_handle *lhandle);
+snd_pcm_sframes_t endpoint_delay(struct loopback_handle *lhandle);
+snd_pcm_sframes_t endpoint_avail(struct loopback_handle *lhandle);
+void endpoint_status(struct loopback_handle *lhandle,
+		     snd_htimestamp_t *tstamp, snd_pcm_sframes_t *delay);
+snd_pcm_sframes_t endpoint_write(struct loopback_handle *lhandle,
+				 const void *buf, snd_pcm_uframes_t size);
+int endpoint_poll_descriptors(struct loopback_handle *lhandle,
+			      struct pollfd *pfd);
+unsigned short endpoint_revents(struct loopback_handle *lhandle,
+				struct pollfd *pfd);
+unsigned long long endpoint_underruns(struct loopback_handle *lhandle);
+
+int measure_start(struct loopback *loop);
+void measure_done(struct loopback *loop);
+void measure_capture(struct loopback *loop, snd_pcm_uframes_t count);
+
+int route_parse(const char *str, struct loopback_route **route);
+void route_free(struct loopback_route *route);
+int route_setup(struct loopback_route *route, unsigned int channels_in,
+		unsigned int channels_out);
+void route_frames(const struct loopback_route *route, snd_pcm_format_t format,
+		  void *dst, const void *src, unsigned int frames);
+void route_frames_float(const struct loopback_route *route, float *dst,
+			const float *src, unsigned int frames);
+
+void mix_sum(snd_pcm_format_t format, void *sum, unsigned int offset,
+	     const void *src, unsigned int samples, int gain);
+void mix_out(snd_pcm_format_t format, void *dst, const void *sum,
+	     unsigned int samples);
+void mix_clear(snd_pcm_format_t format, void *sum, unsigned int samples);
 
 int control_parse_id(const char *str, snd_ctl_elem_id_t *id);
 int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2);
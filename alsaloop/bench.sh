@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Throughput benchmark - run K loops between the free running null
+# devices and report the cpu cost per loop, the cost of the read,
+# convert and write phases and the estimated loop count which one
+# machine can sustain in the realtime.
+#
+#   make bench BENCH_ARGS="-k 8 -c 8 -S samplerate"
+
+ALSALOOP=${ALSALOOP:-./alsaloop}
+LOOPS=4
+THREADS=1
+SECONDS_=60
+FORMAT=S16_LE
+CHANNELS=2
+RATE=48000
+SYNC=none
+CONVERTER=
+CDEVICE=null
+PDEVICE=null
+CFGFILE=$(mktemp /tmp/alsaloop.bench.XXXXXX)
+LOGFILE=$(mktemp /tmp/alsaloop.bench.XXXXXX)
+
+usage() {
+  echo "Usage: $0 [OPTION]... [-- ALSALOOP_OPTIONS]"
+  echo
+  echo "-k loops      loop count (default $LOOPS)"
+  echo "-t threads    0 = thread per loop, 1 = one thread (default $THREADS)"
+  echo "-s seconds    processed audio per loop (default $SECONDS_)"
+  echo "-f format     sample format (default $FORMAT)"
+  echo "-c channels   channels (default $CHANNELS)"
+  echo "-r rate       rate (default $RATE)"
+  echo "-S sync       sync mode (default $SYNC, samplerate = SRC path)"
+  echo "-A converter  samplerate converter"
+  echo "-C device     capture device (default $CDEVICE)"
+  echo "-P device     playback device (default $PDEVICE, for example"
+  echo "              file:FILE=/dev/null)"
+}
+
+while getopts "hk:t:s:f:c:r:S:A:C:P:" opt; do
+  case $opt in
+  k) LOOPS=$OPTARG ;;
+  t) THREADS=$OPTARG ;;
+  s) SECONDS_=$OPTARG ;;
+  f) FORMAT=$OPTARG ;;
+  c) CHANNELS=$OPTARG ;;
+  r) RATE=$OPTARG ;;
+  S) SYNC=$OPTARG ;;
+  A) CONVERTER="-A $OPTARG" ;;
+  C) CDEVICE=$OPTARG ;;
+  P) PDEVICE=$OPTARG ;;
+  *) usage; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+rm -f $CFGFILE
+for i in $(seq 1 $LOOPS); do
+  if test "$THREADS" = "1"; then
+    thread=0
+  else
+    thread=$i
+  fi
+  echo "-C $CDEVICE -P $PDEVICE -f $FORMAT -c $CHANNELS -r $RATE" \
+       "-S $SYNC $CONVERTER -s $SECONDS_ -T $thread $*" >> $CFGFILE
+done
+
+TIMEFORMAT="%R %U %S"
+times=$( { time $ALSALOOP -v -g $CFGFILE > $LOGFILE 2>&1; } 2>&1 )
+err=$?
+rm -f $CFGFILE
+if test $err -ne 0 || ! grep -q "of realtime" $LOGFILE; then
+  cat $LOGFILE
+  rm -f $LOGFILE
+  echo "alsaloop failed"
+  exit 1
+fi
+
+echo "$LOOPS loops, $FORMAT, $CHANNELS channels, $RATE Hz, sync $SYNC," \
+     "$SECONDS_ seconds"
+grep "of realtime" $LOGFILE
+echo "$times" | awk -v loops=$LOOPS -v secs=$SECONDS_ -v cpus=$(nproc) '
+{
+  cpu = $2 + $3
+  printf "process: wall %.3fs, cpu %.3fs (user %.3fs, system %.3fs)\n", $1, cpu, $2, $3
+  per = cpu / loops / secs * 100
+  printf "cpu per loop: %.3f%% of one core\n", per
+  if (per > 0)
+    printf "sustainable loops: %d (%d cpus)\n", cpus * 100 / per, cpus
+}'
+awk '/of realtime/ {
+  for (i = 1; i <= NF; i++) {
+    if ($i == "read") read += $(i + 1)
+    if ($i == "convert") conv += $(i + 1)
+    if ($i == "write") write += $(i + 1)
+  }
+  n++
+}
+END {
+  if (n > 0)
+    printf "average per frame: read %.1fns, convert %.1fns, write %.1fns\n", read / n, conv / n, write / n
+}' $LOGFILE
+rm -f $LOGFILE
@@ -0,0 +1,298 @@
+/*
+ *  A simple PCM loopback utility - shared memory endpoint test consumer
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Play the endpoint ring (alsaloop -N) with a simulated device clock.
+ * One period is consumed each period time, the clock can be offset
+ * by the given ppm to check the drift compensation. The ring fill
+ * should settle at the alsaloop latency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "endpoint.h"
+
+struct consumer {
+	int fd;
+	struct endpoint_shm *shm;
+	size_t map_size;
+	uint32_t generation;
+	int synced;			/* the generation is valid */
+	FILE *out;
+	char *silence;
+	size_t silence_size;
+};
+
+static int consumer_map(struct consumer *c)
+{
+	struct stat st;
+
+	if (c->shm)
+		munmap(c->shm, c->map_size);
+	c->shm = NULL;
+	if (fstat(c->fd, &st) < 0)
+		return -errno;
+	if ((size_t)st.st_size < sizeof(struct endpoint_shm))
+		return -EAGAIN;
+	c->map_size = st.st_size;
+	c->shm = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      c->fd, 0);
+	if (c->shm == MAP_FAILED) {
+		c->shm = NULL;
+		return -errno;
+	}
+	if (c->shm->magic != ENDPOINT_MAGIC ||
+	    c->shm->version != ENDPOINT_VERSION)
+		return -EAGAIN;
+	return 0;
+}
+
+/* wait for a running stream with a consistent header */
+static int consumer_sync(struct consumer *c)
+{
+	uint32_t generation;
+	int err;
+
+	for (;;) {
+		if (c->shm == NULL || c->shm->map_size != c->map_size) {
+			err = consumer_map(c);
+			if (err < 0 && err != -EAGAIN)
+				return err;
+		}
+		if (c->shm && __atomic_load_n(&c->shm->running, __ATOMIC_ACQUIRE)) {
+			generation = __atomic_load_n(&c->shm->generation,
+						     __ATOMIC_ACQUIRE);
+			if (c->shm->map_size == c->map_size) {
+				/* the new generation starts from zero */
+				if (c->synced && generation != c->generation)
+					__atomic_store_n(&c->shm->tail, 0, __ATOMIC_RELEASE);
+				c->generation = generation;
+				c->synced = 1;
+				return 0;
+			}
+		}
+		usleep(10000);
+	}
+}
+
+static void consumer_write(struct consumer *c, const char *ptr, size_t bytes)
+{
+	if (c->out && fwrite(ptr, 1, bytes, c->out) != bytes) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* consume one period, returns the missing frames */
+static uint32_t consumer_period(struct consumer *c, uint32_t frames)
+{
+	struct endpoint_shm *shm = c->shm;
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = shm->tail;
+	uint64_t avail = head - tail;
+	uint32_t pos, r, missing = 0;
+
+	/* the tail is from another generation (attached late), skip */
+	if ((int64_t)avail < 0 || avail > shm->size) {
+		tail = head;
+		avail = 0;
+	}
+	if (avail < frames) {
+		missing = frames - avail;
+		frames = avail;
+	}
+	while (frames > 0) {
+		pos = tail % shm->size;
+		r = shm->size - pos;
+		if (r > frames)
+			r = frames;
+		consumer_write(c, shm->data + (size_t)pos * shm->frame_size,
+			       (size_t)r * shm->frame_size);
+		tail += r;
+		frames -= r;
+	}
+	__atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+	if (missing > 0) {
+		if (c->silence_size < (size_t)missing * shm->frame_size) {
+			free(c->silence);
+			c->silence_size = (size_t)missing * shm->frame_size;
+			c->silence = calloc(1, c->silence_size);
+			if (c->silence == NULL) {
+				fprintf(stderr, "no memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		consumer_write(c, c->silence,
+			       (size_t)missing * shm->frame_size);
+		__atomic_add_fetch(&shm->underruns, 1, __ATOMIC_RELAXED);
+	}
+	return missing;
+}
+
+static void timespec_add_ns(struct timespec *ts, long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000LL;
+	ts->tv_nsec = ns % 1000000000LL;
+}
+
+static void help(void)
+{
+	printf(
+"Usage: alsaloop-consumer [OPTION]... <file>\n"
+"\n"
+"-h,--help      help\n"
+"-p,--ppm       device clock offset in ppm (positive = faster)\n"
+"-P,--period    consumed period in frames (default producer period)\n"
+"-o,--output    write the consumed frames to given raw file\n"
+"-t,--time      run time in seconds (default unlimited)\n"
+"-v,--verbose   print the fill for each period\n"
+);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option long_option[] =
+	{
+		{"help", 0, NULL, 'h'},
+		{"ppm", 1, NULL, 'p'},
+		{"period", 1, NULL, 'P'},
+		{"output", 1, NULL, 'o'},
+		{"time", 1, NULL, 't'},
+		{"verbose", 0, NULL, 'v'},
+		{NULL, 0, NULL, 0},
+	};
+	struct consumer cons;
+	struct timespec next, report;
+	double ppm = 0, run_time = 0, fill_sum = 0;
+	unsigned long long frames = 0, missing = 0, periods = 0;
+	uint64_t fill, fill_min = ~0ULL, fill_max = 0;
+	uint32_t period_req = 0, period;
+	long long period_ns;
+	int c, verbose = 0, err;
+
+	memset(&cons, 0, sizeof(cons));
+	while ((c = getopt_long(argc, argv, "hp:P:o:t:v", long_option, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case 'p':
+			ppm = atof(optarg);
+			break;
+		case 'P':
+			period_req = atoi(optarg);
+			break;
+		case 'o':
+			cons.out = fopen(optarg, "w");
+			if (cons.out == NULL) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			run_time = atof(optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			help();
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		help();
+		return EXIT_FAILURE;
+	}
+	cons.fd = open(argv[optind], O_RDWR);
+	if (cons.fd < 0) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	if ((err = consumer_sync(&cons)) < 0) {
+		fprintf(stderr, "unable to map %s: %s\n", argv[optind], strerror(-err));
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	report = next;
+	timespec_add_ns(&report, 1000000000LL);
+	for (;;) {
+		period = period_req ? period_req : cons.shm->period_size;
+		period_ns = (long long)(period * 1e9 /
+					(cons.shm->rate * (1 + ppm / 1e6)));
+		timespec_add_ns(&next, period_ns);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		if (!__atomic_load_n(&cons.shm->running, __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&cons.shm->generation, __ATOMIC_ACQUIRE) != cons.generation) {
+			printf("stream restarted\n");
+			if ((err = consumer_sync(&cons)) < 0) {
+				fprintf(stderr, "unable to remap: %s\n", strerror(-err));
+				return EXIT_FAILURE;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			continue;
+		}
+		fill = __atomic_load_n(&cons.shm->head, __ATOMIC_ACQUIRE) -
+		       cons.shm->tail;
+		missing += consumer_period(&cons, period);
+		frames += period;
+		periods++;
+		fill_sum += fill;
+		if (fill_min > fill)
+			fill_min = fill;
+		if (fill_max < fill)
+			fill_max = fill;
+		if (verbose)
+			printf("%llu %llu\n", frames, (unsigned long long)fill);
+		if (next.tv_sec > report.tv_sec ||
+		    (next.tv_sec == report.tv_sec && next.tv_nsec >= report.tv_nsec)) {
+			printf("%.1fs: fill avg %.1f, min %llu, max %llu frames, underruns %llu (%llu frames)\n",
+			       (double)frames / cons.shm->rate, fill_sum / periods,
+			       (unsigned long long)fill_min,
+			       (unsigned long long)fill_max,
+			       (unsigned long long)cons.shm->underruns, missing);
+			fflush(stdout);
+			fill_sum = 0;
+			periods = 0;
+			fill_min = ~0ULL;
+			fill_max = 0;
+			timespec_add_ns(&report, 1000000000LL);
+		}
+		if (run_time > 0 && frames >= run_time * cons.shm->rate)
+			break;
+	}
+	if (cons.out)
+		fclose(cons.out);
+	munmap(cons.shm, cons.map_size);
+	close(cons.fd);
+	free(cons.silence);
+	return EXIT_SUCCESS;
+}
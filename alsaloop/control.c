@@ -23,9 +23,34 @@
 
 #include <ctype.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <alsa/asoundlib.h>
 #include "alsaloop.h"
 
+#define CONTROL_HASH_SIZE	64	/* power of two */
+#define CONTROL_BATCH_MS	10	/* event coalescing window */
+
+#define CONTROL_PENDING_PLAY	(1 << 0)	/* playback -> capture */
+#define CONTROL_PENDING_CAPT	(1 << 1)	/* capture -> playback */
+
+/*
+ * The control events are only marked in the job thread, the values
+ * are mirrored from a helper thread (without the realtime priority)
+ * after a short window, so a volume sweep is applied in batches.
+ */
+struct loopback_ctlsync {
+	pthread_t thread;
+	unsigned int running:1;
+	int wake_fd;
+	int stop;
+	int queued;			/* the helper is woken */
+	snd_ctl_t *play_ctl;		/* own handles of the helper */
+	snd_ctl_t *capt_ctl;
+	snd_ctl_elem_value_t *value;
+	struct loopback_mixer *hash[2][CONTROL_HASH_SIZE];	/* src, dst */
+};
+
 static char *id_str(snd_ctl_elem_id_t *id)
 {
 	static char str[128];
@@ -209,6 +234,68 @@ static int copy_value(struct loopback_control *dst,
 	return 0;
 }
 
+/* the unknown types are always treated as changed */
+static int value_equal(snd_ctl_elem_info_t *info,
+		       snd_ctl_elem_value_t *v1, snd_ctl_elem_value_t *v2)
+{
+	unsigned int i, count = snd_ctl_elem_info_get_count(info);
+	snd_aes_iec958_t iec1, iec2;
+
+	switch (snd_ctl_elem_info_get_type(info)) {
+	case SND_CTL_ELEM_TYPE_BOOLEAN:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_boolean(v1, i) !=
+			    snd_ctl_elem_value_get_boolean(v2, i))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_INTEGER:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_integer(v1, i) !=
+			    snd_ctl_elem_value_get_integer(v2, i))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_INTEGER64:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_integer64(v1, i) !=
+			    snd_ctl_elem_value_get_integer64(v2, i))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_ENUMERATED:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_enumerated(v1, i) !=
+			    snd_ctl_elem_value_get_enumerated(v2, i))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_BYTES:
+		for (i = 0; i < count; i++)
+			if (snd_ctl_elem_value_get_byte(v1, i) !=
+			    snd_ctl_elem_value_get_byte(v2, i))
+				return 0;
+		return 1;
+	case SND_CTL_ELEM_TYPE_IEC958:
+		snd_ctl_elem_value_get_iec958(v1, &iec1);
+		snd_ctl_elem_value_get_iec958(v2, &iec2);
+		return memcmp(&iec1, &iec2, sizeof(iec1)) == 0;
+	default:
+		return 0;
+	}
+}
+
+/* FNV-1a over the fields compared by control_id_match() */
+static unsigned int id_hash(snd_ctl_elem_id_t *id)
+{
+	const unsigned char *s;
+	unsigned int h = 2166136261U;
+
+	for (s = (const unsigned char *)snd_ctl_elem_id_get_name(id); *s; s++)
+		h = (h ^ *s) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_index(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_interface(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_device(id)) * 16777619U;
+	h = (h ^ snd_ctl_elem_id_get_subdevice(id)) * 16777619U;
+	return h & (CONTROL_HASH_SIZE - 1);
+}
+
 static int oss_set(struct loopback *loop,
 		   struct loopback_ossmixer *ossmix,
 		   int enable)
@@ -309,6 +396,152 @@ static int control_init2(struct loopback *loop,
 	return 0;
 }
 
+/*
+ * The src and dst values keep the last mirrored value, so the events
+ * caused by the own writes are recognized and not mirrored back.
+ */
+static int control_sync(struct loopback_ctlsync *sync,
+			struct loopback_mixer *mix, int capture)
+{
+	struct loopback_control *from = capture ? &mix->dst : &mix->src;
+	struct loopback_control *to = capture ? &mix->src : &mix->dst;
+	snd_ctl_t *from_ctl = capture ? sync->capt_ctl : sync->play_ctl;
+	snd_ctl_t *to_ctl = capture ? sync->play_ctl : sync->capt_ctl;
+	int err;
+
+	snd_ctl_elem_value_set_id(sync->value, from->id);
+	err = snd_ctl_elem_read(from_ctl, sync->value);
+	if (err < 0) {
+		logit(LOG_CRIT, "Unable to read control value (event%i) '%s': %s\n", capture + 1, id_str(from->id), snd_strerror(err));
+		return err;
+	}
+	if (value_equal(from->info, sync->value, from->value))
+		return 0;
+	snd_ctl_elem_value_copy(from->value, sync->value);
+	copy_value(to, from);
+	err = snd_ctl_elem_write(to_ctl, to->value);
+	if (err < 0) {
+		logit(LOG_CRIT, "Unable to write control value (event%i) '%s': %s\n", capture + 1, id_str(to->id), snd_strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+static void *control_job(void *arg)
+{
+	struct loopback *loop = arg;
+	struct loopback_ctlsync *sync = loop->ctlsync;
+	struct loopback_mixer *mix;
+	struct pollfd pfd;
+	struct timespec ts;
+	unsigned int pending;
+	eventfd_t val;
+	int stop;
+
+	pfd.fd = sync->wake_fd;
+	pfd.events = POLLIN;
+	do {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		eventfd_read(sync->wake_fd, &val);
+		stop = __atomic_load_n(&sync->stop, __ATOMIC_ACQUIRE);
+		if (!stop) {
+			/* collect the following events of a sweep */
+			ts.tv_sec = 0;
+			ts.tv_nsec = CONTROL_BATCH_MS * 1000000L;
+			nanosleep(&ts, NULL);
+		}
+		__atomic_store_n(&sync->queued, 0, __ATOMIC_SEQ_CST);
+		for (mix = loop->controls; mix; mix = mix->next) {
+			pending = __atomic_exchange_n(&mix->pending, 0,
+						      __ATOMIC_ACQ_REL);
+			if (pending & CONTROL_PENDING_PLAY)
+				control_sync(sync, mix, 0);
+			if (pending & CONTROL_PENDING_CAPT)
+				control_sync(sync, mix, 1);
+		}
+	} while (!stop);
+	return NULL;
+}
+
+static void control_sync_done(struct loopback *loop)
+{
+	struct loopback_ctlsync *sync = loop->ctlsync;
+
+	if (sync == NULL)
+		return;
+	if (sync->running) {
+		__atomic_store_n(&sync->stop, 1, __ATOMIC_RELEASE);
+		eventfd_write(sync->wake_fd, 1);
+		pthread_join(sync->thread, NULL);
+	}
+	if (sync->play_ctl)
+		snd_ctl_close(sync->play_ctl);
+	if (sync->capt_ctl)
+		snd_ctl_close(sync->capt_ctl);
+	if (sync->value)
+		snd_ctl_elem_value_free(sync->value);
+	if (sync->wake_fd >= 0)
+		close(sync->wake_fd);
+	free(sync);
+	loop->ctlsync = NULL;
+}
+
+static int control_sync_init(struct loopback *loop)
+{
+	struct loopback_ctlsync *sync;
+	struct loopback_mixer *mix;
+	pthread_attr_t attr;
+	struct sched_param param;
+	unsigned int h;
+	int err;
+
+	sync = calloc(1, sizeof(*sync));
+	if (sync == NULL)
+		return -ENOMEM;
+	loop->ctlsync = sync;
+	sync->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sync->wake_fd < 0) {
+		err = -errno;
+		goto __error;
+	}
+	err = snd_ctl_elem_value_malloc(&sync->value);
+	if (err < 0)
+		goto __error;
+	err = snd_ctl_open(&sync->play_ctl, snd_ctl_name(loop->play->ctl), 0);
+	if (err < 0)
+		goto __error;
+	err = snd_ctl_open(&sync->capt_ctl, snd_ctl_name(loop->capt->ctl), 0);
+	if (err < 0)
+		goto __error;
+	for (mix = loop->controls; mix; mix = mix->next) {
+		if (mix->skip)
+			continue;
+		h = id_hash(mix->src.id);
+		mix->hash_next[0] = sync->hash[0][h];
+		sync->hash[0][h] = mix;
+		h = id_hash(mix->dst.id);
+		mix->hash_next[1] = sync->hash[1][h];
+		sync->hash[1][h] = mix;
+	}
+	/* the job thread may be realtime, the helper is not */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	param.sched_priority = 0;
+	pthread_attr_setschedparam(&attr, &param);
+	err = -pthread_create(&sync->thread, &attr, control_job, loop);
+	pthread_attr_destroy(&attr);
+	if (err < 0)
+		goto __error;
+	sync->running = 1;
+	return 0;
+      __error:
+	logit(LOG_CRIT, "%s: Unable to start the control helper: %s\n", loop->id, snd_strerror(err));
+	control_sync_done(loop);
+	return err;
+}
+
 int control_init(struct loopback *loop)
 {
 	struct loopback_mixer *mix;
@@ -335,6 +568,8 @@ int control_init(struct loopback *loop)
 			logit(LOG_WARNING, "%s: Disabling OSS mixer ID '%s'\n", loop->id, ossmix->oss_id);
 		}
 	}
+	if (loop->controls && loop->play->ctl && loop->capt->ctl)
+		return control_sync_init(loop);
 	return 0;
 }
 
@@ -344,6 +579,7 @@ int control_done(struct loopback *loop)
 	struct loopback_ossmixer *ossmix;
 	int err;
 
+	control_sync_done(loop);
 	if (loop->capt->ctl == NULL)
 		return 0;
 	for (ossmix = loop->oss_controls; ossmix; ossmix = ossmix->next) {
@@ -361,64 +597,36 @@ int control_done(struct loopback *loop)
 	return 0;
 }
 
-static int control_event1(struct loopback *loop,
-			  struct loopback_mixer *mix,
-			  snd_ctl_event_t *ev,
-			  int capture)
+/* called from the job thread, only marks the mixer for the helper */
+int control_event(struct loopback_handle *lhandle, snd_ctl_event_t *ev)
 {
+	struct loopback *loop = lhandle->loopback;
+	struct loopback_ctlsync *sync = loop->ctlsync;
 	unsigned int mask = snd_ctl_event_elem_get_mask(ev);
-	int err;
+	snd_ctl_elem_id_t *id2;
+	struct loopback_mixer *mix;
+	int capt = lhandle == loop->capt;
+	int wake = 0;
 
+	if (sync == NULL)
+		return 0;
 	if (mask == SND_CTL_EVENT_MASK_REMOVE)
 		return 0;
 	if ((mask & SND_CTL_EVENT_MASK_VALUE) == 0)
 		return 0;
-	if (!capture) {
-		snd_ctl_elem_value_set_id(mix->src.value, mix->src.id);
-		err = snd_ctl_elem_read(loop->play->ctl, mix->src.value);
-		if (err < 0) {
-			logit(LOG_CRIT, "Unable to read control value (event1) '%s': %s\n", id_str(mix->src.id), snd_strerror(err));
-			return err;
-		}
-		copy_value(&mix->dst, &mix->src);
-		err = snd_ctl_elem_write(loop->capt->ctl, mix->dst.value);
-		if (err < 0) {
-			logit(LOG_CRIT, "Unable to write control value (event1) '%s': %s\n", id_str(mix->dst.id), snd_strerror(err));
-			return err;
-		}
-	} else {
-		err = snd_ctl_elem_read(loop->capt->ctl, mix->dst.value);
-		if (err < 0) {
-			logit(LOG_CRIT, "Unable to read control value (event2) '%s': %s\n", id_str(mix->dst.id), snd_strerror(err));
-			return err;
-		}
-		copy_value(&mix->src, &mix->dst);
-		err = snd_ctl_elem_write(loop->play->ctl, mix->src.value);
-		if (err < 0) {
-			logit(LOG_CRIT, "Unable to write control value (event2) '%s': %s\n", id_str(mix->src.id), snd_strerror(err));
-			return err;
-		}
-	}
-	return 0;
-}
-
-int control_event(struct loopback_handle *lhandle, snd_ctl_event_t *ev)
-{
-	snd_ctl_elem_id_t *id2;
-	struct loopback_mixer *mix;
-	int capt = lhandle == lhandle->loopback->capt;
-	int err;
-
 	snd_ctl_elem_id_alloca(&id2);
 	snd_ctl_event_elem_get_id(ev, id2);
-	for (mix = lhandle->loopback->controls; mix; mix = mix->next) {
-		if (mix->skip)
-			continue;
+	for (mix = sync->hash[capt][id_hash(id2)]; mix;
+	     mix = mix->hash_next[capt]) {
 		if (control_id_match(id2, capt ? mix->dst.id : mix->src.id)) {
-			err = control_event1(lhandle->loopback, mix, ev, capt);
-			if (err < 0)
-				return err;
+			__atomic_fetch_or(&mix->pending,
+					  capt ? CONTROL_PENDING_CAPT :
+						 CONTROL_PENDING_PLAY,
+					  __ATOMIC_RELEASE);
+			wake = 1;
 		}
 	}
+	if (wake && !__atomic_exchange_n(&sync->queued, 1, __ATOMIC_SEQ_CST))
+		eventfd_write(sync->wake_fd, 1);
 	return 0;
 }
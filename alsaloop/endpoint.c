@@ -0,0 +1,275 @@
+/*
+ *  A simple PCM loopback utility - shared memory playback endpoint
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The endpoint replaces the playback PCM. The queued frames (head - tail)
+ * are the playback delay, the job is woken by a timer in the period
+ * interval. The stream is never stopped by an underrun, the consumer
+ * plays silence when the ring is empty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+#include "endpoint.h"
+
+struct loopback_endpoint {
+	int fd;
+	int timer_fd;
+	struct endpoint_shm *shm;
+	size_t map_size;
+	unsigned int size;		/* ring size in frames */
+};
+
+int endpoint_open(struct loopback_handle *lhandle)
+{
+	struct loopback_endpoint *ep;
+	int err;
+
+	ep = calloc(1, sizeof(*ep));
+	if (ep == NULL)
+		return -ENOMEM;
+	ep->fd = open(lhandle->device, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+	if (ep->fd < 0) {
+		err = -errno;
+		logit(LOG_CRIT, "%s: unable to create endpoint '%s': %s\n", lhandle->id, lhandle->device, snd_strerror(err));
+		free(ep);
+		return err;
+	}
+	ep->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ep->timer_fd < 0) {
+		err = -errno;
+		logit(LOG_CRIT, "%s: unable to create endpoint timer: %s\n", lhandle->id, snd_strerror(err));
+		close(ep->fd);
+		free(ep);
+		return err;
+	}
+	lhandle->endpoint = ep;
+	lhandle->card_number = -1;
+	lhandle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	return 0;
+}
+
+void endpoint_close(struct loopback_handle *lhandle)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+
+	if (ep == NULL)
+		return;
+	if (ep->shm) {
+		__atomic_store_n(&ep->shm->running, 0, __ATOMIC_RELEASE);
+		munmap(ep->shm, ep->map_size);
+	}
+	close(ep->timer_fd);
+	close(ep->fd);
+	free(ep);
+	lhandle->endpoint = NULL;
+}
+
+/* the period follows the requested latency like for the PCM */
+int endpoint_setparams(struct loopback_handle *lhandle,
+		       snd_pcm_uframes_t bufsize)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+	struct endpoint_shm *shm;
+	snd_pcm_uframes_t period, buffer;
+	unsigned int frame_size;
+	struct stat st;
+	size_t size;
+	void *map;
+
+	lhandle->rate = lhandle->rate_req;
+	lhandle->pitch = 1.0;
+	lhandle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	period = lhandle->period_size_req ? lhandle->period_size_req : bufsize;
+	if (period < 16)
+		period = 16;
+	buffer = lhandle->buffer_size_req ? lhandle->buffer_size_req : period * 8;
+	if (buffer < period * 2)
+		buffer = period * 2;
+	frame_size = (snd_pcm_format_physical_width(lhandle->format) / 8) *
+		     lhandle->channels;
+	size = sizeof(*shm) + buffer * frame_size;
+	if (size > ep->map_size) {
+		if (ep->shm)
+			munmap(ep->shm, ep->map_size);
+		ep->shm = NULL;
+		if (fstat(ep->fd, &st) < 0) {
+			logit(LOG_CRIT, "%s: unable to stat endpoint: %s\n", lhandle->id, strerror(errno));
+			return -errno;
+		}
+		/* a consumer may map the whole file, never shrink it */
+		if ((size_t)st.st_size > size)
+			size = st.st_size;
+		else if (ftruncate(ep->fd, size) < 0) {
+			logit(LOG_CRIT, "%s: unable to resize endpoint: %s\n", lhandle->id, strerror(errno));
+			return -errno;
+		}
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   ep->fd, 0);
+		if (map == MAP_FAILED) {
+			logit(LOG_CRIT, "%s: unable to map endpoint: %s\n", lhandle->id, strerror(errno));
+			return -errno;
+		}
+		ep->shm = map;
+		ep->map_size = size;
+	}
+	shm = ep->shm;
+	__atomic_store_n(&shm->running, 0, __ATOMIC_SEQ_CST);
+	shm->magic = ENDPOINT_MAGIC;
+	shm->version = ENDPOINT_VERSION;
+	shm->format = lhandle->format;
+	shm->rate = lhandle->rate;
+	shm->channels = lhandle->channels;
+	shm->frame_size = frame_size;
+	shm->size = buffer;
+	shm->period_size = period;
+	shm->map_size = ep->map_size;
+	/* the consumer resets the tail when it sees the new generation */
+	shm->head = 0;
+	__atomic_add_fetch(&shm->generation, 1, __ATOMIC_RELEASE);
+	ep->size = buffer;
+	lhandle->period_size = period;
+	lhandle->buffer_size = buffer;
+	lhandle->avail_min = period;
+	return 0;
+}
+
+int endpoint_start(struct loopback_handle *lhandle)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+	struct itimerspec its;
+	long usec;
+
+	usec = (long)((double)lhandle->period_size * 1000000 / lhandle->rate);
+	its.it_interval.tv_sec = usec / 1000000;
+	its.it_interval.tv_nsec = (usec % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(ep->timer_fd, 0, &its, NULL) < 0)
+		return -errno;
+	__atomic_store_n(&ep->shm->running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void endpoint_stop(struct loopback_handle *lhandle)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(ep->timer_fd, 0, &its, NULL);
+	if (ep->shm)
+		__atomic_store_n(&ep->shm->running, 0, __ATOMIC_RELEASE);
+}
+
+/* the tail may still be from the previous generation */
+snd_pcm_sframes_t endpoint_delay(struct loopback_handle *lhandle)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+	int64_t delay;
+
+	delay = ep->shm->head - __atomic_load_n(&ep->shm->tail, __ATOMIC_ACQUIRE);
+	if (delay < 0)
+		return 0;
+	if (delay > ep->size)
+		return ep->size;
+	return delay;
+}
+
+snd_pcm_sframes_t endpoint_avail(struct loopback_handle *lhandle)
+{
+	return lhandle->endpoint->size - endpoint_delay(lhandle);
+}
+
+void endpoint_status(struct loopback_handle *lhandle,
+		     snd_htimestamp_t *tstamp, snd_pcm_sframes_t *delay)
+{
+	clock_gettime(CLOCK_MONOTONIC, tstamp);
+	*delay = endpoint_delay(lhandle);
+}
+
+snd_pcm_sframes_t endpoint_write(struct loopback_handle *lhandle,
+				 const void *buf, snd_pcm_uframes_t size)
+{
+	struct loopback_endpoint *ep = lhandle->endpoint;
+	struct endpoint_shm *shm = ep->shm;
+	const char *src = buf;
+	snd_pcm_uframes_t avail, pos, r, res = 0;
+	uint64_t head = shm->head;
+
+	avail = endpoint_avail(lhandle);
+	if (size > avail)
+		size = avail;
+	while (size > 0) {
+		pos = head % ep->size;
+		r = ep->size - pos;
+		if (r > size)
+			r = size;
+		memcpy(shm->data + pos * lhandle->frame_size, src,
+		       r * lhandle->frame_size);
+		src += r * lhandle->frame_size;
+		head += r;
+		res += r;
+		size -= r;
+	}
+	__atomic_store_n(&shm->head, head, __ATOMIC_RELEASE);
+	return res;
+}
+
+int endpoint_poll_descriptors(struct loopback_handle *lhandle,
+			      struct pollfd *pfd)
+{
+	pfd->fd = lhandle->endpoint->timer_fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+	return 1;
+}
+
+unsigned short endpoint_revents(struct loopback_handle *lhandle,
+				struct pollfd *pfd)
+{
+	uint64_t expirations;
+
+	if ((pfd->revents & POLLIN) == 0)
+		return 0;
+	if (read(lhandle->endpoint->timer_fd, &expirations,
+		 sizeof(expirations)) < 0)
+		return 0;
+	return POLLOUT;
+}
+
+unsigned long long endpoint_underruns(struct loopback_handle *lhandle)
+{
+	return __atomic_load_n(&lhandle->endpoint->shm->underruns,
+			       __ATOMIC_RELAXED);
+}
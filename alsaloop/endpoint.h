@@ -0,0 +1,57 @@
+/*
+ *  A simple PCM loopback utility - shared memory endpoint layout
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The file is created by alsaloop (-N) and mapped by the consumer. The
+ * ring has one producer (alsaloop) and one consumer. The head and tail
+ * are free running frame counters, the consumer advances the tail when
+ * the frames are played, so the tail defines the playback clock.
+ *
+ * When the stream parameters change, alsaloop clears running, resets
+ * the head, updates the parameters, increments generation and sets
+ * running again. Only the consumer writes the tail, it resets the tail
+ * to zero when it sees a new generation. The file is never shrunk,
+ * map_size is the current file size.
+ */
+
+#include <stdint.h>
+
+#define ENDPOINT_MAGIC		0x50454c41	/* "ALEP" */
+#define ENDPOINT_VERSION	1
+
+struct endpoint_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t generation;		/* parameters change counter */
+	uint32_t running;		/* the producer streams */
+	int32_t format;			/* snd_pcm_format_t */
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t frame_size;		/* in bytes */
+	uint32_t size;			/* ring size in frames */
+	uint32_t period_size;		/* producer period in frames */
+	uint64_t map_size;		/* file size in bytes */
+	uint64_t head __attribute__((aligned(64)));	/* written frames */
+	uint64_t tail __attribute__((aligned(64)));	/* played frames */
+	uint64_t underruns;		/* counted by the consumer */
+	char data[] __attribute__((aligned(64)));	/* interleaved frames */
+};
@@ -0,0 +1,229 @@
+/*
+ *  A simple PCM loopback utility - round-trip latency measurement
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+/*
+ * The playback output must be connected back to the capture input
+ * (a cable or the snd-aloop driver). The captured samples are replaced
+ * with silence and a noise burst (marker) is injected periodically.
+ * The marker is found in the captured samples by the normalized
+ * cross-correlation, the distance from the injection point is the
+ * whole round-trip latency.
+ */
+
+#define MEASURE_MARKER		1024	/* marker length in frames */
+#define MEASURE_LEVEL		0.5	/* marker amplitude (-6dB) */
+#define MEASURE_GATE		0.01	/* energy gate (-20dB) */
+#define MEASURE_THRESHOLD	0.5	/* minimal correlation */
+
+enum {
+	MEASURE_IDLE = 0,
+	MEASURE_SEARCH,
+};
+
+struct loopback_measure {
+	snd_pcm_uframes_t interval;	/* in frames */
+	snd_pcm_uframes_t timeout;	/* in frames */
+	float marker[MEASURE_MARKER];
+	double marker_energy;
+	float hist[2 * MEASURE_MARKER];	/* channel 0, mirrored */
+	unsigned int hpos;
+	double energy;			/* energy of hist */
+	unsigned long long pos;		/* capture frame counter */
+	unsigned long long next;	/* next injection */
+	unsigned long long inject;	/* last injection */
+	int state;
+	double peak;
+	unsigned long long peak_pos;
+};
+
+static void measure_marker(struct loopback_measure *m)
+{
+	uint32_t seed = 0x12345678;
+	int i;
+
+	/* pseudo-random binary noise, sharp autocorrelation peak */
+	m->marker_energy = 0;
+	for (i = 0; i < MEASURE_MARKER; i++) {
+		seed = seed * 1664525 + 1013904223;
+		m->marker[i] = (seed & 0x80000000) ? MEASURE_LEVEL : -MEASURE_LEVEL;
+		m->marker_energy += m->marker[i] * m->marker[i];
+	}
+}
+
+int measure_start(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_measure *m = loop->measure;
+
+	if (capt->format != SND_PCM_FORMAT_S16 &&
+	    capt->format != SND_PCM_FORMAT_S32) {
+		logit(LOG_CRIT, "%s: latency measurement supports only %s or %s formats\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32));
+		return -EINVAL;
+	}
+	if (m == NULL) {
+		m = calloc(1, sizeof(*m));
+		if (m == NULL)
+			return -ENOMEM;
+		measure_marker(m);
+		loop->measure = m;
+	}
+	memset(m->hist, 0, sizeof(m->hist));
+	m->hpos = 0;
+	m->energy = 0;
+	m->interval = (unsigned long long)loop->measure_interval *
+					capt->rate / 1000;
+	if (m->interval < 2 * MEASURE_MARKER)
+		m->interval = 2 * MEASURE_MARKER;
+	/* one second or four times the expected latency */
+	m->timeout = capt->rate;
+	if (m->timeout < loop->latency * 4)
+		m->timeout = loop->latency * 4;
+	m->state = MEASURE_IDLE;
+	/* let the loop settle after start */
+	m->next = m->pos + capt->rate / 2;
+	return 0;
+}
+
+void measure_done(struct loopback *loop)
+{
+	free(loop->measure);
+	loop->measure = NULL;
+}
+
+static void measure_result(struct loopback *loop, long frames)
+{
+	struct loopback_metrics_data *data = &loop->metrics.live;
+	unsigned int rate = loop->capt->rate;
+
+	if (frames < 0) {
+		data->rtt_lost++;
+		snd_output_printf(loop->output, "%s: latency marker lost\n", loop->id);
+		return;
+	}
+	data->rtt = frames;
+	if (data->rtt_count == 0 || data->rtt_min > frames)
+		data->rtt_min = frames;
+	if (data->rtt_max < frames)
+		data->rtt_max = frames;
+	data->rtt_count++;
+	data->rtt_sum += frames;
+	data->rtt_sum2 += (double)frames * frames;
+	snd_output_printf(loop->output,
+		"%s: measured latency %li frames (%lius), expected %li frames (%lius)\n",
+		loop->id, frames, (long)(frames * 1000000LL / rate),
+		(long)loop->latency,
+		(long)(loop->latency * 1000000LL / loop->play->rate_req));
+}
+
+static void measure_sample(struct loopback *loop, struct loopback_measure *m,
+			   float x)
+{
+	const float *w;
+	double corr;
+	float old;
+	int i;
+
+	old = m->hist[m->hpos];
+	m->hist[m->hpos] = m->hist[m->hpos + MEASURE_MARKER] = x;
+	m->hpos = (m->hpos + 1) % MEASURE_MARKER;
+	m->energy += (double)x * x - (double)old * old;
+	m->pos++;
+	if (m->state != MEASURE_SEARCH)
+		return;
+	/* the window is hist[hpos .. hpos + MEASURE_MARKER - 1] */
+	if (m->energy > m->marker_energy * MEASURE_GATE) {
+		w = m->hist + m->hpos;
+		corr = 0;
+		for (i = 0; i < MEASURE_MARKER; i++)
+			corr += w[i] * m->marker[i];
+		/* the polarity may be inverted */
+		corr = fabs(corr) / sqrt(m->energy * m->marker_energy);
+		if (corr > m->peak) {
+			m->peak = corr;
+			m->peak_pos = m->pos - MEASURE_MARKER;
+		}
+	}
+	if (m->peak >= MEASURE_THRESHOLD &&
+	    m->pos > m->peak_pos + 2 * MEASURE_MARKER) {
+		measure_result(loop, m->peak_pos - m->inject);
+		m->state = MEASURE_IDLE;
+	} else if (m->pos > m->inject + m->timeout) {
+		measure_result(loop, -1);
+		m->state = MEASURE_IDLE;
+	}
+}
+
+/*
+ * Process the last captured samples in the capture buffer: search
+ * the marker, then replace the samples with silence or the marker.
+ */
+void measure_capture(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_measure *m = loop->measure;
+	snd_pcm_uframes_t pos;
+	unsigned long long idx;
+	unsigned int ch;
+	char *frame;
+	float x;
+
+	if (m == NULL || count > capt->buf_size)
+		return;
+	pos = (capt->buf_pos + capt->buf_size - count) % capt->buf_size;
+	while (count-- > 0) {
+		frame = capt->buf + pos * capt->frame_size;
+		if (capt->format == SND_PCM_FORMAT_S32)
+			x = *(int32_t *)frame / 2147483648.0f;
+		else
+			x = *(int16_t *)frame / 32768.0f;
+		idx = m->pos;
+		measure_sample(loop, m, x);
+		if (m->state == MEASURE_IDLE && idx >= m->next) {
+			m->state = MEASURE_SEARCH;
+			m->inject = idx;
+			m->next = idx + m->interval;
+			m->peak = 0;
+			m->peak_pos = 0;
+		}
+		x = 0;
+		if (m->state == MEASURE_SEARCH &&
+		    idx < m->inject + MEASURE_MARKER)
+			x = m->marker[idx - m->inject];
+		for (ch = 0; ch < capt->channels; ch++) {
+			if (capt->format == SND_PCM_FORMAT_S32)
+				((int32_t *)frame)[ch] = x * 2147483647.0f;
+			else
+				((int16_t *)frame)[ch] = x * 32767.0f;
+		}
+		pos = (pos + 1) % capt->buf_size;
+	}
+}
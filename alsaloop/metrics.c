@@ -0,0 +1,255 @@
+/*
+ *  A simple PCM loopback utility - live metrics
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+static char *metrics_path;
+static int metrics_sock = -1;
+static pthread_t metrics_thread;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct loopback **metrics_loops;
+static int metrics_loops_count;
+
+/*
+ * The job thread is the only writer. A seqlock is used, so the job
+ * thread never waits for the readers.
+ */
+void metrics_publish(struct loopback *loop)
+{
+	struct loopback_metrics *m = &loop->metrics;
+
+	m->seq++;
+	__sync_synchronize();
+	memcpy(&m->snap, &m->live, sizeof(m->snap));
+	__sync_synchronize();
+	m->seq++;
+}
+
+static void metrics_snapshot(struct loopback *loop,
+			     struct loopback_metrics_data *data)
+{
+	struct loopback_metrics *m = &loop->metrics;
+	unsigned int seq;
+
+	do {
+		while ((seq = m->seq) & 1)
+			sched_yield();
+		__sync_synchronize();
+		memcpy(data, &m->snap, sizeof(*data));
+		__sync_synchronize();
+	} while (seq != m->seq);
+}
+
+long metrics_percentile(const unsigned int *hist, unsigned int percent)
+{
+	unsigned long long total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < METRICS_HIST_SIZE; i++)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+	for (i = 0; i < METRICS_HIST_SIZE; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * percent)
+			break;
+	}
+	/* upper bound of the bucket */
+	return i > 0 ? 1L << i : 0;
+}
+
+/* called with metrics_lock held, the loops cannot be freed */
+static void metrics_format(FILE *out)
+{
+	struct loopback_metrics_data data;
+	struct loopback *loop;
+	int i, j;
+
+	for (i = 0; i < metrics_loops_count; i++) {
+		loop = metrics_loops[i];
+		metrics_snapshot(loop, &data);
+		fprintf(out, "loop=%i thread=%i capture=%s playback=%s "
+			"running=%i rate=%u wakeups=%llu "
+			"play_xruns=%u capt_xruns=%u reinits=%u "
+			"latency=%li latency_min=%li latency_max=%li "
+			"pitch=%.8f play_fill=%lu capt_fill=%lu "
+			"proc_p50=%li proc_p90=%li proc_p99=%li proc_max=%li "
+			"rtt=%li rtt_min=%li rtt_max=%li rtt_count=%u rtt_lost=%u "
+			"wake_late=%li wake_late_max=%li wake_missed=%u "
+			"conceal_frames=%llu conceal_fades=%u "
+			"read_p99=%li convert_p99=%li write_p99=%li "
+			"read_usec=%llu convert_usec=%llu write_usec=%llu "
+			"cpu_usec=%llu capt_frames=%llu play_frames=%llu "
+			"proc_hist=",
+			i, loop->thread, loop->capt->device, loop->play->device,
+			data.running, loop->play->rate_req, data.wakeups,
+			data.play_xruns, data.capt_xruns, data.reinits,
+			data.latency, data.latency_min, data.latency_max,
+			data.pitch, data.play_fill, data.capt_fill,
+			metrics_percentile(data.proctime, 50),
+			metrics_percentile(data.proctime, 90),
+			metrics_percentile(data.proctime, 99),
+			data.proctime_max,
+			data.rtt, data.rtt_min, data.rtt_max,
+			data.rtt_count, data.rtt_lost,
+			data.wake_late, data.wake_late_max, data.wake_missed,
+			data.conceal_frames, data.conceal_fades,
+			metrics_percentile(data.proc_hist[PROC_READ], 99),
+			metrics_percentile(data.proc_hist[PROC_CONVERT], 99),
+			metrics_percentile(data.proc_hist[PROC_WRITE], 99),
+			data.proc_sum[PROC_READ] / 1000,
+			data.proc_sum[PROC_CONVERT] / 1000,
+			data.proc_sum[PROC_WRITE] / 1000,
+			data.cpu_time / 1000,
+			data.capt_frames, data.play_frames);
+		for (j = 0; j < METRICS_HIST_SIZE; j++)
+			fprintf(out, "%s%u", j > 0 ? "," : "",
+				data.proctime[j]);
+		fprintf(out, "\n");
+	}
+}
+
+/*
+ * The report is formatted to memory under the lock and written after,
+ * a client which does not read cannot block the configuration reload.
+ */
+static void metrics_dump(FILE *out)
+{
+	char *text = NULL;
+	size_t size = 0;
+	FILE *mem;
+
+	mem = open_memstream(&text, &size);
+	if (mem == NULL)
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics_format(mem);
+	pthread_mutex_unlock(&metrics_lock);
+	fclose(mem);
+	fwrite(text, 1, size, out);
+	free(text);
+}
+
+static void *metrics_job(void *arg)
+{
+	FILE *out;
+	int fd;
+
+	while (1) {
+		fd = accept(metrics_sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			logit(LOG_CRIT, "Metrics accept failed: %s\n", strerror(errno));
+			break;
+		}
+		out = fdopen(fd, "w");
+		if (out == NULL) {
+			close(fd);
+			continue;
+		}
+		metrics_dump(out);
+		fclose(out);
+	}
+	return NULL;
+}
+
+/*
+ * Replace the list of reported loops (configuration reload).
+ * When this returns, no reader references the old loops.
+ */
+void metrics_set_loops(struct loopback **loops, int count)
+{
+	struct loopback **copy;
+
+	copy = malloc(count * sizeof(*copy));
+	if (copy == NULL && count > 0) {
+		logit(LOG_CRIT, "No enough memory\n");
+		count = 0;
+	}
+	if (count > 0)
+		memcpy(copy, loops, count * sizeof(*copy));
+	pthread_mutex_lock(&metrics_lock);
+	free(metrics_loops);
+	metrics_loops = copy;
+	metrics_loops_count = count;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static void metrics_done(void)
+{
+	if (metrics_path)
+		unlink(metrics_path);
+}
+
+int metrics_init(const char *path, struct loopback **loops, int count)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logit(LOG_CRIT, "Metrics socket path '%s' is too long\n", path);
+		return -EINVAL;
+	}
+	metrics_set_loops(loops, count);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	metrics_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics_sock < 0) {
+		err = -errno;
+		logit(LOG_CRIT, "Unable to create metrics socket: %s\n", strerror(-err));
+		return err;
+	}
+	unlink(path);
+	if (bind(metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(metrics_sock, 4) < 0) {
+		err = -errno;
+		logit(LOG_CRIT, "Unable to listen on metrics socket '%s': %s\n", path, strerror(-err));
+		close(metrics_sock);
+		metrics_sock = -1;
+		return err;
+	}
+	metrics_path = strdup(path);
+	atexit(metrics_done);
+	/* a scraper may disconnect before the whole dump is written */
+	signal(SIGPIPE, SIG_IGN);
+	err = pthread_create(&metrics_thread, NULL, metrics_job, NULL);
+	if (err) {
+		logit(LOG_CRIT, "Unable to create metrics thread: %s\n", strerror(err));
+		return -err;
+	}
+	use_metrics = 1;
+	return 0;
+}
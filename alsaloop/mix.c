@@ -0,0 +1,156 @@
+/*
+ *  A simple PCM loopback utility - mixing kernels
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "alsaloop.h"
+
+/*
+ * The inputs are summed to a wide accumulator (32-bit for S16,
+ * 64-bit for S32) and the result is saturated once, so the result
+ * does not depend on the order of the inputs.
+ */
+
+static void mix_sum_s16(int32_t *sum, const int16_t *src,
+			unsigned int samples, int gain)
+{
+	unsigned int i = 0;
+
+#ifdef __SSE2__
+	if (gain == MIX_GAIN_UNITY) {
+		for (; i + 8 <= samples; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+			__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+			__m128i *s = (__m128i *)(sum + i);
+			_mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), lo));
+			_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), hi));
+		}
+	} else {
+		__m128i g = _mm_set1_epi16(gain);
+		for (; i + 8 <= samples; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+			/* 16x16 -> 32 bit products */
+			__m128i pl = _mm_mullo_epi16(x, g);
+			__m128i ph = _mm_mulhi_epi16(x, g);
+			__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(pl, ph), MIX_GAIN_SHIFT);
+			__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(pl, ph), MIX_GAIN_SHIFT);
+			__m128i *s = (__m128i *)(sum + i);
+			_mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), lo));
+			_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), hi));
+		}
+	}
+#endif
+	if (gain == MIX_GAIN_UNITY) {
+		for (; i < samples; i++)
+			sum[i] += src[i];
+	} else {
+		for (; i < samples; i++)
+			sum[i] += ((int32_t)src[i] * gain) >> MIX_GAIN_SHIFT;
+	}
+}
+
+static void mix_out_s16(int16_t *dst, const int32_t *sum,
+			unsigned int samples)
+{
+	unsigned int i = 0;
+	int32_t v;
+
+#ifdef __SSE2__
+	for (; i + 8 <= samples; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(sum + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(sum + i + 4));
+		/* saturating pack */
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+	for (; i < samples; i++) {
+		v = sum[i];
+		if (v > INT16_MAX)
+			v = INT16_MAX;
+		else if (v < INT16_MIN)
+			v = INT16_MIN;
+		dst[i] = v;
+	}
+}
+
+static void mix_sum_s32(int64_t *sum, const int32_t *src,
+			unsigned int samples, int gain)
+{
+	unsigned int i;
+
+	if (gain == MIX_GAIN_UNITY) {
+		for (i = 0; i < samples; i++)
+			sum[i] += src[i];
+	} else {
+		for (i = 0; i < samples; i++)
+			sum[i] += ((int64_t)src[i] * gain) >> MIX_GAIN_SHIFT;
+	}
+}
+
+static void mix_out_s32(int32_t *dst, const int64_t *sum,
+			unsigned int samples)
+{
+	unsigned int i;
+	int64_t v;
+
+	for (i = 0; i < samples; i++) {
+		v = sum[i];
+		if (v > INT32_MAX)
+			v = INT32_MAX;
+		else if (v < INT32_MIN)
+			v = INT32_MIN;
+		dst[i] = v;
+	}
+}
+
+/* the sum buffer must hold 8 bytes per sample */
+void mix_sum(snd_pcm_format_t format, void *sum, unsigned int offset,
+	     const void *src, unsigned int samples, int gain)
+{
+	if (format == SND_PCM_FORMAT_S32)
+		mix_sum_s32((int64_t *)sum + offset, src, samples, gain);
+	else
+		mix_sum_s16((int32_t *)sum + offset, src, samples, gain);
+}
+
+void mix_out(snd_pcm_format_t format, void *dst, const void *sum,
+	     unsigned int samples)
+{
+	if (format == SND_PCM_FORMAT_S32)
+		mix_out_s32(dst, sum, samples);
+	else
+		mix_out_s16(dst, sum, samples);
+}
+
+void mix_clear(snd_pcm_format_t format, void *sum, unsigned int samples)
+{
+	memset(sum, 0, samples * (format == SND_PCM_FORMAT_S32 ?
+					sizeof(int64_t) : sizeof(int32_t)));
+}
@@ -24,20 +24,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sched.h>
 #include <errno.h>
 #include <getopt.h>
 #include <alsa/asoundlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include "alsaloop.h"
 
 #define XRUN_PROFILE_UNKNOWN (-10000000)
 
 static int set_rate_shift(struct loopback_handle *lhandle, double pitch);
 static int get_rate(struct loopback_handle *lhandle);
+static int bus_setparams(struct loopback *loop, snd_pcm_uframes_t bufsize);
+static snd_pcm_sframes_t bus_flush(struct loopback_bus *bus);
+static int fanout_setparams(struct loopback *loop, snd_pcm_uframes_t bufsize);
+static int fanout_start(struct loopback_fanout *fan);
+static snd_pcm_sframes_t fanout_read(struct loopback_fanout *fan,
+				     struct loopback *self);
 
 #define SYNCTYPE(v) [SYNC_TYPE_##v] = #v
 
@@ -50,6 +59,13 @@ static const char *sync_types[] = {
 	SYNCTYPE(AUTO)
 };
 
+#define DRIFTTYPE(v) [DRIFT_TYPE_##v] = #v
+
+static const char *drift_types[] = {
+	DRIFTTYPE(AVERAGE),
+	DRIFTTYPE(PI)
+};
+
 #define SRCTYPE(v) [SRC_##v] = "SRC_" #v
 
 #ifdef USE_SAMPLERATE
@@ -88,9 +104,14 @@ static inline void pcm_open_unlock(void)
 	        pthread_mutex_unlock(&pcm_open_mutex);
 }
 
-static inline snd_pcm_uframes_t get_whole_latency(struct loopback *loop)
+/* the mixing bus and fan-out handles are not loop members */
+static inline int is_playback(struct loopback_handle *lhandle)
 {
-	return loop->latency;
+	struct loopback_handle *capt = lhandle->loopback->capt;
+
+	if (capt->fanout && lhandle == capt->fanout->capt)
+		return 0;
+	return lhandle != capt;
 }
 
 static inline unsigned long long
@@ -106,6 +127,23 @@ static inline snd_pcm_uframes_t time_to_frames(unsigned int rate,
 	return (time * rate) / 1000000ULL;
 }
 
+/* the playback delay and avail for the PCM or the shared memory endpoint */
+static int pcm_delay(struct loopback_handle *lhandle, snd_pcm_sframes_t *delay)
+{
+	if (lhandle->endpoint) {
+		*delay = endpoint_delay(lhandle);
+		return 0;
+	}
+	return snd_pcm_delay(lhandle->handle, delay);
+}
+
+static snd_pcm_sframes_t pcm_avail_update(struct loopback_handle *lhandle)
+{
+	if (lhandle->endpoint)
+		return endpoint_avail(lhandle);
+	return snd_pcm_avail_update(lhandle->handle);
+}
+
 static int setparams_stream(struct loopback_handle *lhandle,
 			    snd_pcm_hw_params_t *params)
 {
@@ -247,7 +285,7 @@ static int setparams_set(struct loopback_handle *lhandle,
 	snd_pcm_hw_params_get_period_size(params, &period_size, NULL);
 	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
 	if (lhandle->nblock) {
-		if (lhandle == lhandle->loopback->play) {
+		if (is_playback(lhandle)) {
 			val = buffer_size - (2 * period_size - 4);
 		} else {
 			val = 4;
@@ -255,7 +293,7 @@ static int setparams_set(struct loopback_handle *lhandle,
 		if (verbose > 6)
 			snd_output_printf(lhandle->loopback->output, "%s: avail_min1=%li\n", lhandle->id, val);
 	} else {
-		if (lhandle == lhandle->loopback->play) {
+		if (is_playback(lhandle)) {
 			val = bufsize + bufsize / 2;
 			if (val > (buffer_size * 3) / 4)
 				val = (buffer_size * 3) / 4;
@@ -273,6 +311,24 @@ static int setparams_set(struct loopback_handle *lhandle,
 		logit(LOG_CRIT, "Unable to set avail min for %s: %s\n", lhandle->id, snd_strerror(err));
 		return err;
 	}
+	/* the trace records the status htstamp, too */
+	if (lhandle->loopback->drift == DRIFT_TYPE_PI ||
+	    lhandle->loopback->mix || lhandle->loopback->fanout ||
+	    lhandle->loopback->trace_file) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to enable timestamps for %s: %s\n", lhandle->id, snd_strerror(err));
+			return err;
+		}
+	}
+	/* the endpoint timestamps are monotonic */
+	if (lhandle->loopback->endpoint) {
+		err = snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+		if (err < 0) {
+			logit(LOG_CRIT, "Unable to set monotonic timestamps for %s: %s\n", lhandle->id, snd_strerror(err));
+			return err;
+		}
+	}
 	snd_pcm_sw_params_get_avail_min(swparams, &lhandle->avail_min);
 	err = snd_pcm_sw_params(handle, swparams);
 	if (err < 0) {
@@ -295,29 +351,42 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 	snd_pcm_hw_params_alloca(&ct_params);
 	snd_pcm_sw_params_alloca(&p_swparams);
 	snd_pcm_sw_params_alloca(&c_swparams);
-	if ((err = setparams_stream(loop->play, pt_params)) < 0) {
+	if (loop->play->bus) {
+		if ((err = bus_setparams(loop, bufsize)) < 0)
+			return err;
+	} else if (loop->play->endpoint) {
+		if ((err = endpoint_setparams(loop->play, bufsize)) < 0)
+			return err;
+	} else if ((err = setparams_stream(loop->play, pt_params)) < 0) {
 		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_stream(loop->capt, ct_params)) < 0) {
+	if (loop->capt->fanout) {
+		if ((err = fanout_setparams(loop, bufsize)) < 0)
+			return err;
+	} else if ((err = setparams_stream(loop->capt, ct_params)) < 0) {
 		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
-	if ((err = setparams_bufsize(loop->play, p_params, pt_params, bufsize / loop->play->pitch)) < 0) {
+	if (!loop->play->bus && !loop->play->endpoint &&
+	    (err = setparams_bufsize(loop->play, p_params, pt_params, bufsize / loop->play->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_bufsize(loop->capt, c_params, ct_params, bufsize / loop->capt->pitch)) < 0) {
+	if (!loop->capt->fanout &&
+	    (err = setparams_bufsize(loop->capt, c_params, ct_params, bufsize / loop->capt->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
-	if ((err = setparams_set(loop->play, p_params, p_swparams, bufsize / loop->play->pitch)) < 0) {
+	if (!loop->play->bus && !loop->play->endpoint &&
+	    (err = setparams_set(loop->play, p_params, p_swparams, bufsize / loop->play->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = setparams_set(loop->capt, c_params, c_swparams, bufsize / loop->capt->pitch)) < 0) {
+	if (!loop->capt->fanout &&
+	    (err = setparams_set(loop->capt, c_params, c_swparams, bufsize / loop->capt->pitch)) < 0) {
 		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
@@ -327,17 +396,22 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 		if (snd_pcm_link(loop->capt->handle, loop->play->handle) >= 0)
 			loop->linked = 1;
 #endif
-	if ((err = snd_pcm_prepare(loop->play->handle)) < 0) {
+	if (!loop->play->bus && !loop->play->endpoint &&
+	    (err = snd_pcm_prepare(loop->play->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if (!loop->linked && (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
+	if (!loop->linked && !loop->capt->fanout &&
+	    (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
 	if (verbose) {
-		snd_pcm_dump(loop->play->handle, loop->output);
+		if (loop->play->endpoint)
+			snd_output_printf(loop->output, "%s: endpoint '%s', period %u, buffer %u\n", loop->play->id, loop->play->device, loop->play->period_size, loop->play->buffer_size);
+		else
+			snd_pcm_dump(loop->play->handle, loop->output);
 		snd_pcm_dump(loop->capt->handle, loop->output);
 	}
 	return 0;
@@ -378,7 +452,7 @@ static void xrun_profile0(struct loopback *loop)
 {
 	snd_pcm_sframes_t pdelay, cdelay;
 
-	if (snd_pcm_delay(loop->play->handle, &pdelay) >= 0 &&
+	if (pcm_delay(loop->play, &pdelay) >= 0 &&
 	    snd_pcm_delay(loop->capt->handle, &cdelay) >= 0) {
 		getcurtimestamp(&loop->xrun_last_update);
 		loop->xrun_last_pdelay = pdelay;
@@ -447,6 +521,79 @@ static inline void xrun_stats(struct loopback *loop)
 		xrun_stats0(loop);
 }
 
+static void metrics_latency(struct loopback *loop, long latency)
+{
+	struct loopback_metrics_data *m = &loop->metrics.live;
+
+	m->latency = latency;
+	if (m->latency_min < 0 || m->latency_min > latency)
+		m->latency_min = latency;
+	if (m->latency_max < latency)
+		m->latency_max = latency;
+}
+
+static inline unsigned long long proc_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account the time since *t to the given phase */
+static inline void proc_mark(struct loopback *loop, int phase,
+			     unsigned long long *t)
+{
+	unsigned long long now = proc_clock(CLOCK_MONOTONIC);
+
+	loop->proc_phase[phase] += now - *t;
+	*t = now;
+}
+
+/* the transfer results may be negative error codes */
+static inline void metrics_frames(struct loopback *loop,
+				  snd_pcm_sframes_t capt,
+				  snd_pcm_sframes_t play)
+{
+	if (capt > 0)
+		loop->metrics.live.capt_frames += capt;
+	if (play > 0)
+		loop->metrics.live.play_frames += play;
+}
+
+static void hist_add(unsigned int *hist, long usec)
+{
+	int idx;
+
+	for (idx = 0; usec > 0 && idx < METRICS_HIST_SIZE - 1; idx++)
+		usec >>= 1;
+	hist[idx]++;
+}
+
+static void metrics_update(struct loopback *loop, long proctime,
+			   unsigned long long cpu_time)
+{
+	struct loopback_metrics_data *m = &loop->metrics.live;
+	int i;
+
+	m->wakeups++;
+	m->running = loop->running;
+	m->pitch = loop->pitch;
+	m->play_fill = loop->play->buf_count;
+	m->capt_fill = loop->capt->buf_count;
+	if (m->proctime_max < proctime)
+		m->proctime_max = proctime;
+	hist_add(m->proctime, proctime);
+	for (i = 0; i < PROC_LAST; i++) {
+		hist_add(m->proc_hist[i], loop->proc_phase[i] / 1000);
+		m->proc_sum[i] += loop->proc_phase[i];
+		loop->proc_phase[i] = 0;
+	}
+	m->cpu_time += cpu_time;
+	if (use_metrics)
+		metrics_publish(loop);
+}
+
 static inline snd_pcm_uframes_t buf_avail(struct loopback_handle *lhandle)
 {
 	return lhandle->buf_size - lhandle->buf_count;
@@ -501,12 +648,46 @@ static void buf_add_copy(struct loopback *loop)
 }
 #endif
 
+static void buf_add_route(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t count, count1, cpos, ppos;
+
+	count = capt->buf_count;
+	cpos = capt->buf_pos - count;
+	if (cpos > capt->buf_size)
+		cpos += capt->buf_size;
+	ppos = (play->buf_pos + play->buf_count) % play->buf_size;
+	while (count > 0) {
+		count1 = count;
+		if (count1 + cpos > capt->buf_size)
+			count1 = capt->buf_size - cpos;
+		if (count1 > buf_avail(play))
+			count1 = buf_avail(play);
+		if (count1 + ppos > play->buf_size)
+			count1 = play->buf_size - ppos;
+		if (count1 == 0)
+			break;
+		route_frames(loop->route, play->format,
+			     play->buf + ppos * play->frame_size,
+			     capt->buf + cpos * capt->frame_size, count1);
+		play->buf_count += count1;
+		capt->buf_count -= count1;
+		ppos += count1;
+		ppos %= play->buf_size;
+		cpos += count1;
+		cpos %= capt->buf_size;
+		count -= count1;
+	}
+}
+
 #ifdef USE_SAMPLERATE
 static void buf_add_src(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
 	struct loopback_handle *play = loop->play;
-	float *old_data_out;
+	float *old_data_out, *data_in;
 	snd_pcm_uframes_t count, pos, count1, pos1;
 	count = capt->buf_count;
 	pos = 0;
@@ -517,18 +698,23 @@ static void buf_add_src(struct loopback *loop)
 		count1 = count;
 		if (count1 + pos1 > capt->buf_size)
 			count1 = capt->buf_size - pos1;
+		/* the routed frames are converted to the playback channels */
+		data_in = loop->route ? loop->route_data :
+			  loop->src_in + pos * capt->channels;
 		if (capt->format == SND_PCM_FORMAT_S32)
 			src_int_to_float_array((int *)(capt->buf +
 						pos1 * capt->frame_size),
-					 loop->src_data.data_in +
-					   pos * capt->channels,
+					 data_in,
 					 count1 * capt->channels);
 		else
 			src_short_to_float_array((short *)(capt->buf +
 						pos1 * capt->frame_size),
-					 loop->src_data.data_in +
-					   pos * capt->channels,
+					 data_in,
 					 count1 * capt->channels);
+		if (loop->route)
+			route_frames_float(loop->route,
+					   loop->src_in + pos * play->channels,
+					   data_in, count1);
 		count -= count1;
 		pos += count1;
 		pos1 += count1;
@@ -597,8 +783,12 @@ static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 	/* copy samples from capture to playback buffer */
 	if (count <= 0)
 		return;
+	if (loop->measure)
+		measure_capture(loop, count);
 	if (loop->play->buf == loop->capt->buf) {
 		loop->play->buf_count += count;
+	} else if (loop->route && !loop->use_samplerate) {
+		buf_add_route(loop);
 	} else {
 		buf_add_src(loop);
 	}
@@ -608,15 +798,21 @@ static int xrun(struct loopback_handle *lhandle)
 {
 	int err;
 
-	if (lhandle == lhandle->loopback->play) {
+	if (is_playback(lhandle)) {
 		logit(LOG_DEBUG, "underrun for %s\n", lhandle->id);
+		lhandle->loopback->metrics.live.play_xruns++;
 		xrun_stats(lhandle->loopback);
+		if (lhandle->loopback->trace)
+			trace_xrun(lhandle->loopback, 1);
 		if ((err = snd_pcm_prepare(lhandle->handle)) < 0)
 			return err;
 		lhandle->xrun_pending = 1;
 	} else {
 		logit(LOG_DEBUG, "overrun for %s\n", lhandle->id);
+		lhandle->loopback->metrics.live.capt_xruns++;
 		xrun_stats(lhandle->loopback);
+		if (lhandle->loopback->trace)
+			trace_xrun(lhandle->loopback, 0);
 		if ((err = snd_pcm_prepare(lhandle->handle)) < 0)
 			return err;
 		lhandle->xrun_pending = 1;
@@ -635,12 +831,253 @@ static int suspend(struct loopback_handle *lhandle)
 	return 0;
 }
 
+static inline snd_pcm_sframes_t pcm_readi(struct loopback_handle *lhandle,
+					  void *buf, snd_pcm_uframes_t size)
+{
+	if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return snd_pcm_mmap_readi(lhandle->handle, buf, size);
+	return snd_pcm_readi(lhandle->handle, buf, size);
+}
+
+static inline snd_pcm_sframes_t pcm_writei(struct loopback_handle *lhandle,
+					   const void *buf,
+					   snd_pcm_uframes_t size)
+{
+	if (lhandle->endpoint)
+		return endpoint_write(lhandle, buf, size);
+	if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return snd_pcm_mmap_writei(lhandle->handle, buf, size);
+	return snd_pcm_writei(lhandle->handle, buf, size);
+}
+
+/*
+ * The split mode - the capture is read in own thread to the lock-free
+ * ring, so a slow playback write does not delay the capture read. The
+ * job thread moves the ring contents to the capture buffer in readit().
+ * The streams are handled in the job thread when the capture thread is
+ * not running (xrun, suspend, start and stop).
+ */
+static int split_init(struct loopback *loop)
+{
+	struct loopback_split *split;
+
+	/* head and tail are on separate cache lines */
+	if (posix_memalign((void **)&split, 64, sizeof(*split)))
+		return -ENOMEM;
+	memset(split, 0, sizeof(*split));
+	split->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (split->wake_fd < 0) {
+		free(split);
+		return -errno;
+	}
+	loop->capt->split = split;
+	return 0;
+}
+
+static void split_done(struct loopback *loop)
+{
+	struct loopback_split *split = loop->capt->split;
+
+	if (split == NULL)
+		return;
+	close(split->wake_fd);
+	free(split->ring);
+	free(split->fds);
+	free(split);
+	loop->capt->split = NULL;
+}
+
+static int split_setparams(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_split *split = capt->split;
+
+	free(split->ring);
+	free(split->fds);
+	split->size = capt->buf_size;
+	split->ring = malloc(split->size * capt->frame_size);
+	split->pollfd_count = capt->pollfd_count;
+	split->fds = calloc(split->pollfd_count + 1, sizeof(struct pollfd));
+	if (split->ring == NULL || split->fds == NULL)
+		return -ENOMEM;
+	split->fds[0].fd = split->wake_fd;
+	split->fds[0].events = POLLIN;
+	return 0;
+}
+
+static inline void split_wake(struct loopback_split *split)
+{
+	eventfd_write(split->wake_fd, 1);
+}
+
+static void *split_job(void *arg)
+{
+	struct loopback_handle *capt = arg;
+	struct loopback_split *split = capt->split;
+	snd_pcm_uframes_t head = split->head, tail, room, pos;
+	snd_pcm_sframes_t avail, r;
+	unsigned short revents;
+	eventfd_t val;
+	nfds_t nfds;
+
+	while (!__atomic_load_n(&split->stop, __ATOMIC_ACQUIRE)) {
+		avail = snd_pcm_avail_update(capt->handle);
+		if (avail < 0)
+			break;
+		if (avail == 0 &&
+		    snd_pcm_state(capt->handle) != SND_PCM_STATE_RUNNING)
+			break;
+		tail = __atomic_load_n(&split->tail, __ATOMIC_ACQUIRE);
+		room = split->size - (head - tail);
+		if (avail > 0 && room == 0) {
+			/* the samples are kept in the device buffer */
+			__atomic_store_n(&split->full, 1, __ATOMIC_SEQ_CST);
+			tail = __atomic_load_n(&split->tail, __ATOMIC_SEQ_CST);
+			room = split->size - (head - tail);
+			if (room == 0) {
+				split->overruns++;
+				nfds = 1;
+				goto __wait;
+			}
+			__atomic_store_n(&split->full, 0, __ATOMIC_RELAXED);
+		}
+		if ((snd_pcm_uframes_t)avail > room)
+			avail = room;
+		while (avail > 0) {
+			pos = head % split->size;
+			r = split->size - pos;
+			if (r > avail)
+				r = avail;
+			r = pcm_readi(capt, split->ring + pos * capt->frame_size, r);
+			/* the errors are reported by the next avail update */
+			if (r <= 0)
+				break;
+			head += r;
+			__atomic_store_n(&split->head, head, __ATOMIC_RELEASE);
+			avail -= r;
+		}
+		nfds = split->pollfd_count + 1;
+	      __wait:
+		if (poll(split->fds, nfds, -1) < 0) {
+			if (errno != EINTR)
+				break;
+			continue;
+		}
+		if (split->fds[0].revents & POLLIN)
+			eventfd_read(split->wake_fd, &val);
+		if (nfds > 1)
+			snd_pcm_poll_descriptors_revents(capt->handle,
+							 split->fds + 1,
+							 split->pollfd_count,
+							 &revents);
+	}
+	__atomic_store_n(&split->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int split_start(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_split *split = capt->split;
+	eventfd_t val;
+	int err;
+
+	if (split->running)
+		return 0;
+	err = snd_pcm_poll_descriptors(capt->handle, split->fds + 1,
+				       split->pollfd_count);
+	if (err < 0)
+		return err;
+	eventfd_read(split->wake_fd, &val);
+	split->head = split->tail = 0;
+	split->stop = split->done = split->full = 0;
+	err = pthread_create(&split->thread, NULL, split_job, capt);
+	if (err) {
+		logit(LOG_CRIT, "%s: unable to create the capture thread: %s\n", loop->id, strerror(err));
+		return -err;
+	}
+	split->running = 1;
+	return 0;
+}
+
+/* move the captured samples from the ring to the capture buffer */
+static snd_pcm_sframes_t split_read(struct loopback_handle *lhandle)
+{
+	struct loopback_split *split = lhandle->split;
+	snd_pcm_uframes_t head, tail = split->tail, avail, pos, r;
+	snd_pcm_sframes_t res = 0;
+
+	head = __atomic_load_n(&split->head, __ATOMIC_ACQUIRE);
+	avail = head - tail;
+	/* the rest stays in the ring for the next call */
+	if (avail > buf_avail(lhandle))
+		avail = buf_avail(lhandle);
+	while (avail > 0) {
+		pos = tail % split->size;
+		r = split->size - pos;
+		if (r + lhandle->buf_pos > lhandle->buf_size)
+			r = lhandle->buf_size - lhandle->buf_pos;
+		if (r > avail)
+			r = avail;
+		memcpy(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
+		       split->ring + pos * lhandle->frame_size,
+		       r * lhandle->frame_size);
+#ifdef FILE_CWRITE
+		if (lhandle->loopback->cfile)
+			fwrite(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
+			       r, lhandle->frame_size, lhandle->loopback->cfile);
+#endif
+		tail += r;
+		res += r;
+		lhandle->counter += r;
+		lhandle->buf_count += r;
+		lhandle->buf_pos += r;
+		lhandle->buf_pos %= lhandle->buf_size;
+		avail -= r;
+	}
+	if (lhandle->max < (snd_pcm_uframes_t)res)
+		lhandle->max = res;
+	__atomic_store_n(&split->tail, tail, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&split->full, 0, __ATOMIC_SEQ_CST))
+		split_wake(split);
+	return res;
+}
+
+/* join the capture thread, the ring contents are processed */
+static void split_stop(struct loopback *loop)
+{
+	struct loopback_split *split = loop->capt->split;
+	snd_pcm_sframes_t count;
+
+	if (split == NULL || !split->running)
+		return;
+	__atomic_store_n(&split->stop, 1, __ATOMIC_RELEASE);
+	split_wake(split);
+	pthread_join(split->thread, NULL);
+	split->running = 0;
+	if (!loop->running)
+		return;
+	count = split_read(loop->capt);
+	metrics_frames(loop, count, 0);
+	buf_add(loop, count);
+	/* split_start() resets the ring, the frames which did not fit are lost */
+	loop->capt->buf_over += split->head - split->tail;
+}
+
 static int readit(struct loopback_handle *lhandle)
 {
 	snd_pcm_sframes_t r, res = 0;
 	snd_pcm_sframes_t avail;
 	int err;
 
+	if (lhandle->fanout)
+		return fanout_read(lhandle->fanout, lhandle->loopback);
+	if (lhandle->split && lhandle->split->running) {
+		if (!__atomic_load_n(&lhandle->split->done, __ATOMIC_ACQUIRE))
+			return split_read(lhandle);
+		/* the capture thread exited, check the stream here */
+		split_stop(lhandle->loopback);
+	}
 	avail = snd_pcm_avail_update(lhandle->handle);
 	if (avail == -EPIPE) {
 		return xrun(lhandle);
@@ -663,10 +1100,10 @@ static int readit(struct loopback_handle *lhandle)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_readi(lhandle->handle,
-				  lhandle->buf +
-				  lhandle->buf_pos *
-				  lhandle->frame_size, r);
+		r = pcm_readi(lhandle,
+			      lhandle->buf +
+			      lhandle->buf_pos *
+			      lhandle->frame_size, r);
 		if (r == 0)
 			return res;
 		if (r < 0) {
@@ -704,8 +1141,13 @@ static int writeit(struct loopback_handle *lhandle)
 	snd_pcm_sframes_t r, res = 0;
 	int err;
 
+	if (lhandle->bus) {
+		/* the bus consumes the FIFO of all inputs */
+		err = bus_flush(lhandle->bus);
+		return err < 0 ? err : 0;
+	}
       __again:
-	avail = snd_pcm_avail_update(lhandle->handle);
+	avail = pcm_avail_update(lhandle);
 	if (avail == -EPIPE) {
 		if ((err = xrun(lhandle)) < 0)
 			return err;
@@ -721,10 +1163,10 @@ static int writeit(struct loopback_handle *lhandle)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_writei(lhandle->handle,
-				   lhandle->buf +
-				   lhandle->buf_pos *
-				   lhandle->frame_size, r);
+		r = pcm_writei(lhandle,
+			       lhandle->buf +
+			       lhandle->buf_pos *
+			       lhandle->frame_size, r);
 		if (r <= 0) {
 			if (r == -EPIPE) {
 				if ((err = xrun(lhandle)) < 0)
@@ -758,29 +1200,267 @@ static int writeit(struct loopback_handle *lhandle)
 	return res;
 }
 
+/*
+ * Zero-copy transfer: the captured frames are copied directly from
+ * the capture mmap area to the playback mmap area. Both streams must
+ * use the same access, format and channels (shared buffer mode).
+ */
+static snd_pcm_sframes_t copyit(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t coffset, poffset, cframes, pframes;
+	snd_pcm_sframes_t cavail, pavail, r, res = 0;
+	int err;
+
+	cavail = snd_pcm_avail_update(capt->handle);
+	if (cavail == -EPIPE) {
+		return xrun(capt);
+	} else if (cavail == -ESTRPIPE) {
+		if ((err = suspend(capt)) < 0)
+			return err;
+		return 0;
+	} else if (cavail < 0) {
+		return cavail;
+	} else if (cavail == 0) {
+		if (snd_pcm_state(capt->handle) == SND_PCM_STATE_DRAINING)
+			loop->reinit = 1;
+		return 0;
+	}
+      __again:
+	pavail = snd_pcm_avail_update(play->handle);
+	if (pavail == -EPIPE) {
+		if ((err = xrun(play)) < 0)
+			return err;
+		return 0;
+	} else if (pavail == -ESTRPIPE) {
+		if ((err = suspend(play)) < 0)
+			return err;
+		goto __again;
+	} else if (pavail < 0) {
+		return pavail;
+	}
+	if (pavail > cavail)
+		pavail = cavail;
+	while (pavail > 0) {
+		cframes = pavail;
+		err = snd_pcm_mmap_begin(capt->handle, &careas, &coffset, &cframes);
+		if (err < 0)
+			return res > 0 ? res : err;
+		pframes = cframes;
+		err = snd_pcm_mmap_begin(play->handle, &pareas, &poffset, &pframes);
+		if (err < 0)
+			return res > 0 ? res : err;
+		err = snd_pcm_areas_copy(pareas, poffset, careas, coffset,
+					 play->channels, pframes, play->format);
+		if (err < 0)
+			return res > 0 ? res : err;
+		r = snd_pcm_mmap_commit(play->handle, poffset, pframes);
+		if (r < 0) {
+			if (r == -EPIPE) {
+				if ((err = xrun(play)) < 0)
+					return err;
+				return res;
+			}
+			return res > 0 ? res : r;
+		}
+		/* release only the frames accepted by playback */
+		pframes = r;
+		if (pframes == 0)
+			break;
+		r = snd_pcm_mmap_commit(capt->handle, coffset, pframes);
+		if (r >= 0 && (snd_pcm_uframes_t)r < pframes) {
+			/* the frames are queued to playback, never copy them twice */
+			if (snd_pcm_forward(capt->handle, pframes - r) < 0)
+				r = -EPIPE;
+			else
+				r = pframes;
+		}
+		if (r < 0) {
+			/* the frames are queued to playback, count them */
+			res += pframes;
+			capt->counter += pframes;
+			play->counter += pframes;
+			if (r == -EPIPE) {
+				if ((err = xrun(capt)) < 0)
+					return err;
+				return res;
+			}
+			return res;
+		}
+		res += r;
+		if (capt->max < res)
+			capt->max = res;
+		capt->counter += r;
+		play->counter += r;
+		pavail -= r;
+		xrun_profile(loop);
+		if (loop->stop_pending) {
+			loop->stop_count += r;
+			if (loop->stop_count * play->pitch >
+			    loop->latency * 3) {
+				loop->stop_pending = 0;
+				loop->reinit = 1;
+				break;
+			}
+		}
+	}
+	return res;
+}
+
+/*
+ * Glitch concealment: the gaps after an xrun are filled with the last
+ * played samples (faded in) instead of silence and the dropped samples
+ * are crossfaded to the following samples. Only S16 and S32 samples
+ * are processed, other formats use silence and plain drops.
+ */
+static inline int conceal_format(struct loopback_handle *lhandle)
+{
+	return lhandle->format == SND_PCM_FORMAT_S16 ||
+	       lhandle->format == SND_PCM_FORMAT_S32;
+}
+
+static inline snd_pcm_uframes_t conceal_fade_size(struct loopback_handle *lhandle)
+{
+	return lhandle->rate / 500;	/* 2ms */
+}
+
+static inline double sample_get(struct loopback_handle *lhandle,
+				snd_pcm_uframes_t pos, unsigned int ch)
+{
+	char *frame = lhandle->buf + (pos % lhandle->buf_size) * lhandle->frame_size;
+
+	if (lhandle->format == SND_PCM_FORMAT_S32)
+		return ((int32_t *)frame)[ch];
+	return ((int16_t *)frame)[ch];
+}
+
+static inline void sample_put(struct loopback_handle *lhandle,
+			      snd_pcm_uframes_t pos, unsigned int ch,
+			      double val)
+{
+	char *frame = lhandle->buf + (pos % lhandle->buf_size) * lhandle->frame_size;
+
+	if (lhandle->format == SND_PCM_FORMAT_S32)
+		((int32_t *)frame)[ch] = val;
+	else
+		((int16_t *)frame)[ch] = val;
+}
+
+static int buf_silence(struct loopback_handle *lhandle,
+		       snd_pcm_uframes_t pos, snd_pcm_uframes_t count)
+{
+	snd_pcm_uframes_t count1;
+	int err;
+
+	while (count > 0) {
+		count1 = count;
+		if (count1 + pos > lhandle->buf_size)
+			count1 = lhandle->buf_size - pos;
+		err = snd_pcm_format_set_silence(lhandle->format,
+					lhandle->buf + pos * lhandle->frame_size,
+					count1 * lhandle->channels);
+		if (err < 0)
+			return err;
+		pos = (pos + count1) % lhandle->buf_size;
+		count -= count1;
+	}
+	return 0;
+}
+
+/* insert frames before the playback buffer position */
+static int conceal_fill(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t pos, fade, i;
+	unsigned int ch;
+
+	if (count > play->buf_size - play->buf_count)
+		count = play->buf_size - play->buf_count;
+	if (count == 0)
+		return 0;
+	pos = (play->buf_pos + play->buf_size - count) % play->buf_size;
+	play->buf_pos = pos;
+	play->buf_count += count;
+	if (!loop->conceal || !conceal_format(play))
+		return buf_silence(play, pos, count);
+	/*
+	 * The frames before the buffer position are the last played
+	 * frames, so the repeated block ends exactly where the queued
+	 * frames continue. Only the start is faded in.
+	 */
+	fade = conceal_fade_size(play);
+	if (fade > count)
+		fade = count;
+	for (i = 0; i < fade; i++)
+		for (ch = 0; ch < play->channels; ch++)
+			sample_put(play, pos + i, ch,
+				   sample_get(play, pos + i, ch) * i / fade);
+	loop->metrics.live.conceal_frames += count;
+	return 0;
+}
+
+/*
+ * Crossfade the frames following the dropped block to the new head,
+ * so the played signal continues from the dropped frames smoothly.
+ * The frames are processed backwards, so a short drop may overlap.
+ */
+static void conceal_drop(struct loopback *loop,
+			 struct loopback_handle *lhandle,
+			 snd_pcm_uframes_t head, snd_pcm_uframes_t count)
+{
+	snd_pcm_uframes_t fade, i;
+	unsigned int ch;
+	double a, b;
+
+	if (!loop->conceal || !conceal_format(lhandle) || count == 0)
+		return;
+	fade = conceal_fade_size(lhandle);
+	if (fade > lhandle->buf_count)
+		fade = lhandle->buf_count;
+	for (i = fade; i-- > 0; ) {
+		for (ch = 0; ch < lhandle->channels; ch++) {
+			a = sample_get(lhandle, head + i, ch);
+			b = sample_get(lhandle, head + count + i, ch);
+			sample_put(lhandle, head + count + i, ch,
+				   a + (b - a) * i / fade);
+		}
+	}
+	if (fade > 0)
+		loop->metrics.live.conceal_fades++;
+}
+
 static snd_pcm_sframes_t remove_samples(struct loopback *loop,
 					int capture_preferred,
 					snd_pcm_sframes_t count)
 {
 	struct loopback_handle *play = loop->play;
 	struct loopback_handle *capt = loop->capt;
+	snd_pcm_uframes_t head;
 
 	if (loop->play->buf == loop->capt->buf) {
 		if (count > loop->play->buf_count)
 			count = loop->play->buf_count;
 		if (count > loop->capt->buf_count)
 			count = loop->capt->buf_count;
+		head = play->buf_pos;
 		capt->buf_count -= count;
 		play->buf_pos += count;
 		play->buf_pos %= play->buf_size;
 		play->buf_count -= count;
+		conceal_drop(loop, play, head, count);
 		return count;
 	}
 	if (capture_preferred) {
 		if (count > capt->buf_count)
 			count = capt->buf_count;
+		head = (capt->buf_pos + capt->buf_size - capt->buf_count) %
+								capt->buf_size;
 		capt->buf_count -= count;
+		conceal_drop(loop, capt, head, count);
 	} else {
+		/* the newest samples are dropped, nothing to crossfade */
 		if (count > play->buf_count)
 			count = play->buf_count;
 		play->buf_count -= count;
@@ -802,6 +1482,14 @@ static int xrun_sync(struct loopback *loop)
 	if (capt->xrun_pending) {
 	      __pagain:
 		capt->xrun_pending = 0;
+		if (capt->fanout) {
+			/* other outputs may have restarted the capture */
+			if ((err = fanout_start(capt->fanout)) < 0) {
+				logit(LOG_CRIT, "%s start failed: %s\n", capt->id, snd_strerror(err));
+				return err;
+			}
+			goto __pdone;
+		}
 		if ((err = snd_pcm_prepare(capt->handle)) < 0) {
 			logit(LOG_CRIT, "%s prepare failed: %s\n", capt->id, snd_strerror(err));
 			return err;
@@ -816,6 +1504,7 @@ static int xrun_sync(struct loopback *loop)
 		if (capt->xrun_pending)
 			goto __pagain;
 	}
+      __pdone:
 	/* skip additional playback samples */
 	if ((err = snd_pcm_delay(capt->handle, &cdelay)) < 0) {
 		if (err == -EPIPE) {
@@ -831,7 +1520,7 @@ static int xrun_sync(struct loopback *loop)
 		logit(LOG_CRIT, "%s capture delay failed: %s\n", capt->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0) {
+	if ((err = pcm_delay(play, &pdelay)) < 0) {
 		if (err == -EPIPE) {
 			pdelay = 0;
 			play->xrun_pending = 1;
@@ -877,7 +1566,8 @@ static int xrun_sync(struct loopback *loop)
 			"sync: cbufcount=%li, pbufcount=%li\n",
 			(long)capt->buf_count, (long)play->buf_count);
 	}
-	if (delay1 > fill && capt->counter > 0) {
+	/* a shared capture cannot be restarted for one output */
+	if (delay1 > fill && capt->counter > 0 && !capt->fanout) {
 		if ((err = snd_pcm_drop(capt->handle)) < 0)
 			return err;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0)
@@ -930,14 +1620,12 @@ static int xrun_sync(struct loopback *loop)
 			diff = diff - play->buf_count;
 			if (verbose > 6)
 				snd_output_printf(loop->output,
-					"sync: playback silence added %li samples\n", (long)diff);
-			play->buf_pos -= diff;
-			play->buf_pos %= play->buf_size;
-			if ((err = snd_pcm_format_set_silence(play->format, play->buf + play->buf_pos * play->channels, diff)) < 0)
+					"sync: playback %s added %li samples\n", loop->conceal ? "concealment" : "silence", (long)diff);
+			if ((err = conceal_fill(loop, diff)) < 0)
 				return err;
-			play->buf_count += diff;
 		}
-		if ((err = snd_pcm_prepare(play->handle)) < 0) {
+		if (!play->bus && !play->endpoint &&
+		    (err = snd_pcm_prepare(play->handle)) < 0) {
 			logit(LOG_CRIT, "%s prepare failed: %s\n", play->id, snd_strerror(err));
 
 			return err;
@@ -952,26 +1640,18 @@ static int xrun_sync(struct loopback *loop)
 				snd_output_printf(loop->output,
 					"sync: playback buf_remove %li samples\n", (long)(delay1 - diff));
 		}
-		if ((err = snd_pcm_start(play->handle)) < 0) {
+		if (!play->bus && !play->endpoint &&
+		    (err = snd_pcm_start(play->handle)) < 0) {
 			logit(LOG_CRIT, "%s start failed: %s\n", play->id, snd_strerror(err));
 			return err;
 		}
 	} else if (delay1 < fill) {
 		diff = (fill - delay1) / play->pitch;
-		while (diff > 0) {
-			delay1 = play->buf_size - play->buf_pos;
-			if (verbose > 6)
-				snd_output_printf(loop->output,
-					"sync: playback short, silence filling %li / buf_count=%li\n", (long)delay1, play->buf_count);
-			if (delay1 > diff)
-				delay1 = diff;
-			if ((err = snd_pcm_format_set_silence(play->format, play->buf + play->buf_pos * play->channels, delay1)) < 0)
-				return err;
-			play->buf_pos += delay1;
-			play->buf_pos %= play->buf_size;
-			play->buf_count += delay1;
-			diff -= delay1;
-		}
+		if (verbose > 6)
+			snd_output_printf(loop->output,
+				"sync: playback short, %s filling %li / buf_count=%li\n", loop->conceal ? "concealment" : "silence", (long)diff, play->buf_count);
+		if ((err = conceal_fill(loop, diff)) < 0)
+			return err;
 		writeit(play);
 	}
 	if (verbose > 5) {
@@ -979,7 +1659,7 @@ static int xrun_sync(struct loopback *loop)
 		if (verbose > 6) {
 			if (snd_pcm_delay(capt->handle, &cdelay) < 0)
 				cdelay = -1;
-			if (snd_pcm_delay(play->handle, &pdelay) < 0)
+			if (pcm_delay(play, &pdelay) < 0)
 				pdelay = -1;
 			if (play->buf != capt->buf)
 				cdelay += capt->buf_count;
@@ -994,6 +1674,7 @@ static int xrun_sync(struct loopback *loop)
 		}
 	}
 	loop->xrun_max_proctime = 0;
+	loop->drift_valid = 0;
 	return 0;
 }
 
@@ -1072,8 +1753,72 @@ void update_pitch(struct loopback *loop)
 		snd_output_printf(loop->output, "New pitch for %s: %.8f (min/max samples = %li/%li)\n", loop->id, pitch, loop->pitch_diff_min, loop->pitch_diff_max);
 }
 
-static int get_active(struct loopback_handle *lhandle)
-{
+/*
+ * Get the whole queued sample count from the hardware timestamped
+ * status of both streams. The capture delay is moved to the time of
+ * the playback timestamp, so both values describe the same moment.
+ */
+static int get_tstamp_fill(struct loopback *loop, double *fill,
+			   snd_htimestamp_t *tstamp)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_status_t *pstatus, *cstatus;
+	snd_htimestamp_t ctstamp;
+	snd_pcm_uframes_t fill_ring;
+	snd_pcm_sframes_t epdelay = 0;
+	double pdelay, cdelay;
+	int err;
+
+	snd_pcm_status_alloca(&pstatus);
+	snd_pcm_status_alloca(&cstatus);
+	if (play->endpoint) {
+		endpoint_status(play, tstamp, &epdelay);
+	} else if ((err = snd_pcm_status(play->handle, pstatus)) < 0) {
+		return err;
+	}
+	do {
+		fill_ring = split_fill(capt);
+		if ((err = snd_pcm_status(capt->handle, cstatus)) < 0)
+			return err;
+	} while (fill_ring != split_fill(capt));
+	if ((!play->endpoint &&
+	     snd_pcm_status_get_state(pstatus) != SND_PCM_STATE_RUNNING) ||
+	    snd_pcm_status_get_state(cstatus) != SND_PCM_STATE_RUNNING)
+		return -EAGAIN;
+	if (play->endpoint) {
+		pdelay = epdelay;
+	} else {
+		snd_pcm_status_get_htstamp(pstatus, tstamp);
+		pdelay = snd_pcm_status_get_delay(pstatus);
+	}
+	snd_pcm_status_get_htstamp(cstatus, &ctstamp);
+	cdelay = snd_pcm_status_get_delay(cstatus);
+	cdelay += htimediff(*tstamp, ctstamp) * capt->rate + fill_ring;
+	if (play->buf != capt->buf)
+		cdelay += capt->buf_count;
+	pdelay += play->buf_count;
+#ifdef USE_SAMPLERATE
+	pdelay += loop->src_out_frames;
+#endif
+	*fill = cdelay * capt->pitch + pdelay * play->pitch;
+	return 0;
+}
+
+static void drift_update(struct loopback *loop)
+{
+	snd_htimestamp_t tstamp;
+	double fill;
+
+	if (get_tstamp_fill(loop, &fill, &tstamp) < 0)
+		return;
+	if (use_metrics)
+		metrics_latency(loop, fill);
+	drift_update_fill(loop, fill, tstamp);
+}
+
+static int get_active(struct loopback_handle *lhandle)
+{
 	int err;
 
 	if (lhandle->ctl_active == NULL)
@@ -1156,7 +1901,7 @@ static int openctl(struct loopback_handle *lhandle, int device, int subdevice)
 	int err;
 
 	lhandle->ctl_rate_shift = NULL;
-	if (lhandle->loopback->play == lhandle) {
+	if (is_playback(lhandle)) {
 		if (lhandle->loopback->controls)
 			goto __events;
 		return 0;
@@ -1193,7 +1938,7 @@ static int openctl(struct loopback_handle *lhandle, int device, int subdevice)
 static int openit(struct loopback_handle *lhandle)
 {
 	snd_pcm_info_t *info;
-	int stream = lhandle == lhandle->loopback->play ?
+	int stream = is_playback(lhandle) ?
 				SND_PCM_STREAM_PLAYBACK :
 				SND_PCM_STREAM_CAPTURE;
 	int err, card, device, subdevice;
@@ -1277,6 +2022,671 @@ static int init_handle(struct loopback_handle *lhandle, int alloc)
 	return 0;
 }
 
+/*
+ * Mixing bus: several loops in one thread share a playback PCM.
+ * The playback handle of an input is virtual - the I/O buffer is
+ * the input FIFO and the bus PCM is borrowed for the delay, status
+ * and poll queries, so the drift compensation of each input works
+ * as usual. The bus mixes the FIFOs of all running inputs.
+ */
+static pthread_mutex_t bus_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct loopback_bus *buses;
+
+static void bus_free(struct loopback_bus *bus)
+{
+	struct loopback_handle *bplay = bus->play;
+
+	if (bplay) {
+		closeit(bplay);
+		freeit(bplay);
+		free(bplay->device);
+		free(bplay->ctldev);
+		free(bplay->id);
+		free(bplay);
+	}
+	free(bus->inputs);
+	free(bus->sum);
+	free(bus);
+}
+
+static int bus_attach(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play, *bplay;
+	struct loopback_bus *bus, **pbus;
+	struct loopback **inputs;
+	snd_pcm_format_t format;
+	char id[128];
+	int err;
+
+	pthread_mutex_lock(&bus_mutex);
+	for (bus = buses; bus; bus = bus->next)
+		if (bus->thread == loop->thread &&
+		    strcmp(bus->play->device, play->device) == 0)
+			break;
+	pthread_mutex_unlock(&bus_mutex);
+	if (bus == NULL) {
+		bus = calloc(1, sizeof(*bus));
+		if (bus == NULL)
+			return -ENOMEM;
+		bplay = bus->play = calloc(1, sizeof(*bplay));
+		if (bplay == NULL) {
+			bus_free(bus);
+			return -ENOMEM;
+		}
+		bus->thread = loop->thread;
+		bplay->loopback = loop;
+		bplay->device = strdup(play->device);
+		if (play->ctldev)
+			bplay->ctldev = strdup(play->ctldev);
+		snprintf(id, sizeof(id), "mix %s", play->device);
+		bplay->id = strdup(id);
+		if (bplay->device == NULL || bplay->id == NULL ||
+		    (play->ctldev && bplay->ctldev == NULL)) {
+			bus_free(bus);
+			return -ENOMEM;
+		}
+		/* the kernels sum only S16 or S32 samples */
+		format = play->format;
+		if (format != SND_PCM_FORMAT_S16 &&
+		    format != SND_PCM_FORMAT_S32)
+			format = snd_pcm_format_width(format) > 16 ?
+				SND_PCM_FORMAT_S32 : SND_PCM_FORMAT_S16;
+		bplay->access = play->access;
+		bplay->format = format;
+		bplay->rate = bplay->rate_req = play->rate_req;
+		bplay->channels = play->channels;
+		bplay->buffer_size_req = play->buffer_size_req;
+		bplay->period_size_req = play->period_size_req;
+		bplay->resample = play->resample;
+		bplay->nblock = play->nblock;
+		if ((err = openit(bplay)) < 0) {
+			bus_free(bus);
+			return err;
+		}
+		pthread_mutex_lock(&bus_mutex);
+		bus->next = buses;
+		buses = bus;
+		pthread_mutex_unlock(&bus_mutex);
+	}
+	inputs = realloc(bus->inputs, (bus->inputs_count + 1) *
+						sizeof(struct loopback *));
+	if (inputs == NULL) {
+		if (bus->inputs_count == 0) {
+			pthread_mutex_lock(&bus_mutex);
+			for (pbus = &buses; *pbus != bus; pbus = &(*pbus)->next);
+			*pbus = bus->next;
+			pthread_mutex_unlock(&bus_mutex);
+			bus_free(bus);
+		}
+		return -ENOMEM;
+	}
+	bus->inputs = inputs;
+	bus->inputs[bus->inputs_count++] = loop;
+	bplay = bus->play;
+	play->bus = bus;
+	play->handle = bplay->handle;
+	play->access = bplay->access;
+	play->format = loop->capt->format = bplay->format;
+	play->rate_req = bplay->rate_req;
+	play->channels = bplay->channels;
+	return 0;
+}
+
+static void bus_detach(struct loopback *loop)
+{
+	struct loopback_bus *bus = loop->play->bus, **pbus;
+	int i;
+
+	if (bus == NULL)
+		return;
+	loop->play->bus = NULL;
+	loop->play->handle = NULL;
+	for (i = 0; i < bus->inputs_count; i++) {
+		if (bus->inputs[i] != loop)
+			continue;
+		memmove(&bus->inputs[i], &bus->inputs[i + 1],
+			(bus->inputs_count - i - 1) * sizeof(struct loopback *));
+		bus->inputs_count--;
+		break;
+	}
+	if (bus->inputs_count > 0) {
+		if (bus->play->loopback == loop)
+			bus->play->loopback = bus->inputs[0];
+		return;
+	}
+	pthread_mutex_lock(&bus_mutex);
+	for (pbus = &buses; *pbus != bus; pbus = &(*pbus)->next);
+	*pbus = bus->next;
+	pthread_mutex_unlock(&bus_mutex);
+	bus_free(bus);
+}
+
+/* the first started input configures the bus PCM */
+static int bus_setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_bus *bus = play->bus;
+	struct loopback_handle *bplay = bus->play;
+	snd_pcm_hw_params_t *params, *tparams;
+	snd_pcm_sw_params_t *swparams;
+	int err;
+
+	if (bus->active == 0) {
+		snd_pcm_hw_params_alloca(&params);
+		snd_pcm_hw_params_alloca(&tparams);
+		snd_pcm_sw_params_alloca(&swparams);
+		bplay->loopback = loop;
+		if ((err = setparams_stream(bplay, tparams)) < 0 ||
+		    (err = setparams_bufsize(bplay, params, tparams, bufsize / bplay->pitch)) < 0 ||
+		    (err = setparams_set(bplay, params, swparams, bufsize / bplay->pitch)) < 0) {
+			logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", bplay->id, snd_strerror(err));
+			return err;
+		}
+		if ((err = snd_pcm_prepare(bplay->handle)) < 0) {
+			logit(LOG_CRIT, "Prepare %s error: %s\n", bplay->id, snd_strerror(err));
+			return err;
+		}
+		freeit(bplay);
+		if ((err = init_handle(bplay, 1)) < 0)
+			return err;
+		free(bus->sum);
+		bus->sum = malloc(bplay->buf_size * bplay->channels * 8);
+		if (bus->sum == NULL)
+			return -ENOMEM;
+	}
+	play->rate = bplay->rate;
+	play->pitch = bplay->pitch;
+	play->buffer_size = bplay->buffer_size;
+	play->period_size = bplay->period_size;
+	play->avail_min = bplay->avail_min;
+	return 0;
+}
+
+static void bus_stop(struct loopback *loop)
+{
+	struct loopback_bus *bus = loop->play->bus;
+	struct loopback_handle *bplay = bus->play;
+	int err;
+
+	if (--bus->active > 0)
+		return;
+	if ((err = snd_pcm_drop(bplay->handle)) < 0)
+		logit(LOG_WARNING, "pcm drop %s error: %s\n", bplay->id, snd_strerror(err));
+	if ((err = snd_pcm_hw_free(bplay->handle)) < 0)
+		logit(LOG_WARNING, "pcm hw_free %s error: %s\n", bplay->id, snd_strerror(err));
+}
+
+static inline int bus_input_ready(struct loopback *loop)
+{
+	return loop->running && !loop->play->xrun_pending;
+}
+
+static int bus_xrun(struct loopback_bus *bus)
+{
+	struct loopback *loop;
+	int i, err;
+
+	logit(LOG_DEBUG, "underrun for %s\n", bus->play->id);
+	bus->xruns++;
+	if ((err = snd_pcm_prepare(bus->play->handle)) < 0)
+		return err;
+	/* all inputs must be synchronized again */
+	for (i = 0; i < bus->inputs_count; i++) {
+		loop = bus->inputs[i];
+		if (!loop->running)
+			continue;
+		loop->play->xrun_pending = 1;
+		loop->metrics.live.play_xruns++;
+	}
+	return 0;
+}
+
+/* remove mixed samples from the input FIFO */
+static void bus_consume(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *play = loop->play;
+
+	play->buf_pos += count;
+	play->buf_pos %= play->buf_size;
+	play->buf_count -= count;
+	play->counter += count;
+	buf_remove(loop, count);
+	if (loop->stop_pending) {
+		loop->stop_count += count;
+		if (loop->stop_count * play->pitch > loop->latency * 3) {
+			loop->stop_pending = 0;
+			loop->reinit = 1;
+		}
+	}
+}
+
+static void bus_mix(struct loopback_bus *bus, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *bplay = bus->play, *play;
+	struct loopback *loop;
+	snd_pcm_uframes_t pos, count1, count2;
+	int i;
+
+	mix_clear(bplay->format, bus->sum, count * bplay->channels);
+	for (i = 0; i < bus->inputs_count; i++) {
+		loop = bus->inputs[i];
+		if (!bus_input_ready(loop))
+			continue;
+		play = loop->play;
+		count1 = count;
+		if (count1 > play->buf_count) {
+			/* the input is late, the rest is silence */
+			count1 = play->buf_count;
+			loop->metrics.live.play_xruns++;
+		}
+		pos = 0;
+		while (count1 > 0) {
+			count2 = count1;
+			if (count2 + play->buf_pos > play->buf_size)
+				count2 = play->buf_size - play->buf_pos;
+			mix_sum(bplay->format, bus->sum, pos * bplay->channels,
+				play->buf + play->buf_pos * play->frame_size,
+				count2 * play->channels, loop->mix_gain);
+			bus_consume(loop, count2);
+			pos += count2;
+			count1 -= count2;
+		}
+	}
+	mix_out(bplay->format, bplay->buf, bus->sum, count * bplay->channels);
+}
+
+/*
+ * Write the frames available in all running inputs. When an input
+ * is late and the bus is close to an underrun, one period is written
+ * and the missing samples of the late inputs are replaced by silence.
+ */
+static snd_pcm_sframes_t bus_flush(struct loopback_bus *bus)
+{
+	struct loopback_handle *bplay = bus->play;
+	struct loopback *loop;
+	snd_pcm_sframes_t avail, count, r;
+	snd_pcm_state_t state;
+	int i, inputs = 0, err;
+
+	if (bus->active == 0)
+		return 0;
+      __again:
+	avail = snd_pcm_avail_update(bplay->handle);
+	if (avail == -EPIPE) {
+		return bus_xrun(bus);
+	} else if (avail == -ESTRPIPE) {
+		while ((err = snd_pcm_resume(bplay->handle)) == -EAGAIN)
+			usleep(1);
+		if (err < 0)
+			return bus_xrun(bus);
+		goto __again;
+	} else if (avail < 0) {
+		return avail;
+	}
+	count = avail;
+	for (i = 0; i < bus->inputs_count; i++) {
+		loop = bus->inputs[i];
+		if (!bus_input_ready(loop))
+			continue;
+		if (count > loop->play->buf_count)
+			count = loop->play->buf_count;
+		inputs++;
+	}
+	if (inputs == 0)
+		return 0;
+	state = snd_pcm_state(bplay->handle);
+	if (state == SND_PCM_STATE_RUNNING &&
+	    bplay->buffer_size - avail < bplay->period_size &&
+	    count < bplay->period_size)
+		count = bplay->period_size < avail ?
+				bplay->period_size : avail;
+	if (count > bplay->buf_size)
+		count = bplay->buf_size;
+	if (count <= 0)
+		return 0;
+	bus_mix(bus, count);
+	r = pcm_writei(bplay, bplay->buf, count);
+	if (r == -EPIPE)
+		return bus_xrun(bus);
+	if (r < 0)
+		return r;
+	if (r < count && verbose > 6)
+		snd_output_printf(bplay->loopback->output, "%s: short write %li/%li\n", bplay->id, (long)r, (long)count);
+	if (state == SND_PCM_STATE_PREPARED &&
+	    (err = snd_pcm_start(bplay->handle)) < 0) {
+		logit(LOG_CRIT, "pcm start %s error: %s\n", bplay->id, snd_strerror(err));
+		return err;
+	}
+	return r;
+}
+
+/*
+ * Capture fan-out: one capture PCM feeds several loops in one thread.
+ * The capture is read once to a scratch buffer and copied to the FIFO
+ * of each running output. The outputs keep their own latency target
+ * and drift compensation, the capture PCM is borrowed for the delay,
+ * status and poll queries like the mixing bus PCM.
+ */
+static pthread_mutex_t fanout_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct loopback_fanout *fanouts;
+
+static void fanout_free(struct loopback_fanout *fan)
+{
+	struct loopback_handle *fcapt = fan->capt;
+
+	if (fcapt) {
+		closeit(fcapt);
+		freeit(fcapt);
+		free(fcapt->device);
+		free(fcapt->ctldev);
+		free(fcapt->id);
+		free(fcapt);
+	}
+	free(fan->outputs);
+	free(fan);
+}
+
+static int fanout_attach(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt, *fcapt;
+	struct loopback_fanout *fan, **pfan;
+	struct loopback **outputs;
+	snd_pcm_format_t format;
+	char id[128];
+	int err;
+
+	pthread_mutex_lock(&fanout_mutex);
+	for (fan = fanouts; fan; fan = fan->next)
+		if (fan->thread == loop->thread &&
+		    strcmp(fan->capt->device, capt->device) == 0)
+			break;
+	pthread_mutex_unlock(&fanout_mutex);
+	if (fan == NULL) {
+		fan = calloc(1, sizeof(*fan));
+		if (fan == NULL)
+			return -ENOMEM;
+		fcapt = fan->capt = calloc(1, sizeof(*fcapt));
+		if (fcapt == NULL) {
+			fanout_free(fan);
+			return -ENOMEM;
+		}
+		fan->thread = loop->thread;
+		fcapt->loopback = loop;
+		fcapt->device = strdup(capt->device);
+		if (capt->ctldev)
+			fcapt->ctldev = strdup(capt->ctldev);
+		snprintf(id, sizeof(id), "fanout %s", capt->device);
+		fcapt->id = strdup(id);
+		if (fcapt->device == NULL || fcapt->id == NULL ||
+		    (capt->ctldev && fcapt->ctldev == NULL)) {
+			fanout_free(fan);
+			return -ENOMEM;
+		}
+		/* the outputs may use the samplerate conversion */
+		format = capt->format;
+		if (format != SND_PCM_FORMAT_S16 &&
+		    format != SND_PCM_FORMAT_S32)
+			format = snd_pcm_format_width(format) > 16 ?
+				SND_PCM_FORMAT_S32 : SND_PCM_FORMAT_S16;
+		fcapt->access = capt->access;
+		fcapt->format = format;
+		fcapt->rate = fcapt->rate_req = capt->rate_req;
+		fcapt->channels = capt->channels;
+		fcapt->buffer_size_req = capt->buffer_size_req;
+		fcapt->period_size_req = capt->period_size_req;
+		fcapt->resample = capt->resample;
+		fcapt->nblock = capt->nblock;
+		/* is_playback() checks the fan-out of the loop */
+		capt->fanout = fan;
+		if ((err = openit(fcapt)) < 0) {
+			capt->fanout = NULL;
+			fanout_free(fan);
+			return err;
+		}
+		pthread_mutex_lock(&fanout_mutex);
+		fan->next = fanouts;
+		fanouts = fan;
+		pthread_mutex_unlock(&fanout_mutex);
+	}
+	outputs = realloc(fan->outputs, (fan->outputs_count + 1) *
+						sizeof(struct loopback *));
+	if (outputs == NULL) {
+		capt->fanout = NULL;
+		if (fan->outputs_count == 0) {
+			pthread_mutex_lock(&fanout_mutex);
+			for (pfan = &fanouts; *pfan != fan; pfan = &(*pfan)->next);
+			*pfan = fan->next;
+			pthread_mutex_unlock(&fanout_mutex);
+			fanout_free(fan);
+		}
+		return -ENOMEM;
+	}
+	fan->outputs = outputs;
+	fan->outputs[fan->outputs_count++] = loop;
+	fcapt = fan->capt;
+	capt->fanout = fan;
+	capt->handle = fcapt->handle;
+	capt->access = fcapt->access;
+	capt->format = fcapt->format;
+	capt->rate_req = fcapt->rate_req;
+	capt->channels = fcapt->channels;
+	if (!loop->play->bus)
+		loop->play->format = fcapt->format;
+	return 0;
+}
+
+static void fanout_detach(struct loopback *loop)
+{
+	struct loopback_fanout *fan = loop->capt->fanout, **pfan;
+	int i;
+
+	if (fan == NULL)
+		return;
+	loop->capt->fanout = NULL;
+	loop->capt->handle = NULL;
+	for (i = 0; i < fan->outputs_count; i++) {
+		if (fan->outputs[i] != loop)
+			continue;
+		memmove(&fan->outputs[i], &fan->outputs[i + 1],
+			(fan->outputs_count - i - 1) * sizeof(struct loopback *));
+		fan->outputs_count--;
+		break;
+	}
+	if (fan->outputs_count > 0) {
+		if (fan->capt->loopback == loop)
+			fan->capt->loopback = fan->outputs[0];
+		return;
+	}
+	pthread_mutex_lock(&fanout_mutex);
+	for (pfan = &fanouts; *pfan != fan; pfan = &(*pfan)->next);
+	*pfan = fan->next;
+	pthread_mutex_unlock(&fanout_mutex);
+	fanout_free(fan);
+}
+
+/* the first started output configures the capture PCM */
+static int fanout_setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_fanout *fan = capt->fanout;
+	struct loopback_handle *fcapt = fan->capt;
+	snd_pcm_hw_params_t *params, *tparams;
+	snd_pcm_sw_params_t *swparams;
+	int err;
+
+	if (fan->active == 0) {
+		snd_pcm_hw_params_alloca(&params);
+		snd_pcm_hw_params_alloca(&tparams);
+		snd_pcm_sw_params_alloca(&swparams);
+		fcapt->loopback = loop;
+		if ((err = setparams_stream(fcapt, tparams)) < 0 ||
+		    (err = setparams_bufsize(fcapt, params, tparams, bufsize / fcapt->pitch)) < 0 ||
+		    (err = setparams_set(fcapt, params, swparams, bufsize / fcapt->pitch)) < 0) {
+			logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", fcapt->id, snd_strerror(err));
+			return err;
+		}
+		if ((err = snd_pcm_prepare(fcapt->handle)) < 0) {
+			logit(LOG_CRIT, "Prepare %s error: %s\n", fcapt->id, snd_strerror(err));
+			return err;
+		}
+		freeit(fcapt);
+		if ((err = init_handle(fcapt, 1)) < 0)
+			return err;
+	}
+	capt->rate = fcapt->rate;
+	capt->pitch = fcapt->pitch;
+	capt->buffer_size = fcapt->buffer_size;
+	capt->period_size = fcapt->period_size;
+	capt->avail_min = fcapt->avail_min;
+	return 0;
+}
+
+static int fanout_start(struct loopback_fanout *fan)
+{
+	snd_pcm_t *handle = fan->capt->handle;
+	snd_pcm_state_t state = snd_pcm_state(handle);
+	int err;
+
+	if (state == SND_PCM_STATE_RUNNING)
+		return 0;
+	if (state != SND_PCM_STATE_PREPARED &&
+	    (err = snd_pcm_prepare(handle)) < 0)
+		return err;
+	return snd_pcm_start(handle);
+}
+
+static void fanout_stop(struct loopback *loop)
+{
+	struct loopback_fanout *fan = loop->capt->fanout;
+	struct loopback_handle *fcapt = fan->capt;
+	int err;
+
+	if (--fan->active > 0)
+		return;
+	if ((err = snd_pcm_drop(fcapt->handle)) < 0)
+		logit(LOG_WARNING, "pcm drop %s error: %s\n", fcapt->id, snd_strerror(err));
+	if ((err = snd_pcm_hw_free(fcapt->handle)) < 0)
+		logit(LOG_WARNING, "pcm hw_free %s error: %s\n", fcapt->id, snd_strerror(err));
+}
+
+static inline int fanout_output_ready(struct loopback *loop)
+{
+	return loop->running && !loop->capt->xrun_pending;
+}
+
+static int fanout_xrun(struct loopback_fanout *fan)
+{
+	struct loopback *loop;
+	int i;
+
+	logit(LOG_DEBUG, "overrun for %s\n", fan->capt->id);
+	fan->xruns++;
+	/* all outputs must be synchronized again */
+	for (i = 0; i < fan->outputs_count; i++) {
+		loop = fan->outputs[i];
+		if (!loop->running)
+			continue;
+		loop->capt->xrun_pending = 1;
+		loop->metrics.live.capt_xruns++;
+	}
+	return fanout_start(fan);
+}
+
+/* copy the captured samples to the output FIFO */
+static snd_pcm_uframes_t fanout_copy(struct loopback *loop, const char *buf,
+				     snd_pcm_uframes_t count)
+{
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_uframes_t res, count1;
+
+	if (count > buf_avail(capt)) {
+		capt->buf_over += count - buf_avail(capt);
+		count = buf_avail(capt);
+	}
+	res = count;
+	while (count > 0) {
+		count1 = count;
+		if (count1 + capt->buf_pos > capt->buf_size)
+			count1 = capt->buf_size - capt->buf_pos;
+		memcpy(capt->buf + capt->buf_pos * capt->frame_size, buf,
+		       count1 * capt->frame_size);
+		buf += count1 * capt->frame_size;
+		capt->buf_pos += count1;
+		capt->buf_pos %= capt->buf_size;
+		count -= count1;
+	}
+	if (capt->max < res)
+		capt->max = res;
+	capt->counter += res;
+	capt->buf_count += res;
+	return res;
+}
+
+/*
+ * Read the capture PCM and feed all running outputs. The samples for
+ * the other outputs are passed to their playback buffers here, the
+ * count of samples for the calling output is returned like readit().
+ */
+static snd_pcm_sframes_t fanout_read(struct loopback_fanout *fan,
+				     struct loopback *self)
+{
+	struct loopback_handle *fcapt = fan->capt;
+	struct loopback *loop;
+	snd_pcm_sframes_t avail, r, res = 0;
+	snd_pcm_uframes_t count;
+	int i, err;
+
+      __again:
+	avail = snd_pcm_avail_update(fcapt->handle);
+	if (avail == -EPIPE) {
+		return fanout_xrun(fan);
+	} else if (avail == -ESTRPIPE) {
+		while ((err = snd_pcm_resume(fcapt->handle)) == -EAGAIN)
+			usleep(1);
+		if (err < 0)
+			return fanout_xrun(fan);
+		goto __again;
+	} else if (avail < 0) {
+		return avail;
+	} else if (avail == 0) {
+		if (snd_pcm_state(fcapt->handle) == SND_PCM_STATE_DRAINING)
+			for (i = 0; i < fan->outputs_count; i++)
+				fan->outputs[i]->reinit = 1;
+		return 0;
+	}
+	while (avail > 0) {
+		r = avail;
+		if (r > (snd_pcm_sframes_t)fcapt->buf_size)
+			r = fcapt->buf_size;
+		r = pcm_readi(fcapt, fcapt->buf, r);
+		if (r == 0)
+			break;
+		if (r < 0) {
+			if (r == -EPIPE) {
+				err = fanout_xrun(fan);
+				return res > 0 ? res : err;
+			}
+			return res > 0 ? res : r;
+		}
+		fcapt->counter += r;
+		for (i = 0; i < fan->outputs_count; i++) {
+			loop = fan->outputs[i];
+			if (!fanout_output_ready(loop))
+				continue;
+			count = fanout_copy(loop, fcapt->buf, r);
+			if (loop == self) {
+				res += count;
+				continue;
+			}
+			/* the caller accounts only its own frames */
+			metrics_frames(loop, count, 0);
+			buf_add(loop, count);
+		}
+		avail -= r;
+	}
+	return res;
+}
+
 int pcmjob_init(struct loopback *loop)
 {
 	int err;
@@ -1288,10 +2698,38 @@ int pcmjob_init(struct loopback *loop)
 #ifdef FILE_PWRITE
 	loop->pfile = fopen(FILE_PWRITE, "w+");
 #endif
-	if ((err = openit(loop->play)) < 0)
+	loop->metrics.live.latency_min = -1;
+	loop->proc_init = proc_clock(CLOCK_MONOTONIC);
+	loop->proc_cpu_init = proc_clock(CLOCK_THREAD_CPUTIME_ID);
+	if (loop->mix && loop->endpoint) {
+		logit(LOG_CRIT, "%s: the shared memory endpoint cannot be mixed\n", loop->play->id);
+		err = -EINVAL;
+		goto __error;
+	}
+	if (loop->mix)
+		err = bus_attach(loop);
+	else if (loop->endpoint)
+		err = endpoint_open(loop->play);
+	else
+		err = openit(loop->play);
+	if (err < 0)
 		goto __error;
-	if ((err = openit(loop->capt)) < 0)
+	if (loop->fanout)
+		err = fanout_attach(loop);
+	else
+		err = openit(loop->capt);
+	if (err < 0)
 		goto __error;
+	if (loop->split) {
+		if (loop->fanout) {
+			logit(LOG_CRIT, "%s: the capture thread cannot be used for a shared capture\n", loop->capt->id);
+			err = -EINVAL;
+			goto __error;
+		}
+		err = split_init(loop);
+		if (err < 0)
+			goto __error;
+	}
 	snprintf(id, sizeof(id), "%s/%s", loop->play->id, loop->capt->id);
 	id[sizeof(id)-1] = '\0';
 	loop->id = strdup(id);
@@ -1305,6 +2743,27 @@ int pcmjob_init(struct loopback *loop)
 #endif
 	if (loop->sync == SYNC_TYPE_AUTO)
 		loop->sync = SYNC_TYPE_SIMPLE;
+	if (loop->play->bus && loop->sync == SYNC_TYPE_PLAYRATESHIFT) {
+		logit(LOG_CRIT, "%s: playback rate shift is not possible for a mixed playback\n", loop->id);
+		err = -EINVAL;
+		goto __error;
+	}
+	if (loop->play->endpoint && loop->sync == SYNC_TYPE_PLAYRATESHIFT) {
+		logit(LOG_CRIT, "%s: playback rate shift is not possible for the endpoint\n", loop->id);
+		err = -EINVAL;
+		goto __error;
+	}
+	if (loop->capt->fanout && loop->sync == SYNC_TYPE_CAPTRATESHIFT) {
+		logit(LOG_CRIT, "%s: capture rate shift is not possible for a shared capture\n", loop->id);
+		err = -EINVAL;
+		goto __error;
+	}
+	if (loop->capt->fanout && loop->play->bus &&
+	    loop->capt->format != loop->play->format) {
+		logit(LOG_CRIT, "%s: shared capture format %s does not match the mixing format %s\n", loop->id, snd_pcm_format_name(loop->capt->format), snd_pcm_format_name(loop->play->format));
+		err = -EINVAL;
+		goto __error;
+	}
 	if (loop->slave == SLAVE_TYPE_AUTO &&
 	    loop->capt->ctl_notify &&
 	    loop->capt->ctl_active &&
@@ -1326,6 +2785,11 @@ int pcmjob_init(struct loopback *loop)
 	err = control_init(loop);
 	if (err < 0)
 		goto __error;
+	if (loop->trace_file) {
+		err = trace_open(loop);
+		if (err < 0)
+			goto __error;
+	}
 	return 0;
       __error:
 	pcmjob_done(loop);
@@ -1339,10 +2803,13 @@ static void freeloop(struct loopback *loop)
 		if (loop->src_state)
 			src_delete(loop->src_state);
 		loop->src_state = NULL;
-		free(loop->src_data.data_in);
+		free(loop->src_in);
+		loop->src_in = NULL;
 		loop->src_data.data_in = NULL;
 		free(loop->src_data.data_out);
 		loop->src_data.data_out = NULL;
+		free(loop->route_data);
+		loop->route_data = NULL;
 	}
 #endif
 	if (loop->play->buf == loop->capt->buf)
@@ -1354,6 +2821,12 @@ static void freeloop(struct loopback *loop)
 int pcmjob_done(struct loopback *loop)
 {
 	control_done(loop);
+	measure_done(loop);
+	trace_close(loop);
+	bus_detach(loop);
+	fanout_detach(loop);
+	split_done(loop);
+	endpoint_close(loop->play);
 	closeit(loop->play);
 	closeit(loop->capt);
 	freeloop(loop);
@@ -1386,6 +2859,18 @@ static void fix_format(struct loopback *loop, int force)
 {
 	snd_pcm_format_t format = loop->capt->format;
 
+	if (loop->play->bus) {
+		/* the capture format follows the mixing bus */
+		if (!loop->capt->fanout)
+			loop->capt->format = loop->play->format;
+		return;
+	}
+	if (loop->capt->fanout) {
+		/* the shared capture format is S16 or S32 */
+		if (force || loop->sync == SYNC_TYPE_SAMPLERATE)
+			loop->play->format = loop->capt->format;
+		return;
+	}
 	if (!force && loop->sync != SYNC_TYPE_SAMPLERATE)
 		return;
 	if (format == SND_PCM_FORMAT_S16 ||
@@ -1406,7 +2891,9 @@ int pcmjob_start(struct loopback *loop)
 
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
-	if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
+	if (loop->play->endpoint)
+		err = 1;
+	else if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
 		goto __error;
 	loop->play->pollfd_count = err;
 	loop->pollfd_count += err;
@@ -1423,19 +2910,28 @@ int pcmjob_start(struct loopback *loop)
 		err = get_format(loop->capt);
 		if (err < 0)
 			goto __error;
-		loop->play->format = loop->capt->format = err;
+		/* the parameters of a mixed playback are fixed */
+		loop->capt->format = err;
+		if (!loop->play->bus)
+			loop->play->format = err;
 		fix_format(loop, 0);
 		err = get_rate(loop->capt);
 		if (err < 0)
 			goto __error;
-		loop->play->rate_req = loop->capt->rate_req = err;
+		loop->capt->rate_req = err;
+		if (!loop->play->bus)
+			loop->play->rate_req = err;
 		err = get_channels(loop->capt);
 		if (err < 0)
 			goto __error;
-		loop->play->channels = loop->capt->channels = err;
+		loop->capt->channels = err;
+		/* the routed playback channels are fixed */
+		if (!loop->play->bus && !loop->route)
+			loop->play->channels = err;
 	}
 	loop->reinit = 0;
 	loop->use_samplerate = 0;
+	loop->mmap_copy = 0;
 __again:
 	if (loop->latency_req) {
 		loop->latency_reqtime = frames_to_time(loop->play->rate_req,
@@ -1445,15 +2941,28 @@ __again:
 	loop->latency = time_to_frames(loop->play->rate_req, loop->latency_reqtime);
 	if ((err = setparams(loop, loop->latency/2)) < 0)
 		goto __error;
+	/* the duration is counted at the negotiated capture rate */
+	if (loop->loop_time == ~0UL)
+		loop->loop_limit = ~0ULL;
+	else
+		loop->loop_limit = (unsigned long long)loop->capt->rate *
+				   loop->loop_time;
 	if (verbose)
 		showlatency(loop->output, loop->latency, loop->play->rate_req, "Latency");
 	if (loop->play->access == loop->capt->access &&
 	    loop->play->format == loop->capt->format &&
 	    loop->play->rate == loop->capt->rate &&
-	    loop->play->channels == loop->play->channels &&
-	    loop->sync != SYNC_TYPE_SAMPLERATE) {
+	    loop->play->channels == loop->capt->channels &&
+	    loop->sync != SYNC_TYPE_SAMPLERATE && !loop->route) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
+		if (loop->play->access == SND_PCM_ACCESS_MMAP_INTERLEAVED &&
+		    !loop->play->bus && !loop->capt->fanout &&
+		    !loop->capt->split && !loop->measure_interval) {
+			loop->mmap_copy = 1;
+			if (verbose > 1)
+				snd_output_printf(loop->output, "zero-copy mmap transfer!!!\n");
+		}
 		if ((err = init_handle(loop->play, 1)) < 0)
 			goto __error;
 		if ((err = init_handle(loop->capt, 0)) < 0)
@@ -1486,9 +2995,12 @@ __again:
 		if ((err = init_handle(loop->capt, 1)) < 0)
 			goto __error;
 		if (loop->play->rate_req != loop->play->rate ||
-                    loop->capt->rate_req != loop->capt->rate) {
+                    loop->capt->rate_req != loop->capt->rate ||
+		    loop->route) {
                         snd_pcm_format_t format1, format2;
-			loop->use_samplerate = 1;
+			if (loop->play->rate_req != loop->play->rate ||
+			    loop->capt->rate_req != loop->capt->rate)
+				loop->use_samplerate = 1;
                         format1 = loop->play->format;
                         format2 = loop->capt->format;
                         fix_format(loop, 1);
@@ -1498,6 +3010,19 @@ __again:
                                 goto __again;
                         }
                 }
+		if (loop->route) {
+			if (loop->play->format != loop->capt->format ||
+			    (loop->play->format != SND_PCM_FORMAT_S16 &&
+			     loop->play->format != SND_PCM_FORMAT_S32)) {
+				logit(LOG_CRIT, "%s: channel routing supports only %s or %s formats (play=%s, capt=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
+				err = -EINVAL;
+				goto __error;
+			}
+			err = route_setup(loop->route, loop->capt->channels,
+					  loop->play->channels);
+			if (err < 0)
+				goto __error;
+		}
 	}
 #ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_SAMPLERATE)
@@ -1520,11 +3045,22 @@ __again:
 		}
 		loop->src_state = src_new(loop->src_converter_type,
 					  loop->play->channels, &err);
-		loop->src_data.data_in = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
-		if (loop->src_data.data_in == NULL) {
+		if (loop->route) {
+			loop->route_data = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
+			if (loop->route_data == NULL) {
+				err = -ENOMEM;
+				goto __error;
+			}
+			loop->src_in = calloc(1, sizeof(float)*loop->play->channels*loop->capt->buf_size);
+		} else {
+			loop->src_in = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
+		}
+		if (loop->src_in == NULL) {
 			err = -ENOMEM;
 			goto __error;
 		}
+		/* libsamplerate only reads the input */
+		loop->src_data.data_in = loop->src_in;
 		loop->src_data.data_out =  calloc(1, sizeof(float)*loop->play->channels*loop->play->buf_size);
 		if (loop->src_data.data_out == NULL) {
 			err = -ENOMEM;
@@ -1562,26 +3098,53 @@ __again:
 	}
 	if (verbose > 4)
 		snd_output_printf(loop->output, "%s: capt->buffer_size = %li, play->buffer_size = %li\n", loop->id, loop->capt->buf_size, loop->play->buf_size);
+	if (loop->capt->split && (err = split_setparams(loop)) < 0)
+		goto __error;
 	loop->pitch = 1.0;
 	update_pitch(loop);
 	loop->pitch_delta = 1.0 / ((double)loop->capt->rate * 4);
 	loop->total_queued_count = 0;
 	loop->pitch_diff = 0;
+	drift_init(loop);
+	if (loop->measure_interval && (err = measure_start(loop)) < 0)
+		goto __error;
+	if (loop->trace)
+		trace_start(loop);
 	count = get_whole_latency(loop) / loop->play->pitch;
+	if (loop->play->bus && loop->play->bus->active > 0) {
+		snd_pcm_sframes_t delay;
+		/* the bus is running, the queued samples count too */
+		if (snd_pcm_delay(loop->play->handle, &delay) >= 0 && delay > 0)
+			count = (snd_pcm_sframes_t)count > delay ? count - delay : 0;
+	}
+	if (loop->capt->fanout && loop->capt->fanout->active > 0) {
+		snd_pcm_sframes_t delay;
+		/* the capture is running, the samples to read count too */
+		if (snd_pcm_delay(loop->capt->handle, &delay) >= 0 && delay > 0) {
+			delay = delay * loop->capt->pitch / loop->play->pitch;
+			count = (snd_pcm_sframes_t)count > delay ? count - delay : 0;
+		}
+	}
 	loop->play->buf_count = count;
 	if (loop->play->buf == loop->capt->buf)
 		loop->capt->buf_pos = count;
-	err = writeit(loop->play);
-	if (verbose > 4)
-		snd_output_printf(loop->output, "%s: silence queued %i samples\n", loop->id, err);
-	if (count > loop->play->buffer_size)
-		count = loop->play->buffer_size;
-	if (err != count) {
-		logit(LOG_CRIT, "%s: initial playback fill error (%i/%i/%i)\n", loop->id, err, (int)count, loop->play->buffer_size);
-		err = -EIO;
-		goto __error;
+	if (!loop->play->bus) {
+		err = writeit(loop->play);
+		if (verbose > 4)
+			snd_output_printf(loop->output, "%s: silence queued %i samples\n", loop->id, err);
+		if (count > loop->play->buffer_size)
+			count = loop->play->buffer_size;
+		if (err != count) {
+			logit(LOG_CRIT, "%s: initial playback fill error (%i/%i/%i)\n", loop->id, err, (int)count, loop->play->buffer_size);
+			err = -EIO;
+			goto __error;
+		}
 	}
 	loop->running = 1;
+	if (loop->play->bus)
+		loop->play->bus->active++;
+	if (loop->capt->fanout)
+		loop->capt->fanout->active++;
 	loop->stop_pending = 0;
 	if (loop->xrun) {
 		getcurtimestamp(&loop->xrun_last_update);
@@ -1589,16 +3152,31 @@ __again:
 		loop->xrun_last_cdelay = XRUN_PROFILE_UNKNOWN;
 		loop->xrun_max_proctime = 0;
 	}
-	if ((err = snd_pcm_start(loop->capt->handle)) < 0) {
+	if (loop->capt->fanout)
+		err = fanout_start(loop->capt->fanout);
+	else
+		err = snd_pcm_start(loop->capt->handle);
+	if (err < 0) {
 		logit(LOG_CRIT, "pcm start %s error: %s\n", loop->capt->id, snd_strerror(err));
 		goto __error;
 	}
-	if (!loop->linked) {
+	if (loop->play->bus) {
+		/* the bus is started with the first written samples */
+		if ((err = bus_flush(loop->play->bus)) < 0)
+			goto __error;
+	} else if (loop->play->endpoint) {
+		if ((err = endpoint_start(loop->play)) < 0) {
+			logit(LOG_CRIT, "endpoint start %s error: %s\n", loop->play->id, snd_strerror(err));
+			goto __error;
+		}
+	} else if (!loop->linked) {
 		if ((err = snd_pcm_start(loop->play->handle)) < 0) {
 			logit(LOG_CRIT, "pcm start %s error: %s\n", loop->play->id, snd_strerror(err));
 			goto __error;
 		}
 	}
+	if (loop->capt->split && (err = split_start(loop)) < 0)
+		goto __error;
 	return 0;
       __error:
 	pcmjob_stop(loop);
@@ -1609,14 +3187,23 @@ int pcmjob_stop(struct loopback *loop)
 {
 	int err;
 
+	split_stop(loop);
 	if (loop->running) {
-		if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
+		if (loop->capt->fanout)
+			fanout_stop(loop);
+		else if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_drop(loop->play->handle)) < 0)
+		if (loop->play->bus)
+			bus_stop(loop);
+		else if (loop->play->endpoint)
+			endpoint_stop(loop->play);
+		else if ((err = snd_pcm_drop(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->play->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->capt->handle)) < 0)
+		if (!loop->capt->fanout &&
+		    (err = snd_pcm_hw_free(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
+		if (!loop->play->bus && !loop->play->endpoint &&
+		    (err = snd_pcm_hw_free(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
 		loop->running = 0;
 	}
@@ -1627,16 +3214,32 @@ int pcmjob_stop(struct loopback *loop)
 int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 {
 	int err, idx = 0;
+	unsigned int i;
 
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
+		if (loop->play->endpoint)
+			err = endpoint_poll_descriptors(loop->play, fds + idx);
+		else
+			err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
 		if (err < 0)
 			return err;
 		idx += loop->play->pollfd_count;
 		err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
 		if (err < 0)
 			return err;
+		/* in the zero-copy mode, the captured samples are kept */
+		/* in the capture ring until the playback has a room, */
+		/* in the split mode, the capture thread polls the capture */
+		if (loop->mmap_copy || loop->capt->split) {
+			for (i = 0; i < loop->capt->pollfd_count; i++)
+				fds[idx + i].events = 0;
+		}
 		idx += loop->capt->pollfd_count;
+		/* the thread timer wakes the job instead of the streams */
+		if (loop->timer_wake) {
+			for (i = 0; i < idx; i++)
+				fds[i].events = 0;
+		}
 	}
 	if (loop->play->ctl_pollfd_count > 0 &&
 	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
@@ -1656,12 +3259,34 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 	return idx;
 }
 
+/* the shortest period of both streams in usec (0 = not running) */
+long pcmjob_period_time(struct loopback *loop)
+{
+	long ptime, ctime;
+
+	if (!loop->running)
+		return 0;
+	ptime = frames_to_time(loop->play->rate, loop->play->period_size);
+	ctime = frames_to_time(loop->capt->rate, loop->capt->period_size);
+	return ptime < ctime ? ptime : ctime;
+}
+
+void pcmjob_wake_stats(struct loopback *loop, long late, unsigned int missed)
+{
+	struct loopback_metrics_data *m = &loop->metrics.live;
+
+	m->wake_late = late;
+	if (m->wake_late_max < late)
+		m->wake_late_max = late;
+	m->wake_missed += missed;
+}
+
 static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
 {
 	snd_pcm_sframes_t delay;
 	int err;
 
-	if ((err = snd_pcm_delay(loop->play->handle, &delay)) < 0)
+	if ((err = pcm_delay(loop->play, &delay)) < 0)
 		return 0;
 	loop->play->last_delay = delay;
 	delay += loop->play->buf_count;
@@ -1674,12 +3299,17 @@ static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
 static snd_pcm_sframes_t get_queued_capture_samples(struct loopback *loop)
 {
 	snd_pcm_sframes_t delay;
+	snd_pcm_uframes_t fill;
 	int err;
 
-	if ((err = snd_pcm_delay(loop->capt->handle, &delay)) < 0)
-		return 0;
+	/* the capture thread may move the samples to the ring meanwhile */
+	do {
+		fill = split_fill(loop->capt);
+		if ((err = snd_pcm_delay(loop->capt->handle, &delay)) < 0)
+			return 0;
+	} while (fill != split_fill(loop->capt));
 	loop->capt->last_delay = delay;
-	delay += loop->capt->buf_count;
+	delay += loop->capt->buf_count + fill;
 	return delay;
 }
 
@@ -1749,6 +3379,7 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 			restart = 1;
 	}
 	if (restart) {
+		loop->metrics.live.reinits++;
 		pcmjob_stop(loop);
 		err = pcmjob_start(loop);
 		if (err < 0)
@@ -1761,17 +3392,20 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 {
 	struct loopback_handle *play = loop->play;
 	struct loopback_handle *capt = loop->capt;
-	unsigned short prevents, crevents, events;
+	unsigned short prevents, crevents, pctl_events = 0, cctl_events = 0;
 	snd_pcm_uframes_t ccount, pcount;
+	unsigned long long t, t0, cpu0;
 	int err, loopcount = 10, idx;
 
 	if (verbose > 11)
 		snd_output_printf(loop->output, "%s: pollfds handle\n", loop->id);
+	t0 = proc_clock(CLOCK_MONOTONIC);
+	cpu0 = proc_clock(CLOCK_THREAD_CPUTIME_ID);
 	if (verbose > 13 || loop->xrun)
 		getcurtimestamp(&loop->tstamp_start);
 	if (verbose > 12) {
 		snd_pcm_sframes_t pdelay, cdelay;
-		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
+		if ((err = pcm_delay(play, &pdelay)) < 0)
 			snd_output_printf(loop->output, "%s: delay error: %s / %li / %li\n", play->id, snd_strerror(err), play->buf_size, play->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: delay %li / %li / %li\n", play->id, pdelay, play->buf_size, play->buf_count);
@@ -1782,10 +3416,11 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	}
 	idx = 0;
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors_revents(play->handle, fds,
-						       play->pollfd_count,
-						       &prevents);
-		if (err < 0)
+		if (play->endpoint)
+			prevents = endpoint_revents(play, fds);
+		else if ((err = snd_pcm_poll_descriptors_revents(play->handle, fds,
+							       play->pollfd_count,
+							       &prevents)) < 0)
 			return err;
 		idx += play->pollfd_count;
 		err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
@@ -1805,60 +3440,84 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	} else {
 		prevents = crevents = 0;
 	}
+	/* the control events are handled after the audio transfer */
 	if (play->ctl_pollfd_count > 0 &&
 	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
 		err = snd_ctl_poll_descriptors_revents(play->ctl, fds + idx,
 						       play->ctl_pollfd_count,
-						       &events);
+						       &pctl_events);
 		if (err < 0)
 			return err;
-		if (events) {
-			err = handle_ctl_events(play, events);
-			if (err == 1)
-				return 0;
-			if (err < 0)
-				return err;
-		}
 		idx += play->ctl_pollfd_count;
 	}
 	if (capt->ctl_pollfd_count > 0 &&
 	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
 		err = snd_ctl_poll_descriptors_revents(capt->ctl, fds + idx,
 						       capt->ctl_pollfd_count,
-						       &events);
+						       &cctl_events);
 		if (err < 0)
 			return err;
-		if (events) {
-			err = handle_ctl_events(capt, events);
-			if (err == 1)
-				return 0;
-			if (err < 0)
-				return err;
-		}
 		idx += capt->ctl_pollfd_count;
 	}
 	if (verbose > 9)
 		snd_output_printf(loop->output, "%s: prevents = 0x%x, crevents = 0x%x\n", loop->id, prevents, crevents);
 	if (!loop->running)
 		goto __pcm_end;
+	t = proc_clock(CLOCK_MONOTONIC);
 	do {
+		if (loop->mmap_copy) {
+			snd_pcm_sframes_t r;
+			ccount = pcount = 0;
+			if (play->buf_count > 0) {
+				/* flush the silence or sync residue first */
+				pcount = writeit(play);
+				buf_remove(loop, pcount);
+			}
+			if (play->buf_count == 0 && !play->xrun_pending &&
+			    !loop->reinit) {
+				r = copyit(loop);
+				if (r < 0)
+					return r;
+				ccount = r;
+				pcount += r;
+			}
+			/* the direct copy is one transfer */
+			proc_mark(loop, PROC_WRITE, &t);
+			metrics_frames(loop, ccount, pcount);
+			if (capt->xrun_pending || play->xrun_pending ||
+			    loop->reinit)
+				break;
+			loopcount--;
+			continue;
+		}
 		ccount = readit(capt);
+		proc_mark(loop, PROC_READ, &t);
+		metrics_frames(loop, ccount, 0);
 		buf_add(loop, ccount);
+		proc_mark(loop, PROC_CONVERT, &t);
 		if (capt->xrun_pending || loop->reinit)
 			break;
 		/* we read new samples, if we have a room in the playback
 		   buffer, feed them there */
 		pcount = writeit(play);
 		buf_remove(loop, pcount);
+		proc_mark(loop, PROC_WRITE, &t);
+		metrics_frames(loop, 0, pcount);
 		if (play->xrun_pending || loop->reinit)
 			break;
 		loopcount--;
 	} while ((ccount > 0 || pcount > 0) && loopcount > 0);
 	if (play->xrun_pending || capt->xrun_pending) {
+		/* the capture stream is restarted and read here */
+		split_stop(loop);
 		if ((err = xrun_sync(loop)) < 0)
 			return err;
 	}
+	if (capt->split && !capt->split->running && !loop->reinit &&
+	    (err = split_start(loop)) < 0)
+		return err;
 	if (loop->reinit) {
+		loop->metrics.live.reinits++;
 		err = pcmjob_stop(loop);
 		if (err < 0)
 			return err;
@@ -1867,54 +3526,34 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			return err;
 	}
 	if (loop->sync != SYNC_TYPE_NONE &&
-	    play->counter >= play->sync_point &&
-	    capt->counter >= play->sync_point) {
-		snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
-		diff = ((double)(((double)play->total_queued * play->pitch) +
-				 ((double)capt->total_queued * capt->pitch)) /
-			(double)loop->total_queued_count) - lat;
-		/* FIXME: this algorithm may be slightly better */
-		if (verbose > 3)
-			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
-		if (diff > 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch += loop->pitch_delta;
-			else if (diff > loop->pitch_diff)
-				loop->pitch += loop->pitch_delta*2;
-		} else if (diff < 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta;
-			else if (diff < loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta*2;
-		}
-		loop->pitch_diff = diff;
-		if (loop->pitch_diff_min > diff)
-			loop->pitch_diff_min = diff;
-		if (loop->pitch_diff_max < diff)
-			loop->pitch_diff_max = diff;
-		update_pitch(loop);
-		play->counter -= play->sync_point;
-		capt->counter -= play->sync_point;
-		play->total_queued = 0;
-		capt->total_queued = 0;
-		loop->total_queued_count = 0;
-	}
-	if (loop->sync != SYNC_TYPE_NONE) {
+	    loop->drift == DRIFT_TYPE_PI) {
+		drift_update(loop);
+	} else if (loop->sync != SYNC_TYPE_NONE) {
 		snd_pcm_sframes_t pqueued, cqueued;
 		pqueued = get_queued_playback_samples(loop);
 		cqueued = get_queued_capture_samples(loop);
-		if (verbose > 4)
-			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
-		if (pqueued > 0)
-			play->total_queued += pqueued;
-		if (cqueued > 0)
-			capt->total_queued += cqueued;
-		if (pqueued > 0 || cqueued > 0)
-			loop->total_queued_count += 1;
+		sync_average_update(loop, pqueued, cqueued);
+		if (use_metrics) {
+			/* the shared buffer is counted in pqueued */
+			if (play->buf == capt->buf)
+				cqueued -= capt->buf_count;
+			metrics_latency(loop, pqueued * play->pitch +
+					      cqueued * capt->pitch);
+		}
+	} else if (loop->sync == SYNC_TYPE_NONE && use_metrics) {
+		snd_pcm_sframes_t pqueued, cqueued;
+		pqueued = get_queued_playback_samples(loop);
+		cqueued = get_queued_capture_samples(loop);
+		if (play->buf == capt->buf)
+			cqueued -= capt->buf_count;
+		metrics_latency(loop, pqueued * play->pitch +
+				      cqueued * capt->pitch);
 	}
+	if (loop->trace)
+		trace_wakeup(loop);
 	if (verbose > 12) {
 		snd_pcm_sframes_t pdelay, cdelay;
-		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
+		if ((err = pcm_delay(play, &pdelay)) < 0)
 			snd_output_printf(loop->output, "%s: end delay error: %s / %li / %li\n", play->id, snd_strerror(err), play->buf_size, play->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: end delay %li / %li / %li\n", play->id, pdelay, play->buf_size, play->buf_count);
@@ -1924,6 +3563,8 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			snd_output_printf(loop->output, "%s: end delay %li / %li / %li\n", capt->id, cdelay, capt->buf_size, capt->buf_count);
 	}
       __pcm_end:
+	metrics_update(loop, (proc_clock(CLOCK_MONOTONIC) - t0) / 1000,
+		       proc_clock(CLOCK_THREAD_CPUTIME_ID) - cpu0);
 	if (verbose > 13 || loop->xrun) {
 		long diff;
 		getcurtimestamp(&loop->tstamp_end);
@@ -1933,6 +3574,10 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		if (loop->xrun && loop->xrun_max_proctime < diff)
 			loop->xrun_max_proctime = diff;
 	}
+	if (pctl_events && (err = handle_ctl_events(play, pctl_events)) < 0)
+		return err;
+	if (cctl_events && (err = handle_ctl_events(capt, cctl_events)) < 0)
+		return err;
 	return 0;
 }
 
@@ -1957,6 +3602,43 @@ static void show_handle(struct loopback_handle *lhandle, const char *id)
 	OUT("    pitch = %.8f\n", lhandle->pitch);
 }
 
+static void show_proctime(struct loopback *loop)
+{
+	static const char *names[PROC_LAST] = { "read", "convert", "write" };
+	struct loopback_metrics_data *data = &loop->metrics.live;
+	double wall, cpu;
+	int i;
+
+	wall = (proc_clock(CLOCK_MONOTONIC) - loop->proc_init) / 1e9;
+	if (wall <= 0)
+		return;
+	/* the state is dumped from the job thread */
+	cpu = (proc_clock(CLOCK_THREAD_CPUTIME_ID) - loop->proc_cpu_init) / 1e9;
+	OUT("  cpu = %.3fs (%.2f%%), thread cpu = %.3fs (%.2f%%)\n", data->cpu_time / 1e9, data->cpu_time / 1e7 / wall, cpu, cpu * 100 / wall);
+	OUT("  proctime: wakeups = %llu, p50 = %lius, p99 = %lius, max = %lius\n", data->wakeups, metrics_percentile(data->proctime, 50), metrics_percentile(data->proctime, 99), data->proctime_max);
+	for (i = 0; i < PROC_LAST; i++)
+		OUT("    %s: total = %.3fs (%.2f%%), p50 = %lius, p99 = %lius\n", names[i], data->proc_sum[i] / 1e9, data->proc_sum[i] / 1e7 / wall, metrics_percentile(data->proc_hist[i], 50), metrics_percentile(data->proc_hist[i], 99));
+}
+
+/* the duration (-s) is counted in the captured frames */
+int pcmjob_finished(struct loopback *loop)
+{
+	return loop->metrics.live.capt_frames >= loop->loop_limit;
+}
+
+void pcmjob_summary(struct loopback *loop)
+{
+	struct loopback_metrics_data *data = &loop->metrics.live;
+	double frames = data->capt_frames, audio, cpu, wall;
+
+	if (frames == 0)
+		return;
+	audio = frames / loop->capt->rate;
+	cpu = data->cpu_time / 1e9;
+	wall = (proc_clock(CLOCK_MONOTONIC) - loop->proc_init) / 1e9;
+	snd_output_printf(loop->output, "%s: %llu frames (%.3fs) in %.3fs, cpu %.3fs (%.3f%% of realtime), per frame: read %.1fns, convert %.1fns, write %.1fns\n", loop->id, data->capt_frames, audio, wall, cpu, cpu * 100 / audio, data->proc_sum[PROC_READ] / frames, data->proc_sum[PROC_CONVERT] / frames, data->proc_sum[PROC_WRITE] / frames);
+}
+
 void pcmjob_state(struct loopback *loop)
 {
 	pthread_t self = pthread_self();
@@ -1969,7 +3651,36 @@ void pcmjob_state(struct loopback *loop)
 		goto __skip;
 	OUT("  pollfd_count = %i\n", loop->pollfd_count);
 	OUT("  pitch = %.8f, delta = %.8f, diff = %li, min = %li, max = %li\n", loop->pitch, loop->pitch_delta, loop->pitch_diff, loop->pitch_diff_min, loop->pitch_diff_max);
+	OUT("  drift = %s", drift_types[loop->drift]);
+	if (loop->drift == DRIFT_TYPE_PI)
+		OUT(", err = %.3f, integ = %.3fppm, kp = %.4e, ki = %.4e", loop->drift_err, loop->drift_integ * 1000000, loop->drift_kp, loop->drift_ki);
+	OUT("\n");
 	OUT("  use_samplerate = %i\n", loop->use_samplerate);
+	OUT("  mmap_copy = %i\n", loop->mmap_copy);
+	show_proctime(loop);
+	if (loop->conceal)
+		OUT("  concealed frames = %llu, crossfades = %u\n", loop->metrics.live.conceal_frames, loop->metrics.live.conceal_fades);
+	if (loop->timer_wake)
+		OUT("  timer wake: late = %lius, max = %lius, missed = %u\n", loop->metrics.live.wake_late, loop->metrics.live.wake_late_max, loop->metrics.live.wake_missed);
+	if (loop->play->bus)
+		OUT("  mix = %s, inputs = %i, active = %i, xruns = %u, gain = %.2fdB\n", loop->play->bus->play->id, loop->play->bus->inputs_count, loop->play->bus->active, loop->play->bus->xruns, 20 * log10((double)loop->mix_gain / MIX_GAIN_UNITY));
+	if (loop->play->endpoint && loop->running)
+		OUT("  endpoint = %s, ring = %li/%u, consumer underruns = %llu\n", loop->play->device, (long)endpoint_delay(loop->play), loop->play->buffer_size, endpoint_underruns(loop->play));
+	if (loop->route)
+		OUT("  route = %u -> %u channels, %s\n", loop->route->channels_in, loop->route->channels_out, loop->route->copy ? "copy" : (loop->route->sparse ? "sparse" : "dense"));
+	if (loop->capt->split)
+		OUT("  capture thread = %s, ring = %lu/%lu, overruns = %u\n", loop->capt->split->running ? "running" : "stopped", (unsigned long)split_fill(loop->capt), (unsigned long)loop->capt->split->size, loop->capt->split->overruns);
+	if (loop->capt->fanout)
+		OUT("  fanout = %s, outputs = %i, active = %i, xruns = %u\n", loop->capt->fanout->capt->id, loop->capt->fanout->outputs_count, loop->capt->fanout->active, loop->capt->fanout->xruns);
+	if (loop->measure_interval) {
+		struct loopback_metrics_data *data = &loop->metrics.live;
+		double avg = 0, dev = 0;
+		if (data->rtt_count > 0) {
+			avg = data->rtt_sum / data->rtt_count;
+			dev = sqrt(fabs(data->rtt_sum2 / data->rtt_count - avg * avg));
+		}
+		OUT("  measured latency: count = %u, lost = %u, last = %li, min = %li, avg = %.1f, max = %li, stddev = %.1f (frames)\n", data->rtt_count, data->rtt_lost, data->rtt, data->rtt_min, avg, data->rtt_max, dev);
+	}
       __skip:
 	show_handle(loop->play, "playback");
 	show_handle(loop->capt, "capture");
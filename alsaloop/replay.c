@@ -0,0 +1,339 @@
+/*
+ *  A simple PCM loopback utility - sync trace replay
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Replay a trace recorded by alsaloop --trace against the drift
+ * estimators. The streams are simulated: the queued frame count
+ * follows the recorded one, but the recorded pitch correction is
+ * replaced with the correction of the replayed estimator using
+ * the integrator model dq/dt = -rate * (pitch - 1 - drift).
+ * So the device clocks, the wakeup times and the jitter are the
+ * recorded ones and the result is deterministic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+int verbose = 0;
+int use_syslog = 0;
+
+static unsigned int pitch_updates;
+
+/* the simulated streams have no driver, count the updates only */
+void update_pitch(struct loopback *loop)
+{
+	pitch_updates++;
+	if (verbose > 1)
+		snd_output_printf(loop->output, "New pitch for %s: %.8f\n", loop->id, loop->pitch);
+}
+
+struct replay_stats {
+	double start;			/* segment start time in sec */
+	double settled;			/* last time out of tolerance */
+	unsigned long wakeups;
+	double err_max;
+	double err_sum2;		/* after settling */
+	unsigned long err_count;
+	double pitch_min;
+	double pitch_max;
+};
+
+struct replay {
+	struct loopback loop;
+	struct loopback_handle play;
+	struct loopback_handle capt;
+	double tolerance;		/* in frames */
+	double ppm;			/* additional clock drift */
+	int drift;			/* -1 = recorded */
+	int resync;			/* take the recorded fill */
+	double q;			/* simulated fill */
+	double q_rec;			/* last recorded fill */
+	double pitch_rec;		/* last recorded pitch */
+	double t;			/* last trace time in sec */
+	double tstamp;			/* last stream timestamp in sec */
+	unsigned long long cpu;		/* estimator time in nsec */
+	unsigned long wakeups;
+	unsigned int segments;
+	struct replay_stats stats;
+};
+
+static unsigned long long replay_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_show(struct replay *r)
+{
+	struct replay_stats *s = &r->stats;
+	double rate = r->play.rate_req;
+
+	if (s->wakeups == 0)
+		return;
+	printf("segment %u: wakeups %lu, duration %.3fs\n",
+	       r->segments, s->wakeups, r->t - s->start);
+	printf("  max error %.1f frames (%.3fms)\n",
+	       s->err_max, s->err_max * 1000 / rate);
+	if (s->settled < r->t - 1e-9 && s->err_count > 0)
+		printf("  settled after %.3fs (+-%.0f frames), rms error %.2f frames\n",
+		       s->settled - s->start, r->tolerance,
+		       sqrt(s->err_sum2 / s->err_count));
+	else
+		printf("  not settled (+-%.0f frames)\n", r->tolerance);
+	printf("  pitch %.8f (min %.8f, max %.8f)\n",
+	       r->loop.pitch, s->pitch_min, s->pitch_max);
+}
+
+static void replay_start(struct replay *r, char *line)
+{
+	struct loopback *loop = &r->loop;
+	unsigned long long time;
+	unsigned long latency;
+	int sync, drift;
+
+	if (r->segments > 0)
+		stats_show(r);
+	if (sscanf(line, "S %llu %u %u %lu %i %i %lf %lf", &time,
+		   &r->play.rate_req, &r->capt.rate, &latency, &sync, &drift,
+		   &r->play.pitch, &r->capt.pitch) != 8) {
+		fprintf(stderr, "wrong start record: %s", line);
+		exit(EXIT_FAILURE);
+	}
+	r->play.rate = r->play.rate_req;
+	r->capt.rate_req = r->capt.rate;
+	r->play.sync_point = r->play.rate * 15;
+	r->capt.sync_point = r->capt.rate * 15;
+	r->play.counter = r->capt.counter = 0;
+	r->play.total_queued = r->capt.total_queued = 0;
+	loop->latency = latency;
+	loop->sync = sync;
+	loop->drift = r->drift >= 0 ? r->drift : drift;
+	loop->pitch = 1.0;
+	loop->pitch_delta = 1.0 / ((double)r->capt.rate * 4);
+	loop->pitch_diff = loop->pitch_diff_min = loop->pitch_diff_max = 0;
+	loop->total_queued_count = 0;
+	drift_init(loop);
+	r->resync = 1;
+	r->segments++;
+	memset(&r->stats, 0, sizeof(r->stats));
+	r->stats.start = r->stats.settled = time / 1e9;
+	r->stats.pitch_min = r->stats.pitch_max = 1.0;
+	r->t = time / 1e9;
+	if (verbose)
+		printf("start: rate %u, latency %lu, sync %i, drift %i\n",
+		       r->play.rate_req, latency, sync, loop->drift);
+}
+
+static void replay_wakeup(struct replay *r, char *line)
+{
+	struct loopback *loop = &r->loop;
+	struct replay_stats *s = &r->stats;
+	unsigned long long time, ptstamp, ctstamp, t0;
+	long pdelay, cdelay;
+	unsigned long pbuf, cbuf;
+	double pitch_rec, q_rec, cqueued, dt, err;
+	snd_htimestamp_t tstamp;
+
+	if (r->segments == 0)
+		return;
+	if (sscanf(line, "W %llu %lf %llu %li %lu %llu %li %lu", &time,
+		   &pitch_rec, &ptstamp, &pdelay, &pbuf, &ctstamp, &cdelay,
+		   &cbuf) != 8) {
+		fprintf(stderr, "wrong wakeup record: %s", line);
+		exit(EXIT_FAILURE);
+	}
+	/* the fill computation follows get_tstamp_fill() */
+	cqueued = cdelay + cbuf;
+	if (ptstamp > 0 && ctstamp > 0)
+		cqueued += ((double)ptstamp - (double)ctstamp) / 1e9 *
+								r->capt.rate;
+	else
+		ptstamp = time;
+	q_rec = cqueued * r->capt.pitch + (pdelay + pbuf) * r->play.pitch;
+	dt = ptstamp / 1e9 - r->tstamp;
+	if (r->resync) {
+		r->q = q_rec;
+		r->resync = 0;
+		dt = 0;
+	} else {
+		/* replace the recorded correction with the simulated one */
+		r->q += q_rec - r->q_rec;
+		r->q -= r->play.rate_req * dt *
+			(loop->pitch - r->pitch_rec - r->ppm / 1e6);
+	}
+	r->q_rec = q_rec;
+	r->pitch_rec = pitch_rec;
+	r->tstamp = ptstamp / 1e9;
+	r->t = time / 1e9;
+
+	t0 = replay_clock();
+	if (loop->sync != SYNC_TYPE_NONE && loop->drift == DRIFT_TYPE_PI) {
+		tstamp.tv_sec = ptstamp / 1000000000ULL;
+		tstamp.tv_nsec = ptstamp % 1000000000ULL;
+		drift_update_fill(loop, r->q, tstamp);
+	} else if (loop->sync != SYNC_TYPE_NONE && dt > 0) {
+		/* the transferred frames follow the clocks */
+		r->play.counter += r->play.rate * dt;
+		r->capt.counter += r->capt.rate * dt;
+		sync_average_update(loop,
+			(r->q - cqueued * r->capt.pitch) / r->play.pitch,
+			cqueued);
+	}
+	r->cpu += replay_clock() - t0;
+	r->wakeups++;
+
+	err = r->q - get_whole_latency(loop);
+	s->wakeups++;
+	if (fabs(err) > s->err_max)
+		s->err_max = fabs(err);
+	if (fabs(err) > r->tolerance) {
+		s->settled = r->t;
+		s->err_sum2 = 0;
+		s->err_count = 0;
+	} else {
+		s->err_sum2 += err * err;
+		s->err_count++;
+	}
+	if (s->pitch_min > loop->pitch)
+		s->pitch_min = loop->pitch;
+	if (s->pitch_max < loop->pitch)
+		s->pitch_max = loop->pitch;
+	if (verbose)
+		printf("%.6f %.2f %.2f %.9f %.9f\n", r->t - s->start,
+		       q_rec - get_whole_latency(loop), err,
+		       pitch_rec, loop->pitch);
+}
+
+static void help(void)
+{
+	printf(
+"Usage: alsaloop-replay [OPTION]... <trace>\n"
+"\n"
+"-h,--help      help\n"
+"-D,--drift     replayed drift estimator (0=average, 1=pi, default recorded)\n"
+"-p,--ppm       additional clock drift in ppm\n"
+"-e,--error     settled error tolerance in frames (default 1ms)\n"
+"-v,--verbose   print time, recorded and simulated error and pitch\n"
+"               for each wakeup (more -v means more verbose)\n"
+);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option long_option[] =
+	{
+		{"help", 0, NULL, 'h'},
+		{"drift", 1, NULL, 'D'},
+		{"ppm", 1, NULL, 'p'},
+		{"error", 1, NULL, 'e'},
+		{"verbose", 0, NULL, 'v'},
+		{NULL, 0, NULL, 0},
+	};
+	struct replay *r;
+	char line[512];
+	double tolerance = -1;
+	unsigned long long t0;
+	FILE *in;
+	int c;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return EXIT_FAILURE;
+	r->drift = -1;
+	while ((c = getopt_long(argc, argv, "hD:p:e:v", long_option, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case 'D':
+			if (strcasecmp(optarg, "average") == 0)
+				r->drift = DRIFT_TYPE_AVERAGE;
+			else if (strcasecmp(optarg, "pi") == 0)
+				r->drift = DRIFT_TYPE_PI;
+			else
+				r->drift = atoi(optarg);
+			if (r->drift < 0 || r->drift > DRIFT_TYPE_LAST)
+				r->drift = DRIFT_TYPE_AVERAGE;
+			break;
+		case 'p':
+			r->ppm = atof(optarg);
+			break;
+		case 'e':
+			tolerance = atof(optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			help();
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		help();
+		return EXIT_FAILURE;
+	}
+	in = fopen(argv[optind], "r");
+	if (in == NULL) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	r->loop.id = "replay";
+	r->loop.play = &r->play;
+	r->loop.capt = &r->capt;
+	r->play.loopback = r->capt.loopback = &r->loop;
+	snd_output_stdio_attach(&r->loop.output, stdout, 0);
+	t0 = replay_clock();
+	while (fgets(line, sizeof(line), in)) {
+		switch (line[0]) {
+		case 'S':
+			replay_start(r, line);
+			r->tolerance = tolerance >= 0 ? tolerance :
+				       r->play.rate_req / 1000.0;
+			break;
+		case 'W':
+			replay_wakeup(r, line);
+			break;
+		case 'X':
+			/* the latency is restored after an xrun */
+			r->resync = 1;
+			break;
+		}
+	}
+	fclose(in);
+	stats_show(r);
+	printf("replay time %.3fms, estimator %.1fns per wakeup, %u pitch updates\n",
+	       (replay_clock() - t0) / 1e6,
+	       r->wakeups ? (double)r->cpu / r->wakeups : 0,
+	       pitch_updates);
+	snd_output_close(r->loop.output);
+	free(r);
+	return EXIT_SUCCESS;
+}
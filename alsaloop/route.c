@@ -0,0 +1,304 @@
+/*
+ *  A simple PCM loopback utility - channel routing
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define ROUTE_MAX_GAIN	((double)MIX_GAIN_MAX / MIX_GAIN_UNITY)
+
+/*
+ * The argument is a list of SRC:DST[=GAIN] entries (like the route
+ * plugin ttable), for example "0:0,1:1,0:2=0.5,1:2=0.5".
+ */
+int route_parse(const char *str, struct loopback_route **_route)
+{
+	struct loopback_route *route;
+	struct loopback_route_entry *e;
+	const char *s = str;
+	char *end;
+	int err = -EINVAL;
+
+	route = calloc(1, sizeof(*route));
+	if (route == NULL)
+		return -ENOMEM;
+	while (*s) {
+		e = realloc(route->entries, (route->entries_count + 1) *
+							sizeof(*e));
+		if (e == NULL) {
+			err = -ENOMEM;
+			goto __error;
+		}
+		route->entries = e;
+		e += route->entries_count;
+		e->src = strtoul(s, &end, 10);
+		if (end == s || *end != ':' || e->src >= 1024)
+			goto __error;
+		s = end + 1;
+		e->dst = strtoul(s, &end, 10);
+		if (end == s || e->dst >= 1024)
+			goto __error;
+		s = end;
+		e->gain = 1.0;
+		if (*s == '=') {
+			e->gain = strtod(s + 1, &end);
+			if (end == s + 1 || e->gain < -ROUTE_MAX_GAIN ||
+			    e->gain > ROUTE_MAX_GAIN)
+				goto __error;
+			s = end;
+		}
+		if (*s == ',')
+			s++;
+		else if (*s)
+			goto __error;
+		if (route->channels <= e->dst)
+			route->channels = e->dst + 1;
+		route->entries_count++;
+	}
+	if (route->entries_count == 0)
+		goto __error;
+	*_route = route;
+	return 0;
+      __error:
+	if (err == -EINVAL)
+		logit(LOG_CRIT, "Wrong route syntax '%s'\n", str);
+	route_free(route);
+	return err;
+}
+
+void route_free(struct loopback_route *route)
+{
+	if (route == NULL)
+		return;
+	free(route->entries);
+	free(route->map);
+	free(route->gain);
+	free(route->fgain);
+	free(route);
+}
+
+/*
+ * Build the tables for the current stream channels. The entries
+ * with a source channel out of range are ignored.
+ */
+int route_setup(struct loopback_route *route, unsigned int channels_in,
+		unsigned int channels_out)
+{
+	struct loopback_route_entry *e;
+	unsigned int i, idx;
+	int unity = 1;
+
+	free(route->map);
+	free(route->gain);
+	free(route->fgain);
+	route->map = malloc(channels_out * sizeof(int));
+	route->gain = calloc(channels_out * channels_in, sizeof(int));
+	route->fgain = calloc(channels_out * channels_in, sizeof(float));
+	if (route->map == NULL || route->gain == NULL || route->fgain == NULL)
+		return -ENOMEM;
+	route->channels_in = channels_in;
+	route->channels_out = channels_out;
+	route->sparse = 1;
+	for (i = 0; i < channels_out; i++)
+		route->map[i] = -1;
+	for (i = 0; i < route->entries_count; i++) {
+		e = &route->entries[i];
+		if (e->src >= channels_in || e->dst >= channels_out)
+			continue;
+		idx = e->dst * channels_in + e->src;
+		route->fgain[idx] += e->gain;
+		route->gain[idx] = route->fgain[idx] * MIX_GAIN_UNITY +
+				   (route->fgain[idx] < 0 ? -0.5 : 0.5);
+		/* more sources for one output - downmix */
+		if (route->map[e->dst] >= 0 &&
+		    route->map[e->dst] != (int)e->src)
+			route->sparse = 0;
+		route->map[e->dst] = e->src;
+	}
+	for (i = 0; i < channels_out; i++) {
+		if (route->map[i] < 0)
+			continue;
+		if (route->gain[i * channels_in + route->map[i]] != MIX_GAIN_UNITY)
+			unity = 0;
+	}
+	route->copy = route->sparse && unity;
+	return 0;
+}
+
+static inline int16_t sat16(int32_t v)
+{
+	if (v > INT16_MAX)
+		return INT16_MAX;
+	if (v < INT16_MIN)
+		return INT16_MIN;
+	return v;
+}
+
+static inline int32_t sat32(int64_t v)
+{
+	if (v > INT32_MAX)
+		return INT32_MAX;
+	if (v < INT32_MIN)
+		return INT32_MIN;
+	return v;
+}
+
+/* pure routing - each output is a copy of one input or silence */
+#define ROUTE_COPY(name, type)						\
+static void name(const struct loopback_route *r, type *dst,		\
+		 const type *src, unsigned int frames)			\
+{									\
+	const unsigned int ci = r->channels_in, co = r->channels_out;	\
+	const int *map = r->map;					\
+	unsigned int f, c;						\
+									\
+	for (f = 0; f < frames; f++, src += ci, dst += co)		\
+		for (c = 0; c < co; c++)				\
+			dst[c] = map[c] >= 0 ? src[map[c]] : 0;		\
+}
+
+ROUTE_COPY(route_copy_s16, int16_t)
+ROUTE_COPY(route_copy_s32, int32_t)
+
+static void route_sparse_s16(const struct loopback_route *r, int16_t *dst,
+			     const int16_t *src, unsigned int frames)
+{
+	const unsigned int ci = r->channels_in, co = r->channels_out;
+	unsigned int f, c;
+	int m;
+
+	for (f = 0; f < frames; f++, src += ci, dst += co) {
+		for (c = 0; c < co; c++) {
+			m = r->map[c];
+			dst[c] = m < 0 ? 0 :
+				sat16(((int32_t)src[m] * r->gain[c * ci + m]) >> MIX_GAIN_SHIFT);
+		}
+	}
+}
+
+static void route_sparse_s32(const struct loopback_route *r, int32_t *dst,
+			     const int32_t *src, unsigned int frames)
+{
+	const unsigned int ci = r->channels_in, co = r->channels_out;
+	unsigned int f, c;
+	int m;
+
+	for (f = 0; f < frames; f++, src += ci, dst += co) {
+		for (c = 0; c < co; c++) {
+			m = r->map[c];
+			dst[c] = m < 0 ? 0 :
+				sat32(((int64_t)src[m] * r->gain[c * ci + m]) >> MIX_GAIN_SHIFT);
+		}
+	}
+}
+
+/* downmix - the products are summed to a wide accumulator */
+static void route_dense_s16(const struct loopback_route *r, int16_t *dst,
+			    const int16_t *src, unsigned int frames)
+{
+	const unsigned int ci = r->channels_in, co = r->channels_out;
+	const int *g;
+	unsigned int f, c, i;
+	int64_t acc;	/* the gains go up to 8 x unity */
+
+	for (f = 0; f < frames; f++, src += ci, dst += co) {
+		for (c = 0, g = r->gain; c < co; c++, g += ci) {
+			acc = 0;
+			for (i = 0; i < ci; i++)
+				acc += (int32_t)src[i] * g[i];
+			dst[c] = sat16(acc >> MIX_GAIN_SHIFT);
+		}
+	}
+}
+
+static void route_dense_s32(const struct loopback_route *r, int32_t *dst,
+			    const int32_t *src, unsigned int frames)
+{
+	const unsigned int ci = r->channels_in, co = r->channels_out;
+	const int *g;
+	unsigned int f, c, i;
+	int64_t acc;
+
+	for (f = 0; f < frames; f++, src += ci, dst += co) {
+		for (c = 0, g = r->gain; c < co; c++, g += ci) {
+			acc = 0;
+			for (i = 0; i < ci; i++)
+				acc += (int64_t)src[i] * g[i];
+			dst[c] = sat32(acc >> MIX_GAIN_SHIFT);
+		}
+	}
+}
+
+/* S16 or S32 interleaved frames */
+void route_frames(const struct loopback_route *route, snd_pcm_format_t format,
+		  void *dst, const void *src, unsigned int frames)
+{
+	if (format == SND_PCM_FORMAT_S32) {
+		if (route->copy)
+			route_copy_s32(route, dst, src, frames);
+		else if (route->sparse)
+			route_sparse_s32(route, dst, src, frames);
+		else
+			route_dense_s32(route, dst, src, frames);
+	} else {
+		if (route->copy)
+			route_copy_s16(route, dst, src, frames);
+		else if (route->sparse)
+			route_sparse_s16(route, dst, src, frames);
+		else
+			route_dense_s16(route, dst, src, frames);
+	}
+}
+
+/* the samplerate conversion input */
+void route_frames_float(const struct loopback_route *route, float *dst,
+			const float *src, unsigned int frames)
+{
+	const unsigned int ci = route->channels_in, co = route->channels_out;
+	const float *g;
+	unsigned int f, c, i;
+	float acc;
+	int m;
+
+	if (route->sparse) {
+		for (f = 0; f < frames; f++, src += ci, dst += co) {
+			for (c = 0; c < co; c++) {
+				m = route->map[c];
+				dst[c] = m < 0 ? 0 : src[m] * route->fgain[c * ci + m];
+			}
+		}
+		return;
+	}
+	for (f = 0; f < frames; f++, src += ci, dst += co) {
+		for (c = 0, g = route->fgain; c < co; c++, g += ci) {
+			acc = 0;
+			for (i = 0; i < ci; i++)
+				acc += src[i] * g[i];
+			dst[c] = acc;
+		}
+	}
+}
@@ -0,0 +1,143 @@
+/*
+ *  A simple PCM loopback utility - drift estimators
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The estimators do not touch the PCM devices. The measured values are
+ * passed by the caller, so the same code is driven by the simulated
+ * streams in the trace replay tool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+/* PI drift controller tuning */
+#define DRIFT_OMEGA		1.0	/* natural frequency in rad/s */
+#define DRIFT_ZETA		1.0	/* damping ratio */
+#define DRIFT_FILTER_TIME	0.05	/* error low-pass time constant in s */
+#define DRIFT_MAX_PITCH		0.01	/* maximal pitch correction */
+
+void drift_init(struct loopback *loop)
+{
+	double rate = loop->play->rate_req;
+
+	/* the queue is an integrator: dq/dt = -rate * (pitch - 1 - drift) */
+	loop->drift_kp = (2.0 * DRIFT_ZETA * DRIFT_OMEGA) / rate;
+	loop->drift_ki = (DRIFT_OMEGA * DRIFT_OMEGA) / rate;
+	loop->drift_err = 0;
+	loop->drift_integ = 0;
+	loop->drift_valid = 0;
+}
+
+/* the PI controller, fill is the whole queued frame count at tstamp */
+void drift_update_fill(struct loopback *loop, double fill,
+		       snd_htimestamp_t tstamp)
+{
+	double err, dt, pitch;
+
+	err = fill - get_whole_latency(loop);
+	if (!loop->drift_valid) {
+		loop->drift_err = err;
+		loop->drift_last = tstamp;
+		loop->drift_valid = 1;
+		return;
+	}
+	dt = htimediff(tstamp, loop->drift_last);
+	if (dt <= 0)
+		return;
+	if (dt > 1)
+		dt = 1;
+	loop->drift_last = tstamp;
+	loop->drift_err += (err - loop->drift_err) * dt / (dt + DRIFT_FILTER_TIME);
+	loop->drift_integ += loop->drift_ki * loop->drift_err * dt;
+	if (loop->drift_integ > DRIFT_MAX_PITCH)
+		loop->drift_integ = DRIFT_MAX_PITCH;
+	else if (loop->drift_integ < -DRIFT_MAX_PITCH)
+		loop->drift_integ = -DRIFT_MAX_PITCH;
+	pitch = loop->drift_kp * loop->drift_err + loop->drift_integ;
+	if (pitch > DRIFT_MAX_PITCH)
+		pitch = DRIFT_MAX_PITCH;
+	else if (pitch < -DRIFT_MAX_PITCH)
+		pitch = -DRIFT_MAX_PITCH;
+	pitch += 1.0;
+	loop->pitch_diff = err;
+	if (loop->pitch_diff_min > loop->pitch_diff)
+		loop->pitch_diff_min = loop->pitch_diff;
+	if (loop->pitch_diff_max < loop->pitch_diff)
+		loop->pitch_diff_max = loop->pitch_diff;
+	if (fabs(pitch - loop->pitch) >= loop->pitch_delta) {
+		loop->pitch = pitch;
+		update_pitch(loop);
+	}
+}
+
+/* the averaging estimator, called on each wakeup with the queued frames */
+void sync_average_update(struct loopback *loop, snd_pcm_sframes_t pqueued,
+			 snd_pcm_sframes_t cqueued)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_sframes_t diff, lat;
+
+	if (play->counter >= play->sync_point &&
+	    capt->counter >= play->sync_point) {
+		lat = get_whole_latency(loop);
+		diff = ((double)(((double)play->total_queued * play->pitch) +
+				 ((double)capt->total_queued * capt->pitch)) /
+			(double)loop->total_queued_count) - lat;
+		/* FIXME: this algorithm may be slightly better */
+		if (verbose > 3)
+			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
+		if (diff > 0) {
+			if (diff == loop->pitch_diff)
+				loop->pitch += loop->pitch_delta;
+			else if (diff > loop->pitch_diff)
+				loop->pitch += loop->pitch_delta*2;
+		} else if (diff < 0) {
+			if (diff == loop->pitch_diff)
+				loop->pitch -= loop->pitch_delta;
+			else if (diff < loop->pitch_diff)
+				loop->pitch -= loop->pitch_delta*2;
+		}
+		loop->pitch_diff = diff;
+		if (loop->pitch_diff_min > diff)
+			loop->pitch_diff_min = diff;
+		if (loop->pitch_diff_max < diff)
+			loop->pitch_diff_max = diff;
+		update_pitch(loop);
+		play->counter -= play->sync_point;
+		capt->counter -= play->sync_point;
+		play->total_queued = 0;
+		capt->total_queued = 0;
+		loop->total_queued_count = 0;
+	}
+	if (verbose > 4)
+		snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
+	if (pqueued > 0)
+		play->total_queued += pqueued;
+	if (cqueued > 0)
+		capt->total_queued += cqueued;
+	if (pqueued > 0 || cqueued > 0)
+		loop->total_queued_count += 1;
+}
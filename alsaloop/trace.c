@@ -0,0 +1,154 @@
+/*
+ *  A simple PCM loopback utility - sync trace recording
+ *
+ *     Author: Jaroslav Kysela <perex@perex.cz>
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The trace is a text file with one record per line (times in nsec):
+ *
+ *   # alsaloop trace 1
+ *   S <time> <rate> <capt_rate> <latency> <sync> <drift> <play_pitch> <capt_pitch>
+ *   W <time> <pitch> <play_tstamp> <play_delay> <play_buf> <capt_tstamp> <capt_delay> <capt_buf>
+ *   X <time> playback|capture
+ *
+ * S is written when the job is started, W after each wakeup and X on
+ * each xrun. The pitch in W is the pitch set for the following wakeup
+ * interval. The play_buf value includes the samplerate output residue,
+ * the capt_buf value is zero for the shared buffer and it includes
+ * the capture thread ring in the split mode. The play_tstamp is
+ * the monotonic time of the status read for the shared memory
+ * endpoint. The records are replayed by the alsaloop-replay tool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+struct loopback_trace {
+	FILE *file;
+	unsigned long long start;	/* monotonic time of open */
+};
+
+static inline unsigned long long tstamp_ns(snd_htimestamp_t *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static unsigned long long trace_time(struct loopback_trace *trace)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return tstamp_ns(&ts) - trace->start;
+}
+
+int trace_open(struct loopback *loop)
+{
+	struct loopback_trace *trace;
+	int err;
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return -ENOMEM;
+	trace->file = fopen(loop->trace_file, "w");
+	if (trace->file == NULL) {
+		err = -errno;
+		logit(LOG_CRIT, "%s: unable to create trace file '%s': %s\n", loop->id, loop->trace_file, snd_strerror(err));
+		free(trace);
+		return err;
+	}
+	/* the first record is at the zero time */
+	trace->start = trace_time(trace);
+	fprintf(trace->file, "# alsaloop trace 1\n");
+	loop->trace = trace;
+	return 0;
+}
+
+void trace_close(struct loopback *loop)
+{
+	if (loop->trace == NULL)
+		return;
+	fclose(loop->trace->file);
+	free(loop->trace);
+	loop->trace = NULL;
+}
+
+void trace_start(struct loopback *loop)
+{
+	struct loopback_trace *trace = loop->trace;
+
+	fprintf(trace->file, "S %llu %u %u %lu %i %i %.9f %.9f\n",
+		trace_time(trace), loop->play->rate_req, loop->capt->rate,
+		(unsigned long)get_whole_latency(loop), loop->sync,
+		loop->drift, loop->play->pitch, loop->capt->pitch);
+}
+
+void trace_xrun(struct loopback *loop, int playback)
+{
+	struct loopback_trace *trace = loop->trace;
+
+	fprintf(trace->file, "X %llu %s\n", trace_time(trace),
+		playback ? "playback" : "capture");
+}
+
+void trace_wakeup(struct loopback *loop)
+{
+	struct loopback_trace *trace = loop->trace;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_pcm_status_t *pstatus, *cstatus;
+	snd_htimestamp_t ptstamp, ctstamp;
+	snd_pcm_sframes_t pdelay;
+	snd_pcm_uframes_t pbuf;
+
+	snd_pcm_status_alloca(&pstatus);
+	snd_pcm_status_alloca(&cstatus);
+	if (play->endpoint)
+		endpoint_status(play, &ptstamp, &pdelay);
+	else if (snd_pcm_status(play->handle, pstatus) < 0)
+		return;
+	if (snd_pcm_status(capt->handle, cstatus) < 0)
+		return;
+	if ((!play->endpoint &&
+	     snd_pcm_status_get_state(pstatus) != SND_PCM_STATE_RUNNING) ||
+	    snd_pcm_status_get_state(cstatus) != SND_PCM_STATE_RUNNING)
+		return;
+	if (!play->endpoint) {
+		snd_pcm_status_get_htstamp(pstatus, &ptstamp);
+		pdelay = snd_pcm_status_get_delay(pstatus);
+	}
+	snd_pcm_status_get_htstamp(cstatus, &ctstamp);
+	pbuf = play->buf_count;
+#ifdef USE_SAMPLERATE
+	pbuf += loop->src_out_frames;
+#endif
+	fprintf(trace->file, "W %llu %.9f %llu %li %lu %llu %li %lu\n",
+		trace_time(trace), loop->pitch,
+		tstamp_ns(&ptstamp), (long)pdelay,
+		(unsigned long)pbuf,
+		tstamp_ns(&ctstamp), (long)snd_pcm_status_get_delay(cstatus),
+		(unsigned long)((play->buf == capt->buf ? 0 : capt->buf_count) +
+				split_fill(capt)));
+}
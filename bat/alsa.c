@@ -24,6 +24,8 @@
 
 #include "common.h"
 #include "alsa.h"
+#include "stream.h"
+#include "glitch.h"
 
 struct snd_pcm_container {
 	snd_pcm_t *handle;
@@ -215,7 +217,7 @@ static int generate_input_data(struct snd_pcm_container *sndpcm, int bytes,
 		struct bat *bat)
 {
 	int err;
-	static int load;
+	static long long load;
 	void *buf;
 	int max;
 
@@ -454,12 +456,12 @@ static int read_from_pcm(struct snd_pcm_container *sndpcm, int frames)
 	return 0;
 }
 
-static int read_from_pcm_loop(FILE *fp, int count,
+static int read_from_pcm_loop(FILE *fp, long long count,
 		struct snd_pcm_container *sndpcm, struct bat *bat)
 {
 	int err = 0;
 	int size, frames;
-	int remain = count;
+	long long remain = count;
 
 	while (remain > 0) {
 		size = (remain <= sndpcm->period_bytes) ?
@@ -471,11 +473,20 @@ static int read_from_pcm_loop(FILE *fp, int count,
 		if (err != 0)
 			return err;
 
+		/* pass the chunk to the analysis */
+		if (bat->ring)
+			stream_write(bat, sndpcm->buffer, size);
+		if (bat->glitches)
+			glitch_write(bat, sndpcm->buffer, frames);
+
 		/* write the chunk to file */
-		err = fwrite(sndpcm->buffer, 1, size, fp);
-		if (err != size) {
-			loge(E_MSG_WRITEFILE, "%s(%d)", snd_strerror(err), err);
-			return -EIO;
+		if (fp != NULL) {
+			err = fwrite(sndpcm->buffer, 1, size, fp);
+			if (err != size) {
+				loge(E_MSG_WRITEFILE, "%s(%d)",
+						snd_strerror(err), err);
+				return -EIO;
+			}
 		}
 		remain -= size;
 		bat->periods_played++;
@@ -497,7 +508,7 @@ void *record_alsa(struct bat *bat)
 	FILE *fp = NULL;
 	struct snd_pcm_container sndpcm;
 	struct wav_container wav;
-	int count;
+	long long count;
 
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
@@ -526,12 +537,16 @@ void *record_alsa(struct bat *bat)
 		goto exit2;
 	}
 
-	remove(bat->capture.file);
-	fp = fopen(bat->capture.file, "w+");
-	if (fp == NULL) {
-		loge(E_MSG_OPENFILEC, "%s %d", bat->capture.file, -errno);
-		retval_record = 1;
-		goto exit3;
+	/* the file is optional when the capture is analysed as a stream */
+	if (bat->capture.file != NULL) {
+		remove(bat->capture.file);
+		fp = fopen(bat->capture.file, "w+");
+		if (fp == NULL) {
+			loge(E_MSG_OPENFILEC, "%s %d",
+					bat->capture.file, -errno);
+			retval_record = 1;
+			goto exit3;
+		}
 	}
 
 	prepare_wav_info(&wav, bat);
@@ -542,13 +557,16 @@ void *record_alsa(struct bat *bat)
 	pthread_cleanup_push(destroy_mem, sndpcm.buffer);
 	pthread_cleanup_push((void *)close_file, fp);
 
-	err = write_wav_header(fp, &wav, bat);
-	if (err != 0) {
-		retval_record = 1;
-		goto exit4;
+	if (fp != NULL) {
+		err = write_wav_header(fp, &wav, bat);
+		if (err != 0) {
+			retval_record = 1;
+			goto exit4;
+		}
 	}
 
-	count = wav.chunk.length;
+	/* the length in the header is 32 bit, a soak run is longer */
+	count = bat->frames * bat->frame_size;
 	fprintf(bat->log, "Recording ...\n");
 	err = read_from_pcm_loop(fp, count, &sndpcm, bat);
 	if (err != 0) {
@@ -565,7 +583,7 @@ void *record_alsa(struct bat *bat)
 	snd_pcm_drain(sndpcm.handle);
 
 exit4:
-	fclose(fp);
+	close_file(fp);
 exit3:
 	free(sndpcm.buffer);
 exit2:
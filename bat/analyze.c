@@ -15,25 +15,201 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <math.h>
 #include <fftw3.h>
 
+#include "aconfig.h"
+
 #include "common.h"
+#include "convert.h"
+
+/*
+ * The transform of one size is planned once and reused for all channels
+ * and windows. The single precision transform is used for 8 and 16 bit
+ * samples, its rounding noise is far below their quantization noise.
+ * Without the fftw3f library all sizes use the double transform.
+ * The plan is shared by the workers, each worker has own buffers (the
+ * new-array execute is thread safe, the planning is not).
+ */
+struct fft_buf {
+	double *in;
+	float *inf;
+	fftw_complex *out;
+	fftwf_complex *outf;
+	double *mag;
+};
+
+struct fft {
+	int frames;		/* transform size */
+	bool single;		/* single precision transform */
+	unsigned int plans;	/* created plans */
+	fftw_plan plan;
+	fftwf_plan planf;
+	int workers;
+	struct fft_buf buf[MAX_CHANNELS];
+	double *window;		/* Blackman-Harris window */
+	double window_power;	/* sum of the squared window */
+};
+
+static void fft_free(struct fft *fft)
+{
+	struct fft_buf *b;
+	int i;
+
+	if (fft->plan)
+		fftw_destroy_plan(fft->plan);
+#ifdef HAVE_FFTW3F
+	if (fft->planf)
+		fftwf_destroy_plan(fft->planf);
+#endif
+	fft->plan = NULL;
+	fft->planf = NULL;
+	free(fft->window);
+	fft->window = NULL;
+	for (i = 0; i < fft->workers; i++) {
+		b = &fft->buf[i];
+		fftw_free(b->in);
+		fftw_free(b->out);
+#ifdef HAVE_FFTW3F
+		fftwf_free(b->inf);
+		fftwf_free(b->outf);
+#endif
+		fftw_free(b->mag);
+		memset(b, 0, sizeof(*b));
+	}
+	fft->workers = 0;
+	fft->frames = 0;
+}
+
+static int fft_buf_alloc(struct fft_buf *b, int N, bool single)
+{
+	b->mag = (double *) fftw_malloc(sizeof(double) * N);
+#ifdef HAVE_FFTW3F
+	if (single) {
+		b->inf = (float *) fftwf_malloc(sizeof(float) * N);
+		b->outf = (fftwf_complex *)
+			fftwf_malloc(sizeof(fftwf_complex) * (N / 2 + 1));
+		if (b->inf == NULL || b->outf == NULL)
+			return -ENOMEM;
+		return b->mag == NULL ? -ENOMEM : 0;
+	}
+#endif
+	b->in = (double *) fftw_malloc(sizeof(double) * N);
+	b->out = (fftw_complex *)
+		fftw_malloc(sizeof(fftw_complex) * (N / 2 + 1));
+	if (b->in == NULL || b->out == NULL)
+		return -ENOMEM;
+
+	return b->mag == NULL ? -ENOMEM : 0;
+}
+
+/*
+ * The 7-term Blackman-Harris window, its side lobes are 180 dB down so
+ * the leakage of the fundamental stays below the noise of 24 bit data
+ */
+#define WINDOW_TERMS	7
+
+static const double window_coef[WINDOW_TERMS] = {
+	0.27105140069342, -0.43329793923448, 0.21812299954311,
+	-0.06592544638803, 0.01081174209837, -0.00077658482522,
+	0.00001388721735,
+};
+
+static int fft_window(struct fft *fft, int N)
+{
+	double w;
+	int i, k;
+
+	fft->window = malloc(sizeof(double) * N);
+	if (fft->window == NULL)
+		return -ENOMEM;
+	fft->window_power = 0.0;
+	for (i = 0; i < N; i++) {
+		w = 0.0;
+		for (k = 0; k < WINDOW_TERMS; k++)
+			w += window_coef[k] * cos(2.0 * M_PI * k * i / N);
+		fft->window[i] = w;
+		fft->window_power += w * w;
+	}
+
+	return 0;
+}
+
+static int fft_setup(struct bat *bat, int N, int workers)
+{
+	struct fft *fft = bat->fft;
+#ifdef HAVE_FFTW3F
+	bool single = bat->convert_sample_to_float != NULL;
+#else
+	bool single = false;
+#endif
+	int i;
+
+	if (fft == NULL) {
+		fft = calloc(1, sizeof(*fft));
+		if (fft == NULL)
+			return -ENOMEM;
+		bat->fft = fft;
+	}
+	if (fft->frames == N && fft->single == single
+			&& fft->workers >= workers)
+		return 0;
+
+	fft_free(fft);
+	fft->single = single;
+	fft->workers = workers;
+	for (i = 0; i < workers; i++) {
+		if (fft_buf_alloc(&fft->buf[i], N, single) < 0)
+			goto err;
+	}
+	if (fft_window(fft, N) < 0)
+		goto err;
+
+	/* the planning overwrites the buffers */
+#ifdef HAVE_FFTW3F
+	if (single)
+		fft->planf = fftwf_plan_dft_r2c_1d(N, fft->buf[0].inf,
+				fft->buf[0].outf, FFTW_MEASURE);
+	else
+#endif
+		fft->plan = fftw_plan_dft_r2c_1d(N, fft->buf[0].in,
+				fft->buf[0].out, FFTW_MEASURE);
+	if (fft->plan == NULL && fft->planf == NULL)
+		goto err;
+	fft->frames = N;
+	fft->plans++;
+
+	return 0;
+
+err:
+	fft_free(fft);
+	return -ENOMEM;
+}
 
 /**
- * Convert from sample size to double
+ * Convert from sample size to double and apply the window
  */
-static int convert(struct bat *bat, struct analyze *a)
+static int convert(struct bat *bat, struct analyze *a, struct fft_buf *b)
 {
-	void *s = a->buf;
+	const double *w = bat->fft->window;
 	int i;
 
-	for (i = 0; i < bat->frames; i++)
-		a->in[i] = bat->convert_sample_to_double(s, i);
+	if (bat->fft->single) {
+		bat->convert_sample_to_float(a->buf, b->inf, a->frames);
+		for (i = 0; i < a->frames; i++)
+			b->inf[i] *= w[i];
+	} else {
+		bat->convert_sample_to_double(a->buf, b->in, a->frames);
+		for (i = 0; i < a->frames; i++)
+			b->in[i] *= w[i];
+	}
 
 	return 0;
 }
@@ -53,27 +229,27 @@ int check_peak(struct bat *bat, struct analyze *a, int end, int peak, float hz,
 	float delta_HZ = DELTA_HZ;
 	float tolerance = (delta_rate > delta_HZ) ? delta_rate : delta_HZ;
 
-	fprintf(bat->log, "Detected peak at %2.2f Hz of %2.2f dB\n", hz_peak,
+	fprintf(a->log, "Detected peak at %2.2f Hz of %2.2f dB\n", hz_peak,
 			10.0 * log10(a->mag[peak] / mean));
-	fprintf(bat->log, " Total %3.1f dB from %2.2f to %2.2f Hz\n",
+	fprintf(a->log, " Total %3.1f dB from %2.2f to %2.2f Hz\n",
 			10.0 * log10(p / mean), start * hz,
 			end * hz);
 
 	if (hz_peak < DC_THRESHOLD) {
-		fprintf(bat->log, " WARNING: Found low peak %2.2f Hz,",
+		fprintf(a->log, " WARNING: Found low peak %2.2f Hz,",
 				hz_peak);
-		fprintf(bat->log, " very close to DC\n");
+		fprintf(a->log, " very close to DC\n");
 		ret = FOUND_DC;
 	} else if (hz_peak < bat->target_freq[channel] - tolerance) {
-		fprintf(bat->log, " FAIL: Peak freq too low %2.2f Hz\n",
+		fprintf(a->log, " FAIL: Peak freq too low %2.2f Hz\n",
 				hz_peak);
 		ret = FOUND_WRONG_PEAK;
 	} else if (hz_peak > bat->target_freq[channel] + tolerance) {
-		fprintf(bat->log, " FAIL: Peak freq too high %2.2f Hz\n",
+		fprintf(a->log, " FAIL: Peak freq too high %2.2f Hz\n",
 				hz_peak);
 		ret = FOUND_WRONG_PEAK;
 	} else {
-		fprintf(bat->log, " PASS: Peak detected at target frequency\n");
+		fprintf(a->log, " PASS: Peak detected at target frequency\n");
 		ret = 0;
 	}
 
@@ -85,10 +261,10 @@ int check_peak(struct bat *bat, struct analyze *a, int end, int peak, float hz,
  */
 static int check(struct bat *bat, struct analyze *a, int channel)
 {
-	float hz = 1.0 / ((float) bat->frames / (float) bat->rate);
+	float hz = 1.0 / ((float) a->frames / (float) bat->rate);
 	float mean = 0.0, t, sigma = 0.0, p = 0.0;
 	int i, start = -1, end = -1, peak = 0, signals = 0;
-	int ret = 0, N = bat->frames / 2;
+	int ret = 0, N = a->frames / 2;
 
 	/* calculate mean */
 	for (i = 0; i < N; i++)
@@ -136,115 +312,284 @@ static int check(struct bat *bat, struct analyze *a, int channel)
 	else
 		ret = 0; /* Correct peak detected */
 
-	fprintf(bat->log, "Detected at least %d signal(s) in total\n", signals);
+	fprintf(a->log, "Detected at least %d signal(s) in total\n", signals);
 
 	return ret;
 }
 
-static void calc_magnitude(struct bat *bat, struct analyze *a, int N)
+static void calc_magnitude(struct bat *bat, struct analyze *a,
+		struct fft_buf *b, int N)
 {
 	double r2, i2;
 	int i;
 
 	for (i = 1; i < N / 2; i++) {
-		r2 = a->out[i] * a->out[i];
-		i2 = a->out[N - i] * a->out[N - i];
+		if (bat->fft->single) {
+			r2 = b->outf[i][0] * b->outf[i][0];
+			i2 = b->outf[i][1] * b->outf[i][1];
+		} else {
+			r2 = b->out[i][0] * b->out[i][0];
+			i2 = b->out[i][1] * b->out[i][1];
+		}
 
 		a->mag[i] = sqrt(r2 + i2);
 	}
 	a->mag[0] = 0.0;
 }
 
-static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
-		int channel)
+/* bins on each side of a peak, the window main lobe is 7 bins wide */
+#define PEAK_BINS	8
+
+/* a requested limit cannot pass without the measurement */
+static int quality_skipped(struct bat *bat, struct analyze *a)
 {
-	fftw_plan p;
-	int ret = -ENOMEM, N = bat->frames;
+	if (isnan(bat->max_thd) && isnan(bat->max_thdn) && isnan(bat->min_snr))
+		return 0;
 
-	/* Allocate FFT buffers */
-	a->in = (double *) fftw_malloc(sizeof(double) * bat->frames);
-	if (a->in == NULL)
-		goto out1;
+	fprintf(a->log, " FAIL: distortion not measured\n");
+	return -EBADQUALITY;
+}
 
-	a->out = (double *) fftw_malloc(sizeof(double) * bat->frames);
-	if (a->out == NULL)
-		goto out2;
+/**
+ * Measure the distortion and the noise around the target frequency.
+ * The power of each bin goes to the fundamental, a harmonic, DC or
+ * the noise, the levels are relative to a full scale sine.
+ *
+ * @return 0 if the thresholds are met, -EBADQUALITY otherwise
+ */
+static int check_quality(struct bat *bat, struct analyze *a, int channel)
+{
+	float hz = (float) bat->rate / a->frames;
+	double fs = (double) (1ULL << (bat->sample_size * 8 - 1));
+	double full = a->frames * fs * fs / 4.0 * bat->fft->window_power;
+	double fund = 0.0, harm = 0.0, noise = 0.0, p, l, r, c, kf, d;
+	float thd, thdn, snr;
+	int i, h, k, peak, N = a->frames / 2, ret = 0;
+
+	/* the fundamental is the highest bin close to the target */
+	k = (int) (bat->target_freq[channel] / hz + 0.5);
+	peak = k;
+	for (i = k - PEAK_BINS; i <= k + PEAK_BINS; i++)
+		if (i > 0 && i < N - 1 && a->mag[i] > a->mag[peak])
+			peak = i;
+	if (peak < 2 * PEAK_BINS || peak >= N - 1) {
+		fprintf(a->log, " Too few bins to measure distortion\n");
+		return quality_skipped(bat, a);
+	}
 
-	a->mag = (double *) fftw_malloc(sizeof(double) * bat->frames);
-	if (a->mag == NULL)
-		goto out3;
+	if (a->mag[peak] == 0.0) {
+		fprintf(a->log, " No signal to measure distortion\n");
+		return quality_skipped(bat, a);
+	}
 
-	/* create FFT plan */
-	p = fftw_plan_r2r_1d(N, a->in, a->out, FFTW_R2HC,
-			FFTW_MEASURE | FFTW_PRESERVE_INPUT);
-	if (p == NULL)
-		goto out4;
+	/* interpolate the peak so that the harmonics are placed right */
+	kf = peak;
+	if (a->mag[peak - 1] > 0.0 && a->mag[peak + 1] > 0.0) {
+		l = log(a->mag[peak - 1]);
+		c = log(a->mag[peak]);
+		r = log(a->mag[peak + 1]);
+		d = l - 2.0 * c + r;
+		if (d != 0.0)
+			kf = peak + 0.5 * (l - r) / d;
+	}
+
+	for (i = PEAK_BINS + 1; i < N; i++) {
+		p = a->mag[i] * a->mag[i];
+		h = (int) (i / kf + 0.5);
+		d = fabs(i - h * kf);
+		if (h == 1 && d <= PEAK_BINS)
+			fund += p;
+		else if (h > 1 && h <= MAX_HARMONICS && d <= PEAK_BINS)
+			harm += p;
+		else
+			noise += p;
+	}
+	if (fund == 0.0 || noise == 0.0) {
+		fprintf(a->log, " No signal or noise to measure distortion\n");
+		return quality_skipped(bat, a);
+	}
+
+	thd = 10.0 * log10(harm / fund);
+	thdn = 10.0 * log10((harm + noise) / fund);
+	snr = 10.0 * log10(fund / noise);
+	fprintf(a->log, " Signal %2.2f dBFS, noise %2.2f dBFS\n",
+			10.0 * log10(fund / full), 10.0 * log10(noise / full));
+	fprintf(a->log, " THD %2.2f dB, THD+N %2.2f dB, SNR %2.2f dB\n",
+			thd, thdn, snr);
+
+	if (!isnan(bat->max_thd) && thd > bat->max_thd) {
+		fprintf(a->log, " FAIL: THD above %2.2f dB\n", bat->max_thd);
+		ret = -EBADQUALITY;
+	}
+	if (!isnan(bat->max_thdn) && thdn > bat->max_thdn) {
+		fprintf(a->log, " FAIL: THD+N above %2.2f dB\n",
+				bat->max_thdn);
+		ret = -EBADQUALITY;
+	}
+	if (!isnan(bat->min_snr) && snr < bat->min_snr) {
+		fprintf(a->log, " FAIL: SNR below %2.2f dB\n", bat->min_snr);
+		ret = -EBADQUALITY;
+	}
+
+	return ret;
+}
+
+static int find_and_check_harmonics(struct bat *bat, struct analyze *a,
+		struct fft_buf *b, int channel)
+{
+	int ret, N = a->frames;
+
+	a->mag = b->mag;
 
 	/* convert source PCM to doubles */
-	ret = convert(bat, a);
+	ret = convert(bat, a, b);
 	if (ret != 0)
-		goto out4;
+		return ret;
 
 	/* run FFT */
-	fftw_execute(p);
+#ifdef HAVE_FFTW3F
+	if (bat->fft->single)
+		fftwf_execute_dft_r2c(bat->fft->planf, b->inf, b->outf);
+	else
+#endif
+		fftw_execute_dft_r2c(bat->fft->plan, b->in, b->out);
 
 	/* FFT out is real and imaginary numbers - calc magnitude for each */
-	calc_magnitude(bat, a, N);
+	calc_magnitude(bat, a, b, N);
 
 	/* check data */
 	ret = check(bat, a, channel);
+	if (ret != 0)
+		return ret;
 
-	fftw_destroy_plan(p);
+	/* measure the distortion of a correct signal */
+	return check_quality(bat, a, channel);
+}
 
-out4:
-	fftw_free(a->mag);
-out3:
-	fftw_free(a->out);
-out2:
-	fftw_free(a->in);
-out1:
-	return ret;
+/*
+ * The channels are analysed by a pool of workers, each channel logs to
+ * own memory stream and the logs are copied in the channel order.
+ */
+struct analyze_pool {
+	struct bat *bat;
+	pthread_mutex_t lock;
+	int next;		/* next channel to analyse */
+	struct analyze a[MAX_CHANNELS];
+	char *text[MAX_CHANNELS];
+	size_t size[MAX_CHANNELS];
+	int ret[MAX_CHANNELS];
+};
+
+struct analyze_worker {
+	struct analyze_pool *pool;
+	struct fft_buf *buf;
+	pthread_t thread;
+};
+
+static void *analyze_worker(void *arg)
+{
+	struct analyze_worker *w = arg;
+	struct analyze_pool *pool = w->pool;
+	struct bat *bat = pool->bat;
+	struct analyze *a;
+	int c;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		c = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (c >= bat->channels)
+			break;
+
+		a = &pool->a[c];
+		fprintf(a->log, "\nChannel %i - ", c + 1);
+		fprintf(a->log, "Checking for target frequency %2.2f Hz\n",
+				bat->target_freq[c]);
+		pool->ret[c] = find_and_check_harmonics(bat, a, w->buf, c);
+		fclose(a->log);
+	}
+
+	return NULL;
+}
+
+static int analyze_workers(struct bat *bat)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	return cpus < bat->channels ? cpus : bat->channels;
 }
 
 /**
- * Convert interleaved samples from channels in samples from a single channel
+ * Check all channels, the samples of each channel follow the previous
+ * channel. The result is the first failed channel result
  */
-static int reorder_data(struct bat *bat)
+int analyze_window(struct bat *bat, void *buf, int frames)
 {
-	char *p, *new_bat_buf;
-	int ch, i, j;
+	struct analyze_pool pool;
+	struct analyze_worker w[MAX_CHANNELS];
+	int ret, c, i, workers = analyze_workers(bat);
 
-	if (bat->channels == 1)
-		return 0; /* No need for reordering */
+	ret = fft_setup(bat, frames, workers);
+	if (ret != 0)
+		return ret;
 
-	p = malloc(bat->frames * bat->frame_size);
-	new_bat_buf = p;
-	if (p == NULL)
-		return -ENOMEM;
+	memset(&pool, 0, sizeof(pool));
+	pool.bat = bat;
+	pthread_mutex_init(&pool.lock, NULL);
 
-	for (ch = 0; ch < bat->channels; ch++) {
-		for (j = 0; j < bat->frames; j++) {
-			for (i = 0; i < bat->sample_size; i++) {
-				*p++ = ((char *) (bat->buf))[j * bat->frame_size
-						+ ch * bat->sample_size + i];
-			}
+	for (c = 0; c < bat->channels; c++) {
+		pool.a[c].buf = (char *) buf + c * frames * bat->sample_size;
+		pool.a[c].frames = frames;
+		pool.a[c].log = open_memstream(&pool.text[c], &pool.size[c]);
+		if (pool.a[c].log == NULL) {
+			while (c-- > 0)
+				fclose(pool.a[c].log);
+			ret = -ENOMEM;
+			goto out;
 		}
 	}
 
-	free(bat->buf);
-	bat->buf = new_bat_buf;
+	/* the first worker is the calling thread */
+	for (i = 0; i < workers; i++) {
+		w[i].pool = &pool;
+		w[i].buf = &bat->fft->buf[i];
+		if (i > 0 && pthread_create(&w[i].thread, NULL,
+				analyze_worker, &w[i]) != 0)
+			break;
+	}
+	workers = i;
+	analyze_worker(&w[0]);
+	for (i = 1; i < workers; i++)
+		pthread_join(w[i].thread, NULL);
 
-	return 0;
+	for (c = 0; c < bat->channels; c++) {
+		fwrite(pool.text[c], 1, pool.size[c], bat->log);
+		if (ret == 0)
+			ret = pool.ret[c];
+	}
+
+out:
+	for (c = 0; c < bat->channels; c++)
+		free(pool.text[c]);
+	pthread_mutex_destroy(&pool.lock);
+
+	return ret;
 }
 
+/* frames read from the capture file at once */
+#define CAPTURE_CHUNK	4096
+
 int analyze_capture(struct bat *bat)
 {
 	int ret = 0;
 	size_t items;
-	int c;
-	struct analyze a;
+	char *chunk;
+	long long j;
+	int n;
 
-	fprintf(bat->log, "\nBAT analyses signal has %d frames at %d Hz,",
+	fprintf(bat->log, "\nBAT analyses signal has %lld frames at %d Hz,",
 			bat->frames, bat->rate);
 	fprintf(bat->log, " %d channels, %d bytes per sample.\n",
 			bat->channels, bat->sample_size);
@@ -252,6 +597,11 @@ int analyze_capture(struct bat *bat)
 	bat->buf = malloc(bat->frames * bat->frame_size);
 	if (bat->buf == NULL)
 		return -ENOMEM;
+	chunk = malloc(CAPTURE_CHUNK * bat->frame_size);
+	if (chunk == NULL) {
+		ret = -ENOMEM;
+		goto exit1;
+	}
 
 	bat->fp = fopen(bat->capture.file, "rb");
 	if (bat->fp == NULL) {
@@ -265,30 +615,98 @@ int analyze_capture(struct bat *bat)
 	if (ret != 0)
 		goto exit2;
 
-	items = fread(bat->buf, bat->frame_size, bat->frames, bat->fp);
-	if (items != bat->frames) {
-		ret = -EIO;
-		goto exit2;
+	/* deinterleave while reading, the channels are stored one by one */
+	for (j = 0; j < bat->frames; j += n) {
+		n = bat->frames - j;
+		if (n > CAPTURE_CHUNK)
+			n = CAPTURE_CHUNK;
+		items = fread(chunk, bat->frame_size, n, bat->fp);
+		if (items != n) {
+			ret = -EIO;
+			goto exit2;
+		}
+		deinterleave((char *) bat->buf + j * bat->sample_size,
+				bat->frames, chunk, n, bat->channels,
+				bat->sample_size);
 	}
 
-	ret = reorder_data(bat);
-	if (ret != 0)
-		goto exit2;
-
-	for (c = 0; c < bat->channels; c++) {
-		fprintf(bat->log, "\nChannel %i - ", c + 1);
-		fprintf(bat->log, "Checking for target frequency %2.2f Hz\n",
-				bat->target_freq[c]);
-		a.buf = bat->buf +
-				c * bat->frames * bat->frame_size
-				/ bat->channels;
-		ret = find_and_check_harmonics(bat, &a, c);
-	}
+	ret = analyze_window(bat, bat->buf, bat->frames);
 
 exit2:
 	fclose(bat->fp);
 exit1:
+	free(chunk);
 	free(bat->buf);
 
 	return ret;
 }
+
+#ifdef HAVE_FFTW3F
+/* the single precision wisdom is in a separate file */
+static int wisdom_single(struct bat *bat, bool save)
+{
+	char *name;
+	int ret;
+
+	name = malloc(strlen(bat->wisdom) + 2);
+	if (name == NULL)
+		return 0;
+	sprintf(name, "%sf", bat->wisdom);
+	if (save)
+		ret = fftwf_export_wisdom_to_filename(name);
+	else
+		ret = fftwf_import_wisdom_from_filename(name);
+	free(name);
+
+	return ret;
+}
+#endif
+
+/**
+ * Load the system wisdom and the wisdom saved by previous runs
+ */
+void analyze_init(struct bat *bat)
+{
+	int ret;
+
+	fftw_import_system_wisdom();
+#ifdef HAVE_FFTW3F
+	fftwf_import_system_wisdom();
+#endif
+
+	if (bat->wisdom == NULL)
+		return;
+
+	ret = fftw_import_wisdom_from_filename(bat->wisdom);
+#ifdef HAVE_FFTW3F
+	ret |= wisdom_single(bat, false);
+#endif
+	if (ret)
+		fprintf(bat->log, "Loaded FFTW wisdom from %s\n", bat->wisdom);
+}
+
+/**
+ * Free the FFT plan and save the wisdom of the created plans
+ */
+void analyze_done(struct bat *bat)
+{
+	struct fft *fft = bat->fft;
+	int ret;
+
+	if (fft == NULL)
+		return;
+
+	if (bat->wisdom && fft->plans > 0) {
+		ret = fftw_export_wisdom_to_filename(bat->wisdom);
+#ifdef HAVE_FFTW3F
+		if (ret)
+			ret = wisdom_single(bat, true);
+#endif
+		if (!ret)
+			loge(E_MSG_WRITEFILE, "wisdom %s", bat->wisdom);
+	}
+
+	fft_free(fft);
+	free(fft);
+	bat->fft = NULL;
+}
@@ -13,4 +13,7 @@
  *
  */
 
+int analyze_window(struct bat *, void *, int);
 int analyze_capture(struct bat *);
+void analyze_init(struct bat *);
+void analyze_done(struct bat *);
@@ -17,10 +17,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <getopt.h>
+#include <math.h>
 
 #include "aconfig.h"
 
@@ -29,22 +31,25 @@
 #include "alsa.h"
 #include "convert.h"
 #include "analyze.h"
+#include "stream.h"
+#include "glitch.h"
 
 static int get_duration(struct bat *bat)
 {
-	float duration_f;
-	int duration_i;
+	double duration_f;
+	long long duration_i;
 	char *ptrf, *ptri;
 
 	errno = 0;
 
 	duration_f = strtod(bat->narg, &ptrf);
-	duration_i = strtol(bat->narg, &ptri, 10);
+	duration_i = strtoll(bat->narg, &ptri, 10);
 
 	if (errno != 0)
 		return -errno;
 
-	if (duration_i < 0 || duration_i > MAX_FRAMES)
+	/* the frame count is capped, the streaming analysis has no limit */
+	if (duration_i < 0 || (!bat->stream && duration_i > MAX_FRAMES))
 		return -EINVAL;
 
 	if (*ptrf == 's')
@@ -60,18 +65,23 @@ static int get_duration(struct bat *bat)
 	return 0;
 }
 
+/* one frequency per channel, the last one is used for the rest */
 static void get_sine_frequencies(struct bat *bat, char *freq)
 {
 	char *tmp1;
-
-	tmp1 = strchr(freq, ',');
-	if (tmp1 == NULL) {
-		bat->target_freq[1] = bat->target_freq[0] = atof(optarg);
-	} else {
-		*tmp1 = '\0';
-		bat->target_freq[0] = atof(optarg);
-		bat->target_freq[1] = atof(tmp1 + 1);
+	int c = 0;
+
+	while (c < MAX_CHANNELS) {
+		tmp1 = strchr(freq, ',');
+		if (tmp1 != NULL)
+			*tmp1 = '\0';
+		bat->target_freq[c++] = atof(freq);
+		if (tmp1 == NULL)
+			break;
+		freq = tmp1 + 1;
 	}
+	for (; c < MAX_CHANNELS; c++)
+		bat->target_freq[c] = bat->target_freq[c - 1];
 }
 
 static inline int thread_wait_completion(struct bat *bat,
@@ -229,16 +239,30 @@ static void usage(struct bat *bat, char *argv[])
 "-r                     sampling rate\n"
 "-n                     frames to capture\n"
 "-k                     sigma k\n"
-"-F                     target frequency\n"
+"-F                     target frequency (comma separated per channel)\n"
 "-l                     internal loop, bypass hardware\n"
 "-p                     total number of periods to play/capture\n"
 "    --log              path of log file. if not set, logs be put to stdout\n"
 "    --saveplay         save playback content to target file, for debug\n"
+"    --savecap          save capture content to target file\n"
+"    --stream           analyse the capture while recording, in\n"
+"                       overlapping windows (no capture file by default)\n"
+"    --window           frames of one analysis window for --stream\n"
+"                       (default about one second)\n"
+"    --wisdom           FFTW wisdom file, loaded at start and updated\n"
+"    --sine             sine generator: exact (default) or fast wavetable\n"
+"    --thd              fail if the THD is above the given dB\n"
+"    --thdn             fail if the THD+N is above the given dB\n"
+"    --snr              fail if the SNR is below the given dB\n"
+"    --glitch           detect dropouts, skipped and repeated frames while\n"
+"                       recording, implies --stream\n"
 			, argv[0]);
 }
 
 static void set_defaults(struct bat *bat)
 {
+	int c;
+
 	memset(bat, 0, sizeof(struct bat));
 
 	/* Set default values */
@@ -247,11 +271,15 @@ static void set_defaults(struct bat *bat)
 	bat->frame_size = 2;
 	bat->sample_size = 2;
 	bat->convert_float_to_sample = convert_float_to_int16;
+	bat->convert_sample_to_float = convert_int16_to_float;
 	bat->convert_sample_to_double = convert_int16_to_double;
 	bat->frames = bat->rate * 2;
-	bat->target_freq[0] = 997.0;
-	bat->target_freq[1] = 997.0;
+	for (c = 0; c < MAX_CHANNELS; c++)
+		bat->target_freq[c] = 997.0;
 	bat->sigma_k = 3.0;
+	bat->max_thd = NAN;
+	bat->max_thdn = NAN;
+	bat->min_snr = NAN;
 	bat->playback.device = NULL;
 	bat->capture.device = NULL;
 	bat->buf = NULL;
@@ -272,6 +300,15 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		{"help", 0, 0, 'h'},
 		{"log", 1, 0, OPT_LOG},
 		{"saveplay", 1, 0, OPT_SAVEPLAY},
+		{"savecap", 1, 0, OPT_SAVECAP},
+		{"stream", 0, 0, OPT_STREAM},
+		{"window", 1, 0, OPT_WINDOW},
+		{"wisdom", 1, 0, OPT_WISDOM},
+		{"sine", 1, 0, OPT_SINE},
+		{"thd", 1, 0, OPT_THD},
+		{"thdn", 1, 0, OPT_THDN},
+		{"snr", 1, 0, OPT_SNR},
+		{"glitch", 0, 0, OPT_GLITCH},
 		{0, 0, 0, 0}
 	};
 
@@ -284,6 +321,35 @@ static void parse_arguments(struct bat *bat, int argc, char *argv[])
 		case OPT_SAVEPLAY:
 			bat->debugplay = optarg;
 			break;
+		case OPT_SAVECAP:
+			bat->savecap = optarg;
+			break;
+		case OPT_STREAM:
+			bat->stream = true;
+			break;
+		case OPT_WINDOW:
+			bat->window = atoi(optarg);
+			break;
+		case OPT_WISDOM:
+			bat->wisdom = optarg;
+			break;
+		case OPT_SINE:
+			bat->sinearg = optarg;
+			break;
+		case OPT_THD:
+			bat->max_thd = atof(optarg);
+			break;
+		case OPT_THDN:
+			bat->max_thdn = atof(optarg);
+			break;
+		case OPT_SNR:
+			bat->min_snr = atof(optarg);
+			break;
+		case OPT_GLITCH:
+			/* the capture is not kept, it is analysed as a stream */
+			bat->glitch = true;
+			bat->stream = true;
+			break;
 		case 'D':
 			if (bat->playback.device == NULL)
 				bat->playback.device = optarg;
@@ -357,12 +423,57 @@ static int validate_options(struct bat *bat)
 		return -EINVAL;
 	}
 
+	/* check the glitch detection has a capture */
+	if (bat->glitch && (bat->local || bat->playback.single)) {
+		loge(E_MSG_PARAMS, "glitch detection needs capture");
+		return -EINVAL;
+	}
+
+	/* check the streaming analysis has a capture and a window */
+	if (bat->stream) {
+		if (bat->local || bat->playback.single) {
+			loge(E_MSG_PARAMS, "streaming analysis needs capture");
+			return -EINVAL;
+		}
+		/* about one second by default, a power of two for the FFT */
+		if (bat->window == 0) {
+			bat->window = 2;
+			while (bat->window < bat->rate)
+				bat->window <<= 1;
+			if (bat->window > bat->frames)
+				bat->window = bat->frames;
+		}
+		if (bat->window < 2 || bat->window > bat->frames) {
+			loge(E_MSG_PARAMS, "window %d out of range (2, %lld)",
+					bat->window, bat->frames);
+			return -EINVAL;
+		}
+	}
+
+	/* the length in the wav header is 32 bit */
+	if (!bat->local && bat->capture.file != NULL
+			&& bat->frames * bat->frame_size > UINT32_MAX) {
+		loge(E_MSG_PARAMS, "capture file over 4 GiB");
+		return -EINVAL;
+	}
+
 	/* check single ended is in either playback or capture - not both */
 	if (bat->playback.single && bat->capture.single) {
 		loge(E_MSG_PARAMS, "single ended mode is simplex");
 		return -EINVAL;
 	}
 
+	/* check the sine generator */
+	if (bat->sinearg) {
+		if (strcmp(bat->sinearg, "fast") == 0) {
+			bat->sine_fast = true;
+		} else if (strcmp(bat->sinearg, "exact") != 0) {
+			loge(E_MSG_PARAMS, "unknown sine generator %s",
+					bat->sinearg);
+			return -EINVAL;
+		}
+	}
+
 	/* check sine wave frequency range*/
 	freq_low = DC_THRESHOLD;
 	freq_high = bat->rate * RATE_FACTOR;
@@ -405,6 +516,8 @@ static int bat_init(struct bat *bat)
 	/* Determine capture file */
 	if (bat->local)
 		bat->capture.file = bat->playback.file;
+	else if (bat->savecap || bat->stream)
+		bat->capture.file = bat->savecap;
 	else
 		bat->capture.file = TEMP_RECORD_FILE_NAME;
 
@@ -447,18 +560,22 @@ static int bat_init(struct bat *bat)
 	switch (bat->sample_size) {
 	case 1:
 		bat->convert_float_to_sample = convert_float_to_int8;
+		bat->convert_sample_to_float = convert_int8_to_float;
 		bat->convert_sample_to_double = convert_int8_to_double;
 		break;
 	case 2:
 		bat->convert_float_to_sample = convert_float_to_int16;
+		bat->convert_sample_to_float = convert_int16_to_float;
 		bat->convert_sample_to_double = convert_int16_to_double;
 		break;
 	case 3:
 		bat->convert_float_to_sample = convert_float_to_int24;
+		bat->convert_sample_to_float = NULL;
 		bat->convert_sample_to_double = convert_int24_to_double;
 		break;
 	case 4:
 		bat->convert_float_to_sample = convert_float_to_int32;
+		bat->convert_sample_to_float = NULL;
 		bat->convert_sample_to_double = convert_int32_to_double;
 		break;
 	default:
@@ -472,7 +589,7 @@ static int bat_init(struct bat *bat)
 int main(int argc, char *argv[])
 {
 	struct bat bat;
-	int ret = 0;
+	int ret = 0, err;
 
 	set_defaults(&bat);
 
@@ -488,12 +605,26 @@ int main(int argc, char *argv[])
 	if (ret < 0)
 		goto out;
 
+	analyze_init(&bat);
+
 	/* single line playback thread: playback only, no capture */
 	if (bat.playback.single) {
 		test_playback(&bat);
 		goto out;
 	}
 
+	if (bat.glitch) {
+		ret = glitch_start(&bat);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (bat.stream) {
+		ret = stream_start(&bat);
+		if (ret < 0)
+			goto out;
+	}
+
 	/* single line capture thread: capture only, no playback */
 	if (bat.capture.single) {
 		test_capture(&bat);
@@ -505,8 +636,17 @@ int main(int argc, char *argv[])
 		test_loopback(&bat);
 
 analyze:
-	ret = analyze_capture(&bat);
+	if (bat.stream)
+		ret = stream_finish(&bat);
+	else
+		ret = analyze_capture(&bat);
+	if (bat.glitch) {
+		err = glitch_finish(&bat);
+		if (ret == 0)
+			ret = err;
+	}
 out:
+	analyze_done(&bat);
 	fprintf(bat.log, "\nReturn value is %d\n", ret);
 	if (bat.logarg)
 		fclose(bat.log);
@@ -18,6 +18,15 @@
 #define OPT_BASE			300
 #define OPT_LOG				(OPT_BASE + 1)
 #define OPT_SAVEPLAY			(OPT_BASE + 2)
+#define OPT_SAVECAP			(OPT_BASE + 3)
+#define OPT_STREAM			(OPT_BASE + 4)
+#define OPT_WINDOW			(OPT_BASE + 5)
+#define OPT_WISDOM			(OPT_BASE + 6)
+#define OPT_SINE			(OPT_BASE + 7)
+#define OPT_THD				(OPT_BASE + 8)
+#define OPT_THDN			(OPT_BASE + 9)
+#define OPT_SNR				(OPT_BASE + 10)
+#define OPT_GLITCH			(OPT_BASE + 11)
 
 #define COMPOSE(a, b, c, d)		((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define WAV_RIFF			COMPOSE('R', 'I', 'F', 'F')
@@ -26,9 +35,10 @@
 #define WAV_DATA			COMPOSE('d', 'a', 't', 'a')
 #define WAV_FORMAT_PCM			1	/* PCM WAVE file encoding */
 
-#define MAX_CHANNELS			2
+#define MAX_CHANNELS			32
 #define MIN_CHANNELS			1
 #define MAX_PEAKS			10
+#define MAX_HARMONICS			10
 #define MAX_FRAMES			(10 * 1024 * 1024)
 /* Given in ms */
 #define CAPTURE_DELAY			500
@@ -40,11 +50,15 @@
 #define MAX_BUFFERTIME			500000
 /* devide factor, was 4, changed to 8 to remove reduce capture overrun */
 #define DIV_BUFFERTIME			8
+/* streaming ring size in analysis windows */
+#define STREAM_WINDOWS			4
 
 #define EBATBASE			1000
 #define ENOPEAK				(EBATBASE + 1)
 #define EONLYDC				(EBATBASE + 2)
 #define EBADPEAK			(EBATBASE + 3)
+#define EBADQUALITY			(EBATBASE + 4)
+#define EGLITCH				(EBATBASE + 5)
 
 #define DC_THRESHOLD			7.01
 
@@ -71,6 +85,8 @@
 #define E_MSG_JOINTHREADC		"Can't join capture thread: "
 #define E_MSG_EXITTHREADP		"Exit playback thread fail: "
 #define E_MSG_EXITTHREADC		"Exit capture thread fail: "
+#define E_MSG_NEWTHREADA		"Can't create analysis thread: "
+#define E_MSG_JOINTHREADA		"Can't join analysis thread: "
 /* pcm device error message */
 #define E_MSG_OPENPCMP			"Can't open PCM playback device: "
 #define E_MSG_OPENPCMC			"Can't open PCM capture device: "
@@ -140,6 +156,9 @@ struct wav_container {
 };
 
 struct bat;
+struct stream;
+struct glitch;
+struct fft;
 
 struct pcm {
 	char *device;
@@ -151,17 +170,34 @@ struct pcm {
 struct bat {
 	unsigned int rate;	/* sampling rate */
 	int channels;		/* nb of channels */
-	int frames;		/* nb of frames */
+	long long frames;	/* nb of frames */
 	int frame_size;		/* size of frame */
 	int sample_size;	/* size of sample */
 
 	float sigma_k;		/* threshold for peak detection */
 	float target_freq[MAX_CHANNELS];
-
-	int sinus_duration;	/* number of frames for playback */
+	float max_thd;		/* THD limit in dB, NAN if not checked */
+	float max_thdn;		/* THD+N limit in dB, NAN if not checked */
+	float min_snr;		/* SNR limit in dB, NAN if not checked */
+
+	long long sinus_duration;	/* number of frames for playback */
+	char *sinearg;		/* argument string of sine generator */
+	bool sine_fast;		/* wavetable instead of exact generator */
+	double sine_phase[MAX_CHANNELS];	/* generator phase in cycles */
 	char *narg;		/* argument string of duration */
 	char *logarg;		/* path name of log file */
 	char *debugplay;	/* path name to store playback signal */
+	char *savecap;		/* path name to store capture signal */
+
+	bool stream;		/* analyse while capturing */
+	int window;		/* frames of one analysis window */
+	struct stream *ring;	/* capture to analysis ring */
+
+	bool glitch;		/* detect glitches while capturing */
+	struct glitch *glitches;	/* glitch detector state */
+
+	char *wisdom;		/* path name of FFTW wisdom file */
+	struct fft *fft;	/* cached FFT plan */
 
 	struct pcm playback;
 	struct pcm capture;
@@ -172,8 +208,10 @@ struct bat {
 	FILE *fp;
 	FILE *log;
 
-	double (*convert_sample_to_double)(void *, int);
-	void (*convert_float_to_sample)(float, void *);
+	/* block converters, the float one is set for 8 and 16 bit only */
+	void (*convert_sample_to_float)(const void *, float *, int);
+	void (*convert_sample_to_double)(const void *, double *, int);
+	void (*convert_float_to_sample)(const float *, void *, int);
 
 	void *buf;		/* PCM Buffer */
 
@@ -182,9 +220,9 @@ struct bat {
 
 struct analyze {
 	void *buf;
-	double *in;
-	double *out;
+	int frames;	/* analysed frames per channel */
 	double *mag;
+	FILE *log;	/* channel log */
 };
 
 void close_file(FILE *);
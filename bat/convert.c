@@ -17,54 +17,249 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-double convert_int8_to_double(void *buf, int i)
+/*
+ * The converters process a whole block of samples, the loops are kept
+ * simple and free of aliasing so that the compiler vectorizes them.
+ */
+
+void convert_int8_to_float(const void *buf, float *restrict dst, int n)
+{
+	const int8_t *restrict s = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = s[i];
+}
+
+void convert_int16_to_float(const void *buf, float *restrict dst, int n)
+{
+	const int16_t *restrict s = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = s[i];
+}
+
+void convert_int8_to_double(const void *buf, double *restrict dst, int n)
+{
+	const int8_t *restrict s = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = s[i];
+}
+
+void convert_int16_to_double(const void *buf, double *restrict dst, int n)
+{
+	const int16_t *restrict s = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = s[i];
+}
+
+void convert_int24_to_double(const void *buf, double *restrict dst, int n)
+{
+	const uint8_t *restrict s = buf;
+	int32_t tmp;
+	int i;
+
+	for (i = 0; i < n; i++, s += 3) {
+		tmp = (uint32_t) s[2] << 24 | (uint32_t) s[1] << 16 |
+				(uint32_t) s[0] << 8;
+		dst[i] = tmp >> 8;
+	}
+}
+
+void convert_int32_to_double(const void *buf, double *restrict dst, int n)
+{
+	const int32_t *restrict s = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = s[i];
+}
+
+void convert_float_to_int8(const float *restrict src, void *buf, int n)
 {
-	return ((int8_t *) buf)[i];
+	int8_t *restrict d = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = (int8_t) src[i];
 }
 
-double convert_int16_to_double(void *buf, int i)
+void convert_float_to_int16(const float *restrict src, void *buf, int n)
 {
-	return ((int16_t *) buf)[i];
+	int16_t *restrict d = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = (int16_t) src[i];
 }
 
-double convert_int24_to_double(void *buf, int i)
+void convert_float_to_int24(const float *restrict src, void *buf, int n)
 {
+	uint8_t *restrict d = buf;
 	int32_t tmp;
+	int i;
+
+	for (i = 0; i < n; i++, d += 3) {
+		tmp = (int32_t) src[i];
+		d[0] = tmp & 0xff;
+		d[1] = (tmp >> 8) & 0xff;
+		d[2] = (tmp >> 16) & 0xff;
+	}
+}
+
+void convert_float_to_int32(const float *restrict src, void *buf, int n)
+{
+	int32_t *restrict d = buf;
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] = (int32_t) src[i];
+}
+
+/*
+ * Deinterleave kernels, one per sample width. The channel c of the
+ * frames is written at dst + c * stride samples. The stereo 16 and
+ * 32 bit captures are the common case and they use SIMD shuffles.
+ */
 
-	tmp = ((uint8_t *) buf)[i * 3 + 2] << 24;
-	tmp |= ((uint8_t *) buf)[i * 3 + 1] << 16;
-	tmp |= ((uint8_t *) buf)[i * 3] << 8;
-	tmp >>= 8;
-	return tmp;
+static int deinterleave_stereo16(int16_t *l, int16_t *r, const int16_t *s,
+		int frames)
+{
+	int j = 0;
+
+#if defined(__SSE2__)
+	__m128i a, b;
+
+	for (; j + 8 <= frames; j += 8, s += 16) {
+		a = _mm_loadu_si128((const __m128i *) s);
+		b = _mm_loadu_si128((const __m128i *) (s + 8));
+		/* the left sample is in the low half of each frame */
+		_mm_storeu_si128((__m128i *) (l + j), _mm_packs_epi32(
+				_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+				_mm_srai_epi32(_mm_slli_epi32(b, 16), 16)));
+		_mm_storeu_si128((__m128i *) (r + j), _mm_packs_epi32(
+				_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+	}
+#elif defined(__ARM_NEON)
+	int16x8x2_t v;
+
+	for (; j + 8 <= frames; j += 8, s += 16) {
+		v = vld2q_s16(s);
+		vst1q_s16(l + j, v.val[0]);
+		vst1q_s16(r + j, v.val[1]);
+	}
+#endif
+	return j;
 }
 
-double convert_int32_to_double(void *buf, int i)
+static int deinterleave_stereo32(int32_t *l, int32_t *r, const int32_t *s,
+		int frames)
 {
-	return ((int32_t *) buf)[i];
+	int j = 0;
+
+#if defined(__SSE2__)
+	__m128 a, b;
+
+	for (; j + 4 <= frames; j += 4, s += 8) {
+		a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) s));
+		b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) (s + 4)));
+		_mm_storeu_si128((__m128i *) (l + j), _mm_castps_si128(
+				_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))));
+		_mm_storeu_si128((__m128i *) (r + j), _mm_castps_si128(
+				_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+	}
+#elif defined(__ARM_NEON)
+	int32x4x2_t v;
+
+	for (; j + 4 <= frames; j += 4, s += 8) {
+		v = vld2q_s32(s);
+		vst1q_s32(l + j, v.val[0]);
+		vst1q_s32(r + j, v.val[1]);
+	}
+#endif
+	return j;
 }
 
-void convert_float_to_int8(float sinus, void *buf)
+static void deinterleave8(int8_t *dst, int stride, const int8_t *src,
+		int frames, int channels)
 {
-	*((int8_t *) buf) = (int8_t) (sinus);
+	int c, j;
+
+	for (j = 0; j < frames; j++)
+		for (c = 0; c < channels; c++)
+			dst[c * stride + j] = *src++;
+}
+
+static void deinterleave16(int16_t *dst, int stride, const int16_t *src,
+		int frames, int channels)
+{
+	int c, j = 0;
+
+	if (channels == 2) {
+		j = deinterleave_stereo16(dst, dst + stride, src, frames);
+		src += j * 2;
+	}
+	for (; j < frames; j++)
+		for (c = 0; c < channels; c++)
+			dst[c * stride + j] = *src++;
 }
 
-void convert_float_to_int16(float sinus, void *buf)
+static void deinterleave24(uint8_t *dst, int stride, const uint8_t *src,
+		int frames, int channels)
 {
-	*((int16_t *) buf) = (int16_t) (sinus);
+	uint8_t *d;
+	int c, j;
+
+	for (j = 0; j < frames; j++) {
+		for (c = 0; c < channels; c++, src += 3) {
+			d = dst + (c * stride + j) * 3;
+			d[0] = src[0];
+			d[1] = src[1];
+			d[2] = src[2];
+		}
+	}
 }
 
-void convert_float_to_int24(float sinus, void *buf)
+static void deinterleave32(int32_t *dst, int stride, const int32_t *src,
+		int frames, int channels)
 {
-	int32_t sinus_f_i;
+	int c, j = 0;
 
-	sinus_f_i = (int32_t) sinus;
-	*((int8_t *) (buf + 0)) = (int8_t) (sinus_f_i & 0xff);
-	*((int8_t *) (buf + 1)) = (int8_t) ((sinus_f_i >> 8) & 0xff);
-	*((int8_t *) (buf + 2)) = (int8_t) ((sinus_f_i >> 16) & 0xff);
+	if (channels == 2) {
+		j = deinterleave_stereo32(dst, dst + stride, src, frames);
+		src += j * 2;
+	}
+	for (; j < frames; j++)
+		for (c = 0; c < channels; c++)
+			dst[c * stride + j] = *src++;
 }
 
-void convert_float_to_int32(float sinus, void *buf)
+void deinterleave(void *dst, int stride, const void *src, int frames,
+		int channels, int width)
 {
-	*((int32_t *) buf) = (int32_t) (sinus);
+	switch (width) {
+	case 1:
+		deinterleave8(dst, stride, src, frames, channels);
+		break;
+	case 2:
+		deinterleave16(dst, stride, src, frames, channels);
+		break;
+	case 3:
+		deinterleave24(dst, stride, src, frames, channels);
+		break;
+	case 4:
+		deinterleave32(dst, stride, src, frames, channels);
+		break;
+	}
 }
@@ -13,11 +13,14 @@
  *
  */
 
-double convert_int8_to_double(void *, int);
-double convert_int16_to_double(void *, int);
-double convert_int24_to_double(void *, int);
-double convert_int32_to_double(void *, int);
-void convert_float_to_int8(float, void *);
-void convert_float_to_int16(float, void *);
-void convert_float_to_int24(float, void *);
-void convert_float_to_int32(float, void *);
+void convert_int8_to_float(const void *, float *, int);
+void convert_int16_to_float(const void *, float *, int);
+void convert_int8_to_double(const void *, double *, int);
+void convert_int16_to_double(const void *, double *, int);
+void convert_int24_to_double(const void *, double *, int);
+void convert_int32_to_double(const void *, double *, int);
+void convert_float_to_int8(const float *, void *, int);
+void convert_float_to_int16(const float *, void *, int);
+void convert_float_to_int24(const float *, void *, int);
+void convert_float_to_int32(const float *, void *, int);
+void deinterleave(void *, int, const void *, int, int, int);
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2013-2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+
+#include "common.h"
+#include "glitch.h"
+
+/*
+ * The capture is compared with the generated sine while recording. Each
+ * block is fitted by least squares to a sine of the target frequency and
+ * the fit predicts every sample of the next block. A sample too far from
+ * the prediction starts an event, the fit of the block after the event
+ * tells what happened: the phase moved forward (frames skipped), moved
+ * back (frames repeated, modulo one sine period) or did not move (a
+ * discontinuity). A run of silent samples is a dropout. The oscillator
+ * follows the phase drift between the playback and capture clocks.
+ * Only the state of the channels is kept, the memory does not grow with
+ * the length of the run.
+ */
+
+#define GLITCH_BLOCK_MS		100
+#define GLITCH_SIGMA		10.0	/* threshold in residual rms */
+#define GLITCH_FLOOR		1e-3	/* threshold floor, of the amplitude */
+#define GLITCH_LOCK_SNR		100.0	/* fit to residual power to lock */
+#define GLITCH_LOCK_DELTA	0.05	/* fit change between locked blocks */
+#define GLITCH_LOGGED		100	/* printed events, others are counted */
+
+enum {
+	GLITCH_SKIP,
+	GLITCH_REPEAT,
+	GLITCH_DISCONTINUITY,
+	GLITCH_DROPOUT,
+	GLITCH_TYPES,
+};
+
+static const char *const glitch_names[GLITCH_TYPES] = {
+	"skip", "repeat", "discontinuity", "dropout",
+};
+
+enum {
+	CHAN_LOCKING,		/* waiting for two consistent blocks */
+	CHAN_LOCKED,		/* predicting the samples */
+	CHAN_SETTLING,		/* after an event, the next block decides */
+};
+
+struct glitch_chan {
+	int state;
+	bool locked;		/* locked at least once */
+	double step;		/* oscillator radians per frame */
+	double lo;		/* oscillator phase at the block start */
+	double c, s, dc, ds;	/* oscillator at the current frame, step */
+	double a, b;		/* sine = a * s + b * c of the last fit */
+	double thresh;		/* residual threshold */
+	double xs, xc, ss, cc, sc, xx;	/* least squares sums */
+	long long start;	/* first frame of the candidate lock */
+	long long event;	/* frame of the pending event, -1 if none */
+	long long lost;		/* frame the signal was lost, -1 if none */
+	int silent;		/* current run of silent samples */
+	int silent_max;		/* longest silent run of the event */
+};
+
+struct glitch {
+	long long frame;	/* analysed frames */
+	int block;		/* frames per block */
+	int pos;		/* frames in the current block */
+	double *buf;		/* converted period */
+	int buf_frames;
+	unsigned int events[GLITCH_TYPES];
+	unsigned int logged;
+	struct glitch_chan ch[MAX_CHANNELS];
+};
+
+static double wrap_phase(double p)
+{
+	return p - 2.0 * M_PI * floor((p + M_PI) / (2.0 * M_PI));
+}
+
+static void glitch_event(struct bat *bat, int type, int channel,
+		long long frame, double value)
+{
+	struct glitch *g = bat->glitches;
+	double t = (double) frame / bat->rate;
+	int h = t / 3600, m = (t - h * 3600) / 60;
+
+	g->events[type]++;
+	if (g->logged++ == GLITCH_LOGGED)
+		fprintf(bat->log, "Further glitches are only counted\n");
+	if (g->logged > GLITCH_LOGGED)
+		return;
+
+	/* the shift is only known modulo the sine period */
+	if (type == GLITCH_SKIP || type == GLITCH_REPEAT)
+		fprintf(bat->log, "Channel %i at %02d:%02d:%06.3f (frame %lld): %s of %.1f frames (modulo %.1f)\n",
+				channel + 1, h, m, t - h * 3600 - m * 60,
+				frame, glitch_names[type], fabs(value),
+				2.0 * M_PI / g->ch[channel].step);
+	else if (type == GLITCH_DROPOUT)
+		fprintf(bat->log, "Channel %i at %02d:%02d:%06.3f (frame %lld): %s of %.1f ms\n",
+				channel + 1, h, m, t - h * 3600 - m * 60,
+				frame, glitch_names[type],
+				value * 1000.0 / bat->rate);
+	else
+		fprintf(bat->log, "Channel %i at %02d:%02d:%06.3f (frame %lld): %s\n",
+				channel + 1, h, m, t - h * 3600 - m * 60,
+				frame, glitch_names[type]);
+}
+
+static void chan_samples(struct glitch *g, struct glitch_chan *ch,
+		const double *x, int stride, int n)
+{
+	double r, t;
+	int k;
+
+	for (k = 0; k < n; k++, x += stride) {
+		if (ch->state == CHAN_LOCKED && ch->event < 0) {
+			r = *x - (ch->a * ch->s + ch->b * ch->c);
+			if (fabs(r) > ch->thresh) {
+				ch->event = g->frame + k;
+				ch->silent = ch->silent_max = 0;
+			}
+		}
+		if (ch->event >= 0) {
+			if (fabs(*x) <= ch->thresh) {
+				if (++ch->silent > ch->silent_max)
+					ch->silent_max = ch->silent;
+			} else {
+				ch->silent = 0;
+			}
+		}
+
+		ch->xs += *x * ch->s;
+		ch->xc += *x * ch->c;
+		ch->ss += ch->s * ch->s;
+		ch->cc += ch->c * ch->c;
+		ch->sc += ch->s * ch->c;
+		ch->xx += *x * *x;
+
+		t = ch->c * ch->dc - ch->s * ch->ds;
+		ch->s = ch->s * ch->dc + ch->c * ch->ds;
+		ch->c = t;
+	}
+}
+
+/* adopt the fit as the prediction of the next block */
+static void chan_adopt(struct glitch_chan *ch, double a, double b,
+		double res, int frames)
+{
+	double amp = hypot(a, b), rms = sqrt(res / frames);
+
+	ch->a = a;
+	ch->b = b;
+	ch->thresh = GLITCH_SIGMA * rms;
+	if (ch->thresh < GLITCH_FLOOR * amp)
+		ch->thresh = GLITCH_FLOOR * amp;
+}
+
+/*
+ * Correct the oscillator step by the phase change since the last fit,
+ * the fit is the phase in the block middle so the prediction of the
+ * next block is half a block further
+ */
+static double chan_track(struct glitch_chan *ch, double a, double b,
+		double res, int frames)
+{
+	double dphi = wrap_phase(atan2(b, a) - atan2(ch->b, ch->a));
+	double c = cos(dphi / 2), s = sin(dphi / 2);
+
+	ch->step += dphi / frames;
+	ch->dc = cos(ch->step);
+	ch->ds = sin(ch->step);
+	chan_adopt(ch, a * c - b * s, a * s + b * c, res, frames);
+
+	return dphi;
+}
+
+/* silent samples of a sine around its zero crossings */
+static int chan_silent_limit(struct glitch_chan *ch)
+{
+	double amp = hypot(ch->a, ch->b);
+
+	return 2 + (int) (2.0 * ch->thresh / (amp * ch->step));
+}
+
+static void chan_block(struct bat *bat, int channel, int frames)
+{
+	struct glitch *g = bat->glitches;
+	struct glitch_chan *ch = &g->ch[channel];
+	long long start = g->frame - frames;
+	double det, a = 0.0, b = 0.0, fit, res, amp, dphi;
+	bool good;
+
+	/* the oscillator ran the whole block with the current step */
+	ch->lo = fmod(ch->lo + ch->step * frames, 2.0 * M_PI);
+
+	det = ch->ss * ch->cc - ch->sc * ch->sc;
+	if (det > 0.0) {
+		a = (ch->xs * ch->cc - ch->xc * ch->sc) / det;
+		b = (ch->xc * ch->ss - ch->xs * ch->sc) / det;
+	}
+	fit = a * ch->xs + b * ch->xc;
+	res = ch->xx - fit;
+	if (res < 0.0)
+		res = 0.0;
+	good = fit > 0.0 && fit > GLITCH_LOCK_SNR * res;
+
+	switch (ch->state) {
+	case CHAN_LOCKING:
+		if (!good) {
+			ch->start = -1;
+			break;
+		}
+		if (ch->start < 0) {
+			ch->start = start;
+			chan_adopt(ch, a, b, res, frames);
+			break;
+		}
+		/* lock when the level and the frequency are stable */
+		amp = hypot(ch->a, ch->b);
+		dphi = chan_track(ch, a, b, res, frames);
+		if (fabs(hypot(a, b) - amp) > GLITCH_LOCK_DELTA * amp) {
+			ch->start = start;
+		} else if (fabs(dphi) < GLITCH_LOCK_DELTA) {
+			if (ch->lost >= 0)
+				glitch_event(bat, GLITCH_DROPOUT, channel,
+						ch->lost, ch->start - ch->lost);
+			ch->lost = -1;
+			ch->locked = true;
+			ch->state = CHAN_LOCKED;
+		}
+		break;
+	case CHAN_LOCKED:
+		if (ch->event >= 0) {
+			ch->state = CHAN_SETTLING;
+			break;
+		}
+		if (!good) {
+			ch->lost = start;
+			ch->start = -1;
+			ch->state = CHAN_LOCKING;
+			break;
+		}
+		/* follow the drift of the playback and capture clocks */
+		chan_track(ch, a, b, res, frames);
+		break;
+	case CHAN_SETTLING:
+		if (!good) {
+			ch->lost = ch->event;
+			ch->start = -1;
+			ch->state = CHAN_LOCKING;
+		} else if (ch->silent_max > chan_silent_limit(ch)) {
+			glitch_event(bat, GLITCH_DROPOUT, channel, ch->event,
+					ch->silent_max);
+		} else {
+			dphi = wrap_phase(atan2(b, a) - atan2(ch->b, ch->a));
+			dphi /= ch->step;
+			if (dphi >= 0.5)
+				glitch_event(bat, GLITCH_SKIP, channel,
+						ch->event, dphi);
+			else if (dphi <= -0.5)
+				glitch_event(bat, GLITCH_REPEAT, channel,
+						ch->event, dphi);
+			else
+				glitch_event(bat, GLITCH_DISCONTINUITY,
+						channel, ch->event, 0.0);
+		}
+		if (good) {
+			chan_adopt(ch, a, b, res, frames);
+			ch->state = CHAN_LOCKED;
+		}
+		ch->event = -1;
+		break;
+	}
+
+	/* restart the oscillator from the accumulated phase */
+	ch->c = cos(ch->lo);
+	ch->s = sin(ch->lo);
+	ch->xs = ch->xc = ch->ss = ch->cc = ch->sc = ch->xx = 0.0;
+}
+
+int glitch_start(struct bat *bat)
+{
+	struct glitch *g;
+	struct glitch_chan *ch;
+	int c;
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return -ENOMEM;
+	g->block = bat->rate * GLITCH_BLOCK_MS / 1000;
+	for (c = 0; c < bat->channels; c++) {
+		ch = &g->ch[c];
+		ch->step = 2.0 * M_PI * bat->target_freq[c] / bat->rate;
+		ch->dc = cos(ch->step);
+		ch->ds = sin(ch->step);
+		ch->c = 1.0;
+		ch->start = ch->event = ch->lost = -1;
+	}
+	bat->glitches = g;
+
+	fprintf(bat->log, "\nBAT detects glitches in blocks of %d frames\n",
+			g->block);
+
+	return 0;
+}
+
+/* called from the capture thread with each period */
+void glitch_write(struct bat *bat, const void *buf, int frames)
+{
+	struct glitch *g = bat->glitches;
+	double *p;
+	int c, n, done = 0;
+
+	if (frames > g->buf_frames) {
+		p = realloc(g->buf, sizeof(double) * frames * bat->channels);
+		if (p == NULL) {
+			loge(E_MSG_MALLOC, "size=%zd",
+				sizeof(double) * frames * bat->channels);
+			return;
+		}
+		g->buf = p;
+		g->buf_frames = frames;
+	}
+	bat->convert_sample_to_double(buf, g->buf, frames * bat->channels);
+
+	while (done < frames) {
+		n = frames - done;
+		if (n > g->block - g->pos)
+			n = g->block - g->pos;
+		for (c = 0; c < bat->channels; c++)
+			chan_samples(g, &g->ch[c],
+					g->buf + done * bat->channels + c,
+					bat->channels, n);
+		g->frame += n;
+		g->pos += n;
+		done += n;
+		if (g->pos == g->block) {
+			for (c = 0; c < bat->channels; c++)
+				chan_block(bat, c, g->block);
+			g->pos = 0;
+		}
+	}
+}
+
+/* the capture is complete, print the summary and return the result */
+int glitch_finish(struct bat *bat)
+{
+	struct glitch *g = bat->glitches;
+	struct glitch_chan *ch;
+	unsigned int total = 0;
+	int c, t, ret = 0;
+
+	for (c = 0; c < bat->channels; c++) {
+		ch = &g->ch[c];
+		if (!ch->locked) {
+			fprintf(bat->log, "Channel %i: no sine found\n", c + 1);
+			ret = -ENOPEAK;
+		} else if (ch->lost >= 0) {
+			glitch_event(bat, GLITCH_DROPOUT, c, ch->lost,
+					g->frame - ch->lost);
+		}
+	}
+
+	fprintf(bat->log, "\nChecked %lld frames:", g->frame);
+	for (t = 0; t < GLITCH_TYPES; t++) {
+		fprintf(bat->log, " %u %s%s", g->events[t], glitch_names[t],
+				t < GLITCH_TYPES - 1 ? "," : "\n");
+		total += g->events[t];
+	}
+	if (ret == 0 && total > 0)
+		ret = -EGLITCH;
+
+	free(g->buf);
+	free(g);
+	bat->glitches = NULL;
+
+	return ret;
+}
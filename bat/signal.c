@@ -18,26 +18,100 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common.h"
 
+/* samples generated before each block conversion */
+#define SINE_BLOCK	1024
+
+/* wavetable of one sine period for the fast generator */
+#define SINE_TABLE_BITS	10
+#define SINE_TABLE	(1 << SINE_TABLE_BITS)
+#define SINE_FRAC_BITS	(32 - SINE_TABLE_BITS)
+
+static float sine_table[SINE_TABLE + 1];
+static bool sine_table_ready;
+
+static void sine_table_init(void)
+{
+	int k;
+
+	for (k = 0; k <= SINE_TABLE; k++)
+		sine_table[k] = sin(2.0 * M_PI * k / SINE_TABLE);
+	sine_table_ready = true;
+}
+
+/*
+ * Rotate the phasor by the frequency step, the phasor is computed from
+ * the phase accumulator at each call so the error does not build up
+ */
+static void sine_exact(float *dst, int stride, int n, double phase,
+		double step, float max)
+{
+	double c = cos(2.0 * M_PI * phase), s = sin(2.0 * M_PI * phase);
+	double dc = cos(2.0 * M_PI * step), ds = sin(2.0 * M_PI * step);
+	double t;
+	int k;
+
+	for (k = 0; k < n; k++) {
+		dst[k * stride] = s * max;
+		t = c * dc - s * ds;
+		s = s * dc + c * ds;
+		c = t;
+	}
+}
+
+/* 32 bit phase accumulator with linear interpolation of the wavetable */
+static void sine_fast(float *dst, int stride, int n, double phase,
+		double step, float max)
+{
+	uint32_t p, inc, idx;
+	float frac;
+	int k;
+
+	/* wrap before the conversion, 1.0 does not fit 32 bits */
+	phase -= floor(phase);
+	step -= floor(step);
+	p = (uint32_t) (uint64_t) (phase * 4294967296.0);
+	inc = (uint32_t) (uint64_t) (step * 4294967296.0 + 0.5);
+
+	for (k = 0; k < n; k++) {
+		idx = p >> SINE_FRAC_BITS;
+		frac = (p & ((1 << SINE_FRAC_BITS) - 1))
+				* (1.0f / (1 << SINE_FRAC_BITS));
+		dst[k * stride] = (sine_table[idx] + (sine_table[idx + 1]
+				- sine_table[idx]) * frac) * max;
+		p += inc;
+	}
+}
+
 void generate_sine_wave(struct bat *bat, int length, void *buf, int max)
 {
-	static int i;
-	int k, c;
-	float sin_val[MAX_CHANNELS], sinus_f;
+	float block[SINE_BLOCK];
+	int block_frames = SINE_BLOCK / bat->channels;
+	double step;
+	int c, n;
 
-	for (c = 0; c < bat->channels; c++)
-		sin_val[c] = (float) bat->target_freq[c] / (float) bat->rate;
+	if (bat->sine_fast && !sine_table_ready)
+		sine_table_init();
 
-	for (k = 0; k < length; k++) {
+	while (length > 0) {
+		n = length < block_frames ? length : block_frames;
 		for (c = 0; c < bat->channels; c++) {
-			sinus_f = sinf(i * 2.0 * M_PI * sin_val[c]) * max;
-			bat->convert_float_to_sample(sinus_f, buf);
-			buf += bat->sample_size;
+			step = (double) bat->target_freq[c] / bat->rate;
+			if (bat->sine_fast)
+				sine_fast(block + c, bat->channels, n,
+						bat->sine_phase[c], step, max);
+			else
+				sine_exact(block + c, bat->channels, n,
+						bat->sine_phase[c], step, max);
+			/* the phase is kept in cycles, wrapped to [0, 1) */
+			bat->sine_phase[c] += n * step;
+			bat->sine_phase[c] -= floor(bat->sine_phase[c]);
 		}
-		i += 1;
-		if (i == bat->rate)
-			i = 0; /* Restart from 0 after one sine wave period */
+		bat->convert_float_to_sample(block, buf, n * bat->channels);
+		buf += n * bat->frame_size;
+		length -= n;
 	}
 }
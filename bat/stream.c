@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2013-2015 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "analyze.h"
+#include "convert.h"
+#include "stream.h"
+
+/*
+ * The capture thread passes the periods to the analysis thread through
+ * a ring. Each window is analysed as soon as it is complete, the next
+ * window starts half a window later. The capture never waits: when the
+ * ring is full, the periods are dropped until the analysis catches up
+ * and the analysis restarts with the new data.
+ */
+struct stream {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;
+	size_t size;		/* ring size in bytes */
+	size_t head;		/* written bytes */
+	size_t tail;		/* bytes of the current window start */
+	bool eof;
+	bool reset;		/* data dropped, restart from the head */
+	unsigned int overruns;
+	int windows;		/* analysed windows */
+	int ret;
+};
+
+/* copy one window from the ring, the channels are stored one by one */
+static void ring_copy(struct bat *bat, char *dst, size_t pos)
+{
+	struct stream *s = bat->ring;
+	int frames, r;
+
+	pos %= s->size;
+	frames = (s->size - pos) / bat->frame_size;
+	r = frames < bat->window ? frames : bat->window;
+	deinterleave(dst, bat->window, s->buf + pos, r, bat->channels,
+			bat->sample_size);
+	deinterleave(dst + r * bat->sample_size, bat->window, s->buf,
+			bat->window - r, bat->channels, bat->sample_size);
+}
+
+static void *stream_analysis(void *arg)
+{
+	struct bat *bat = arg;
+	struct stream *s = bat->ring;
+	size_t bytes = bat->window * bat->frame_size;
+	size_t hop = (bat->window / 2) * bat->frame_size;
+	char *win;
+	int err;
+
+	win = malloc(bytes);
+	if (win == NULL) {
+		s->ret = -ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		while (s->head - s->tail < bytes && !s->eof)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->head - s->tail < bytes)
+			break;
+		ring_copy(bat, win, s->tail);
+		pthread_mutex_unlock(&s->lock);
+
+		fprintf(bat->log, "\nWindow %d - frames %zu to %zu\n",
+				s->windows + 1, s->tail / bat->frame_size,
+				s->tail / bat->frame_size + bat->window);
+		err = analyze_window(bat, win, bat->window);
+		if (err != 0 && s->ret == 0)
+			s->ret = err;
+		s->windows++;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->reset) {
+			s->tail = s->head;
+			s->reset = false;
+		} else {
+			s->tail += hop;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	free(win);
+	return NULL;
+}
+
+int stream_start(struct bat *bat)
+{
+	struct stream *s;
+	size_t total = (size_t) bat->frames * bat->frame_size;
+	int err;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return -ENOMEM;
+
+	/* the whole capture fits when it is shorter than the ring */
+	s->size = (size_t) bat->window * bat->frame_size * STREAM_WINDOWS;
+	if (s->size > total)
+		s->size = total;
+	s->buf = malloc(s->size);
+	if (s->buf == NULL) {
+		loge(E_MSG_MALLOC, "size=%zd", s->size);
+		free(s);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	bat->ring = s;
+
+	fprintf(bat->log, "\nBAT analyses stream in windows of %d frames at",
+			bat->window);
+	fprintf(bat->log, " %d Hz, %d channels, %d bytes per sample.\n",
+			bat->rate, bat->channels, bat->sample_size);
+
+	err = pthread_create(&s->thread, NULL, stream_analysis, bat);
+	if (err != 0) {
+		loge(E_MSG_NEWTHREADA, "%d", err);
+		free(s->buf);
+		free(s);
+		bat->ring = NULL;
+		return -err;
+	}
+
+	return 0;
+}
+
+/* called from the capture thread, never blocks on the analysis */
+void stream_write(struct bat *bat, const void *buf, int bytes)
+{
+	struct stream *s = bat->ring;
+	size_t pos, r;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->reset || s->size - (s->head - s->tail) < bytes) {
+		if (!s->reset)
+			s->overruns++;
+		s->reset = true;
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	pos = s->head % s->size;
+	r = s->size - pos;
+	if (r > bytes)
+		r = bytes;
+	memcpy(s->buf + pos, buf, r);
+	memcpy(s->buf, (const char *) buf + r, bytes - r);
+	s->head += bytes;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* the capture is complete, analyse the rest and return the result */
+int stream_finish(struct bat *bat)
+{
+	struct stream *s = bat->ring;
+	int err, ret;
+
+	pthread_mutex_lock(&s->lock);
+	s->eof = true;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	err = pthread_join(s->thread, NULL);
+	if (err != 0) {
+		loge(E_MSG_JOINTHREADA, "%d", err);
+		return -err;
+	}
+
+	fprintf(bat->log, "\nAnalysed %d window(s), %u overrun(s)\n",
+			s->windows, s->overruns);
+	ret = s->ret;
+	if (s->windows == 0) {
+		loge(E_MSG_PARAMS, "captured less than one window");
+		ret = -EIO;
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s->buf);
+	free(s);
+	bat->ring = NULL;
+
+	return ret;
+}